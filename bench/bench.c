@@ -0,0 +1,635 @@
+/**
+ * Benchmarks
+ *
+ * Measures throughput and latency of the data structures under contention, next to a
+ * chained hash table behind one `pthread_mutex` as a baseline. `typed` is a map from
+ * `HASHMAP_TYPED` with the same keys as `hashmap`, and `cpp` is a `lockfree::HashMap`
+ * from `hashmap.hpp` with the same keys again. All three hash keys with splitmix64.
+ * Every combination of the options below is run for a fixed time, with each thread
+ * pinned to its own core where there are enough of them.
+ *
+ * Every operation is timed on its own and counted in a per-thread log-linear histogram,
+ * like an HDR histogram with `HIST_SUB_BITS` bits of precision, so percentiles are
+ * within 1% of the real latency. The timer costs some tens of nanoseconds, which is
+ * included in both the latencies and the throughput.
+ *
+ * Results are printed as CSV, one line per run, so runs of different releases can be
+ * compared with any tool. Progress goes to stderr.
+ *
+ *     ./bench -b hashmap,typed,cpp,mutex -t 1,2,4,8 -k 1000,1000000 -r 90,50 -d uniform,zipf -m 1000
+ */
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "free_later.h"
+#include "hashmap.h"
+#include "hashmap_typed.h"
+#include "list.h"
+#include "mempool.h"
+
+// histogram precision. values keep their top 7 bits, so buckets are at most 1/128 wide
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+// keys each thread draws before a run, and then cycles through
+#define KEY_STREAM 65536
+// skew of the Zipfian distribution, as used by YCSB
+#define ZIPF_THETA 0.99
+// adds or allocations a thread does before it hands the memory back, untimed
+#define WINDOW 1024
+// most threads in one run
+#define MAX_THREADS 256
+// most values per option
+#define MAX_LIST 32
+
+typedef enum {
+	BENCH_HASHMAP,
+	BENCH_TYPED,
+	BENCH_CPP,
+	BENCH_MUTEX,
+	BENCH_LIST,
+	BENCH_MEMPOOL,
+} bench_kind;
+
+static const char *bench_names[] = {"hashmap", "typed", "cpp", "mutex", "list_add", "mempool_alloc"};
+
+typedef enum {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+} dist_kind;
+
+static const char *dist_names[] = {"uniform", "zipf"};
+
+HASHMAP_TYPED(typedmap, uint64_t, void *, hashmap_typed_hash_u64, hashmap_typed_eq)
+
+// the `lockfree::HashMap` of `bench_cpp.cpp`
+void *cppmap_new(uint32_t hint);
+void cppmap_free(void *map);
+bool cppmap_get(void *map, uint64_t key, void **value);
+bool cppmap_put(void *map, uint64_t key, void *value);
+bool cppmap_del(void *map, uint64_t key);
+
+// chained table behind one lock, the baseline for `hashmap`
+typedef struct chain_node_s {
+	struct chain_node_s *next;
+	uint64_t key;
+	void *value;
+} chain_node;
+
+typedef struct chained_s {
+	pthread_mutex_t lock;
+	chain_node **buckets;
+	uint64_t mask;
+} chained;
+
+// one run
+typedef struct run_s {
+	bench_kind kind;
+	dist_kind dist;
+	uint32_t threads;
+	uint64_t keys;
+	// percent of operations that are gets. the rest are half puts and half deletes
+	uint32_t reads;
+	hashmap *map;
+	typedmap *typed;
+	void *cpp;
+	chained *table;
+	list *list;
+	mempool *pool;
+	// Zipfian constants for `keys`
+	double zeta;
+	double eta;
+} run;
+
+typedef struct worker_s {
+	pthread_t thread;
+	uint32_t id;
+	run *r;
+	uint64_t ops;
+	uint64_t *hist;
+	uint64_t *stream;
+	uint64_t rng;
+} __attribute__((aligned(64))) worker;
+
+static worker workers[MAX_THREADS];
+static pthread_barrier_t start;
+static volatile uint32_t stop = 0;
+// cores the process may run on, which threads are pinned to in turn
+static int cpus[CPU_SETSIZE];
+static int num_cpus = 0;
+
+
+static inline uint64_t
+now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Splitmix64's finalizer, which spreads consecutive integers over all 64 bits
+ */
+static inline uint64_t
+mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+// xorshift64*
+static inline uint64_t
+next_rand(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static inline uint32_t
+hist_index(uint64_t v) {
+	if (v < HIST_SUB) return v;
+	uint32_t shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (uint32_t)((v >> shift) - HIST_SUB);
+}
+
+/**
+ * Returns the largest value that falls in bucket `i`
+ */
+static uint64_t
+hist_value(uint32_t i) {
+	if (i < HIST_SUB) return i;
+	uint32_t shift = i / HIST_SUB - 1;
+	uint64_t sub = i % HIST_SUB + HIST_SUB;
+	return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Returns the value that `fraction` of the `total` recorded values are at or below
+ */
+static uint64_t
+hist_percentile(uint64_t *hist, uint64_t total, double fraction) {
+	uint64_t want = (uint64_t)ceil(total * fraction);
+	if (want == 0) want = 1;
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= want) return hist_value(i);
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+static double
+zeta(uint64_t n, double theta) {
+	double sum = 0;
+	for (uint64_t i = 1; i <= n; i++) {
+		sum += 1 / pow(i, theta);
+	}
+	return sum;
+}
+
+/**
+ * Draws a key from Gray et al.'s Zipfian generator, the one YCSB uses. Ranks are
+ * scrambled so that the hot keys don't sit in neighbouring buckets
+ */
+static uint64_t
+zipf_key(run *r, uint64_t *rng) {
+	double u = (double)(next_rand(rng) >> 11) / (double)(1ULL << 53);
+	double uz = u * r->zeta;
+	uint64_t rank;
+	if (uz < 1) {
+		rank = 0;
+	}
+	else if (uz < 1 + pow(0.5, ZIPF_THETA)) {
+		rank = 1;
+	}
+	else {
+		rank = (uint64_t)(r->keys * pow(r->eta * u - r->eta + 1, 1 / (1 - ZIPF_THETA)));
+	}
+	return mix64(rank) % r->keys;
+}
+
+/**
+ * Integer keys are stored in the pointer itself, plus one so that none is NULL
+ */
+static inline void *
+key_ptr(uint64_t key) {
+	return (void *)(uintptr_t)(key + 1);
+}
+
+static uint8_t
+cmp_key(const void *x, const void *y) {
+	return x != y;
+}
+
+static uint64_t
+hash_key(const void *key) {
+	return mix64((uintptr_t)key);
+}
+
+static chained *
+chained_new(uint64_t keys) {
+	chained *t = calloc(1, sizeof(chained));
+	uint64_t n = 1;
+	while (n < keys) n <<= 1;
+	t->buckets = calloc(n, sizeof(chain_node *));
+	t->mask = n - 1;
+	pthread_mutex_init(&t->lock, NULL);
+	return t;
+}
+
+static void *
+chained_get(chained *t, uint64_t key) {
+	void *value = NULL;
+	pthread_mutex_lock(&t->lock);
+	for (chain_node *n = t->buckets[mix64(key) & t->mask]; n; n = n->next) {
+		if (n->key == key) {
+			value = n->value;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+	return value;
+}
+
+static void
+chained_put(chained *t, uint64_t key, void *value) {
+	pthread_mutex_lock(&t->lock);
+	chain_node **bucket = &t->buckets[mix64(key) & t->mask];
+	for (chain_node *n = *bucket; n; n = n->next) {
+		if (n->key == key) {
+			n->value = value;
+			pthread_mutex_unlock(&t->lock);
+			return;
+		}
+	}
+	chain_node *n = malloc(sizeof(chain_node));
+	n->key = key;
+	n->value = value;
+	n->next = *bucket;
+	*bucket = n;
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void
+chained_del(chained *t, uint64_t key) {
+	pthread_mutex_lock(&t->lock);
+	for (chain_node **prev = &t->buckets[mix64(key) & t->mask]; *prev; prev = &(*prev)->next) {
+		if ((*prev)->key == key) {
+			chain_node *n = *prev;
+			*prev = n->next;
+			free(n);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void
+chained_free(chained *t) {
+	for (uint64_t i = 0; i <= t->mask; i++) {
+		chain_node *n = t->buckets[i];
+		while (n) {
+			chain_node *tofree = n;
+			n = n->next;
+			free(tofree);
+		}
+	}
+	pthread_mutex_destroy(&t->lock);
+	free(t->buckets);
+	free(t);
+}
+
+// times `op` and counts it in the worker's histogram
+#define TIMED(w, op) { \
+	uint64_t t0_ = now_ns(); \
+	op; \
+	(w)->hist[hist_index(now_ns() - t0_)]++; \
+	(w)->ops++; \
+}
+
+static void
+work_map(worker *w) {
+	run *r = w->r;
+	uint32_t i = 0;
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		uint64_t key = w->stream[i++ % KEY_STREAM];
+		uint64_t dice = next_rand(&w->rng);
+		bool read = dice % 100 < r->reads;
+		bool put = (dice >> 32) & 1;
+		if (r->kind == BENCH_HASHMAP) {
+			if (read) TIMED(w, hashmap_get(r->map, key_ptr(key)))
+			else if (put) TIMED(w, hashmap_put(r->map, key_ptr(key), key_ptr(key)))
+			else TIMED(w, hashmap_del(r->map, key_ptr(key)))
+		}
+		else if (r->kind == BENCH_TYPED) {
+			void *value;
+			if (read) TIMED(w, typedmap_get(r->typed, key, &value))
+			else if (put) TIMED(w, typedmap_put(r->typed, key, key_ptr(key), NULL))
+			else TIMED(w, typedmap_del(r->typed, key, NULL))
+		}
+		else if (r->kind == BENCH_CPP) {
+			void *value;
+			if (read) TIMED(w, cppmap_get(r->cpp, key, &value))
+			else if (put) TIMED(w, cppmap_put(r->cpp, key, key_ptr(key)))
+			else TIMED(w, cppmap_del(r->cpp, key))
+		}
+		else {
+			if (read) TIMED(w, chained_get(r->table, key))
+			else if (put) TIMED(w, chained_put(r->table, key, key_ptr(key)))
+			else TIMED(w, chained_del(r->table, key))
+		}
+	}
+}
+
+static void
+work_list(worker *w) {
+	run *r = w->r;
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		for (uint32_t i = 0; i < WINDOW; i++) {
+			TIMED(w, list_add(r->list, key_ptr(i)))
+		}
+		// keep the list from growing for the whole run
+		list_free_nodes(r->list, list_pop_all(r->list));
+	}
+}
+
+static void
+work_mempool(worker *w) {
+	run *r = w->r;
+	void *blocks[WINDOW];
+	uint32_t sizes[WINDOW];
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		for (uint32_t i = 0; i < WINDOW; i++) {
+			sizes[i] = 8 + next_rand(&w->rng) % 249;
+			TIMED(w, blocks[i] = mempool_alloc(r->pool, sizes[i]))
+		}
+		// hand the blocks back, so later windows are served from the free lists as well
+		// as from new memory
+		for (uint32_t i = 0; i < WINDOW; i++) {
+			mempool_release(r->pool, blocks[i], sizes[i]);
+		}
+	}
+}
+
+static void *
+work(void *args) {
+	worker *w = args;
+	if (num_cpus > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpus[w->id % num_cpus], &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	// draw the keys up front, so that drawing them isn't measured
+	for (uint32_t i = 0; i < KEY_STREAM && w->r->keys; i++) {
+		w->stream[i] = w->r->dist == DIST_ZIPF ? zipf_key(w->r, &w->rng) : next_rand(&w->rng) % w->r->keys;
+	}
+
+	pthread_barrier_wait(&start);
+	switch (w->r->kind) {
+	case BENCH_HASHMAP:
+	case BENCH_TYPED:
+	case BENCH_CPP:
+	case BENCH_MUTEX: work_map(w); break;
+	case BENCH_LIST: work_list(w); break;
+	case BENCH_MEMPOOL: work_mempool(w); break;
+	}
+	free_later_unregister();
+	return NULL;
+}
+
+/**
+ * Runs `r` for `ms` milliseconds and prints its line
+ */
+static void
+bench(run *r, uint32_t ms) {
+	fprintf(stderr, "%s %s keys=%lu reads=%u threads=%u\n", bench_names[r->kind], dist_names[r->dist], r->keys, r->reads, r->threads);
+	stop = 0;
+	pthread_barrier_init(&start, NULL, r->threads + 1);
+	for (uint32_t i = 0; i < r->threads; i++) {
+		worker *w = &workers[i];
+		w->id = i;
+		w->r = r;
+		w->ops = 0;
+		w->rng = mix64(i + 1);
+		memset(w->hist, 0, HIST_BUCKETS * sizeof(uint64_t));
+		if (pthread_create(&w->thread, NULL, work, w) != 0) {
+			fprintf(stderr, "Failed to create thread %u\n", i);
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start);
+	uint64_t began = now_ns();
+	struct timespec wait = {ms / 1000, (ms % 1000) * 1000000L};
+	while (nanosleep(&wait, &wait) == -1 && errno == EINTR);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	uint64_t ended = now_ns();
+
+	uint64_t ops = 0;
+	uint64_t *hist = calloc(HIST_BUCKETS, sizeof(uint64_t));
+	for (uint32_t i = 0; i < r->threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		for (uint32_t j = 0; j < HIST_BUCKETS; j++) {
+			hist[j] += workers[i].hist[j];
+		}
+	}
+	pthread_barrier_destroy(&start);
+
+	uint64_t max = 0;
+	for (uint32_t j = 0; j < HIST_BUCKETS; j++) {
+		if (hist[j]) max = hist_value(j);
+	}
+	double secs = (ended - began) / 1e9;
+	bool keyed = r->kind <= BENCH_MUTEX;
+	printf("%s,%s,%lu,%u,%u,%lu,%.3f,%.0f,%lu,%lu,%lu,%lu\n",
+		bench_names[r->kind], keyed ? dist_names[r->dist] : "", keyed ? r->keys : 0, keyed ? r->reads : 0,
+		r->threads, ops, secs, ops / secs,
+		hist_percentile(hist, ops, 0.5), hist_percentile(hist, ops, 0.99), hist_percentile(hist, ops, 0.999), max);
+	fflush(stdout);
+	free(hist);
+}
+
+/**
+ * Puts every key in the map or table, so each run starts full
+ */
+static void
+fill(run *r) {
+	for (uint64_t k = 0; k < r->keys; k++) {
+		if (r->kind == BENCH_HASHMAP) {
+			hashmap_put(r->map, key_ptr(k), key_ptr(k));
+		}
+		else if (r->kind == BENCH_TYPED) {
+			typedmap_put(r->typed, k, key_ptr(k), NULL);
+		}
+		else if (r->kind == BENCH_CPP) {
+			cppmap_put(r->cpp, k, key_ptr(k));
+		}
+		else {
+			chained_put(r->table, k, key_ptr(k));
+		}
+	}
+}
+
+/**
+ * Parses a comma separated list of numbers into `out` and returns how many there were
+ */
+static uint32_t
+parse_list(const char *arg, uint64_t *out) {
+	uint32_t n = 0;
+	char *end;
+	while (*arg && n < MAX_LIST) {
+		out[n++] = strtoull(arg, &end, 10);
+		if (*end != ',') break;
+		arg = end + 1;
+	}
+	return n;
+}
+
+static bool
+has(const char *list, const char *name) {
+	size_t len = strlen(name);
+	for (const char *p = strstr(list, name); p; p = strstr(p + 1, name)) {
+		if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) return true;
+	}
+	return false;
+}
+
+static void
+usage(const char *name) {
+	fprintf(stderr,
+		"usage: %s [-b benches] [-t threads] [-k keys] [-r reads] [-d dists] [-m ms]\n"
+		"  -b  any of hashmap,typed,cpp,mutex,list,mempool. default all\n"
+		"  -t  thread counts. default powers of 2 up to the number of cores\n"
+		"  -k  keys in the table, which starts full. default 1000,1000000\n"
+		"  -r  percent of operations that are gets, the rest half puts and half deletes.\n"
+		"      default 90,50,10\n"
+		"  -d  any of uniform,zipf. default both\n"
+		"  -m  milliseconds per run. default 1000\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char **argv) {
+	const char *benches = "hashmap,typed,cpp,mutex,list,mempool";
+	const char *dists = "uniform,zipf";
+	uint64_t threads[MAX_LIST], keys[MAX_LIST] = {1000, 1000000}, reads[MAX_LIST] = {90, 50, 10};
+	uint32_t num_threads = 0, num_keys = 2, num_reads = 3;
+	uint32_t ms = 1000;
+
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &set)) cpus[num_cpus++] = i;
+		}
+	}
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:t:k:r:d:m:")) != -1) {
+		switch (opt) {
+		case 'b': benches = optarg; break;
+		case 't': num_threads = parse_list(optarg, threads); break;
+		case 'k': num_keys = parse_list(optarg, keys); break;
+		case 'r': num_reads = parse_list(optarg, reads); break;
+		case 'd': dists = optarg; break;
+		case 'm': ms = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (num_threads == 0) {
+		for (uint64_t t = 1; t < (uint64_t)num_cpus; t <<= 1) threads[num_threads++] = t;
+		threads[num_threads++] = num_cpus > 0 ? num_cpus : 1;
+	}
+	for (uint32_t i = 0; i < num_threads; i++) {
+		if (threads[i] == 0 || threads[i] > MAX_THREADS) usage(argv[0]);
+	}
+	for (uint32_t i = 0; i < MAX_THREADS; i++) {
+		workers[i].hist = malloc(HIST_BUCKETS * sizeof(uint64_t));
+		workers[i].stream = malloc(KEY_STREAM * sizeof(uint64_t));
+	}
+
+	free_later_init();
+	printf("bench,dist,keys,read_pct,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+
+	for (bench_kind kind = BENCH_HASHMAP; kind <= BENCH_MUTEX; kind++) {
+		if (!has(benches, bench_names[kind])) continue;
+		for (uint32_t k = 0; k < num_keys; k++) {
+			run r = {.kind = kind, .keys = keys[k]};
+			if (kind == BENCH_HASHMAP) {
+				r.map = hashmap_new(keys[k], cmp_key, hash_key);
+			}
+			else if (kind == BENCH_TYPED) {
+				r.typed = typedmap_new(keys[k]);
+			}
+			else if (kind == BENCH_CPP) {
+				r.cpp = cppmap_new(keys[k]);
+			}
+			else {
+				r.table = chained_new(keys[k]);
+			}
+			r.zeta = zeta(keys[k], ZIPF_THETA);
+			r.eta = (1 - pow(2.0 / keys[k], 1 - ZIPF_THETA)) / (1 - zeta(2, ZIPF_THETA) / r.zeta);
+
+			for (dist_kind dist = DIST_UNIFORM; dist <= DIST_ZIPF; dist++) {
+				if (!has(dists, dist_names[dist])) continue;
+				for (uint32_t rd = 0; rd < num_reads; rd++) {
+					for (uint32_t t = 0; t < num_threads; t++) {
+						r.dist = dist;
+						r.reads = reads[rd];
+						r.threads = threads[t];
+						fill(&r);
+						bench(&r, ms);
+					}
+				}
+			}
+
+			if (kind == BENCH_HASHMAP) {
+				// the map has no free. empty it so its nodes at least are released
+				for (uint64_t i = 0; i < keys[k]; i++) {
+					hashmap_del(r.map, key_ptr(i));
+				}
+			}
+			else if (kind == BENCH_TYPED) {
+				typedmap_free(&r.typed);
+			}
+			else if (kind == BENCH_CPP) {
+				cppmap_free(r.cpp);
+			}
+			else {
+				chained_free(r.table);
+			}
+		}
+	}
+
+	for (uint32_t t = 0; t < num_threads && has(benches, "list"); t++) {
+		run r = {.kind = BENCH_LIST, .threads = threads[t], .list = list_new()};
+		bench(&r, ms);
+		list_free_nodes(r.list, list_pop_all(r.list));
+		free(r.list);
+	}
+
+	for (uint32_t t = 0; t < num_threads && has(benches, "mempool"); t++) {
+		run r = {.kind = BENCH_MEMPOOL, .threads = threads[t], .pool = mempool_new_flags(10 * 1024, 3, MEMPOOL_RELEASE)};
+		bench(&r, ms);
+		mempool_free(&r.pool);
+	}
+
+	free_later_term();
+	return 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * The `cpp` benchmark's map, a `lockfree::HashMap` with the same keys and values as
+ * `typed`. Its functions are C so that `bench.c` can call them like the other maps
+ */
+#include <cstdint>
+
+#include "hashmap.hpp"
+
+/**
+ * Passes keys through unchanged. The map runs every hash through splitmix64, so keys
+ * are hashed exactly as `hashmap` and `typed` hash them
+ */
+struct cppmap_hash {
+	uint64_t operator()(uint64_t key) const noexcept { return key; }
+};
+
+using cppmap_t = lockfree::HashMap<uint64_t, void *, cppmap_hash>;
+
+extern "C" {
+
+void *
+cppmap_new(uint32_t hint) {
+	return new cppmap_t(hint);
+}
+
+void
+cppmap_free(void *map) {
+	delete static_cast<cppmap_t *>(map);
+}
+
+bool
+cppmap_get(void *map, uint64_t key, void **value) {
+	return static_cast<cppmap_t *>(map)->visit(key, [value](void *const &v) { *value = v; });
+}
+
+bool
+cppmap_put(void *map, uint64_t key, void *value) {
+	return static_cast<cppmap_t *>(map)->insert_or_assign(key, value);
+}
+
+bool
+cppmap_del(void *map, uint64_t key) {
+	return static_cast<cppmap_t *>(map)->erase(key);
+}
+
+}
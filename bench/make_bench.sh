@@ -0,0 +1,23 @@
+set -e
+
+# compile the library
+cd ../src
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o free_later.o free_later.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o counter.o counter.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o objpool.o objpool.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o hazard.o hazard.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o list.o list.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o hashmap.o hashmap.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o mempool.o mempool.c
+gcc -mcx16 -fPIC -shared -o lockfree.so hashmap.o list.o mempool.o counter.o objpool.o hazard.o free_later.o -lm -lpthread -latomic
+cp lockfree.so liblockfree.so
+
+cd ../bench
+# compile the benchmarks
+cc -mcx16 -O3 -Wall -march=native -msse4.2 -D_GNU_SOURCE -L ../src -std=c99 -I ../src -c -o bench.o bench.c
+g++ -mcx16 -O3 -Wall -march=native -msse4.2 -D_GNU_SOURCE -std=c++17 -I ../src -c -o bench_cpp.o bench_cpp.cpp
+g++ -mcx16 -L ../src -o bench bench.o bench_cpp.o -lm -lpthread -llockfree -latomic -I ../src
+
+# run. arguments are passed on, see `./bench -h`
+export LD_LIBRARY_PATH=../src
+./bench "$@"
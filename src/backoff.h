@@ -0,0 +1,51 @@
+/**
+ * Exponential Backoff
+ *
+ * A thread whose CAS failed has just lost a race for a cache line. Retrying right away
+ * mostly steals the line back from the thread that won, so under contention every
+ * thread spends its time moving the line around instead of making progress. Waiting a
+ * little longer after each failure spreads the retries out.
+ *
+ *     uint32_t spins = BACKOFF_MIN;
+ *     while (!__atomic_compare_exchange_n(...)) {
+ *         backoff_wait(&spins);
+ *     }
+ */
+#ifndef JFALKNER_BACKOFF_H
+#define JFALKNER_BACKOFF_H
+
+#include <stdint.h>
+
+// pauses after the first failure, doubled after each one up to the max
+#define BACKOFF_MIN 1
+#define BACKOFF_MAX 1024
+
+/**
+ * Tells the CPU that this is a spin loop, which frees the core for its hyperthread and
+ * avoids a pipeline flush when the loop ends
+ */
+static inline void
+cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/**
+ * Spins for `*spins` pauses and doubles the next wait
+ */
+static inline void
+backoff_wait(uint32_t *spins) {
+	for (uint32_t i = 0; i < *spins; i++) {
+		cpu_relax();
+	}
+	if (*spins < BACKOFF_MAX) {
+		*spins <<= 1;
+	}
+}
+
+#endif // JFALKNER_BACKOFF_H
@@ -0,0 +1,62 @@
+#include "counter.h"
+
+// hands out stripes to threads as they first use a counter
+static uint32_t next_stripe = 0;
+// stripe of this thread plus one, so 0 means one hasn't been picked yet
+static __thread uint32_t thread_stripe = 0;
+
+
+static inline counter_stripe *
+counter_stripe_of(counter *c) {
+	if (!thread_stripe) {
+		thread_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) % COUNTER_STRIPES + 1;
+	}
+	return &c->stripes[thread_stripe - 1];
+}
+
+// stripes that threads have been given. the others are still 0
+static inline uint32_t
+counter_stripes_used(void) {
+	uint32_t used = __atomic_load_n(&next_stripe, __ATOMIC_ACQUIRE);
+	return used < COUNTER_STRIPES ? used : COUNTER_STRIPES;
+}
+
+void
+counter_add(counter *c, int64_t delta) {
+	counter_stripe *s = counter_stripe_of(c);
+
+	// the stripe is rarely shared, so this add doesn't contend with other threads
+	int64_t value = __atomic_add_fetch(&s->value, delta, __ATOMIC_RELAXED);
+	if (value >= COUNTER_FLUSH || value <= -COUNTER_FLUSH) {
+		value = __atomic_exchange_n(&s->value, 0, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&c->total, value, __ATOMIC_RELAXED);
+	}
+}
+
+int64_t
+counter_read(counter *c) {
+	int64_t sum = __atomic_load_n(&c->total, __ATOMIC_SEQ_CST);
+	uint32_t used = counter_stripes_used();
+	for (uint32_t i=0;i<used;i++) {
+		sum += __atomic_load_n(&c->stripes[i].value, __ATOMIC_SEQ_CST);
+	}
+	return sum;
+}
+
+int64_t
+counter_read_approx(counter *c) {
+	return __atomic_load_n(&c->total, __ATOMIC_RELAXED);
+}
+
+int64_t
+counter_approx_error(void) {
+	return (int64_t)counter_stripes_used() * (COUNTER_FLUSH - 1);
+}
+
+void
+counter_reset(counter *c) {
+	for (int i=0;i<COUNTER_STRIPES;i++) {
+		__atomic_store_n(&c->stripes[i].value, 0, __ATOMIC_SEQ_CST);
+	}
+	__atomic_store_n(&c->total, 0, __ATOMIC_SEQ_CST);
+}
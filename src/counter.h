@@ -0,0 +1,66 @@
+/**
+ * Striped Counter
+ *
+ * A counter that many threads can add to without fighting over one cache line. Each
+ * thread adds to its own padded stripe, and a read sums the stripes. This is for sizes
+ * and statistics that are written on every operation but read much less often.
+ *
+ * A stripe that drifts `COUNTER_FLUSH` away from zero moves its count into `total`,
+ * so `counter_read_approx` is a single load that is off by at most
+ * `COUNTER_STRIPES * COUNTER_FLUSH`. `counter_read` adds up every stripe that a thread
+ * has been given, so it costs one line per thread up to `COUNTER_STRIPES`, and is exact
+ * whenever no adds are in flight.
+ *
+ * Zeroed memory is a counter at 0, so counters can be globals or part of a zeroed
+ * struct without any setup. A struct that holds one is aligned to `COUNTER_LINE`, so
+ * allocate it with `aligned_alloc` and `memset` rather than `calloc`.
+ */
+#ifndef JFALKNER_COUNTER_H
+#define JFALKNER_COUNTER_H
+
+#include <stdint.h>
+
+// threads share stripes round robin once there are more threads than stripes
+#define COUNTER_STRIPES 32
+#define COUNTER_LINE 64
+// how far a stripe may drift before its count is moved into `total`
+#define COUNTER_FLUSH 64
+
+typedef struct counter_stripe_s {
+	int64_t value;
+} __attribute__((aligned(COUNTER_LINE))) counter_stripe;
+
+typedef struct counter_s {
+	// counts flushed from the stripes
+	int64_t total __attribute__((aligned(COUNTER_LINE)));
+	counter_stripe stripes[COUNTER_STRIPES];
+} counter;
+
+
+/**
+ * Adds `delta`, which may be negative, to the calling thread's stripe
+ */
+void counter_add(counter *c, int64_t delta);
+
+/**
+ * Returns the sum of every stripe
+ */
+int64_t counter_read(counter *c);
+
+/**
+ * Returns the flushed count without touching the stripes
+ */
+int64_t counter_read_approx(counter *c);
+
+/**
+ * Returns how far `counter_read_approx` can be from `counter_read`, which is less than
+ * `COUNTER_FLUSH` for every stripe that a thread has used so far
+ */
+int64_t counter_approx_error(void);
+
+/**
+ * Sets the counter back to 0. Adds that race with this may or may not be kept
+ */
+void counter_reset(counter *c);
+
+#endif // JFALKNER_COUNTER_H
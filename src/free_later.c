@@ -1,9 +1,10 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "spinlock.h"
-#include "list.h"
 #include "free_later.h"
 
 typedef struct free_later_var_s {
@@ -11,84 +12,287 @@ typedef struct free_later_var_s {
 	void (*free)(void *var);
 } free_later_var;
 
+// a thread's vars are kept in fixed-size chunks so registering one allocates nothing
+typedef struct free_later_chunk_s {
+	struct free_later_chunk_s *next;
+	// epoch when the chunk filled up, which is no older than any of its vars
+	uint64_t epoch;
+	uint32_t count;
+	free_later_var vars[FREE_LATER_CHUNK];
+} free_later_chunk;
 
-// track expired vars to cleanup later
-static list *buffer = NULL;
-static list *buffer_prev = NULL;
+// a registered thread. the first three fields are shared, the rest belong to its owner
+typedef struct free_later_thread_s {
+	// epoch seen when entering a section, shifted left with the low bit set. 0 outside
+	uint64_t announce;
+	// set while a thread owns this slot. slots of exited threads are re-used
+	uint32_t in_use;
+	struct free_later_thread_s *next;
 
+	// how deeply sections are nested
+	uint32_t depth;
+	// chunk that vars are being added to
+	free_later_chunk *open;
+	// full chunks waiting to be released, oldest first
+	free_later_chunk *head;
+	free_later_chunk *tail;
+	// released chunks kept for re-use
+	free_later_chunk *spare;
+	uint32_t num_spare;
+} __attribute__((aligned(64))) free_later_thread;
+
+
+// current epoch. vars are released two epochs after they were registered
+static uint64_t epoch = 1;
+// every thread that ever registered
+static free_later_thread *threads = NULL;
+// chunks left behind by threads that unregistered, adopted by the next thread to collect
+static free_later_chunk *orphans = NULL;
+
+// releases a thread's slot when it exits
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread free_later_thread *self = NULL;
+
+
+static void
+free_later_thread_exit(void *thread) {
+	self = thread;
+	free_later_unregister();
+}
+
+static void
+free_later_make_key(void) {
+	pthread_key_create(&thread_key, free_later_thread_exit);
+}
 
 int
 free_later_init() {
-	buffer = list_new();
+	pthread_once(&thread_key_once, free_later_make_key);
 	return 0;
 }
 
 void
-free_later (
-	void *var,
-	void release(void *var)) {
-    //register a var for cleanup
-    free_later_var *cv = malloc(sizeof(free_later_var));
-    cv->var = var;
-    cv->free = release;
-    list_add(buffer, cv);
+free_later_register(void) {
+	if (self) return;
+	pthread_once(&thread_key_once, free_later_make_key);
+
+	// re-use the slot of a thread that exited
+	free_later_thread *t = __atomic_load_n(&threads, __ATOMIC_SEQ_CST);
+	for (; t; t = t->next) {
+		uint32_t unused = 0;
+		if (__atomic_compare_exchange_n(&t->in_use, &unused, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break;
+	}
+
+	// or add a new one. slots are never removed, so walking them needs no protection
+	if (!t) {
+		t = aligned_alloc(64, sizeof(free_later_thread));
+		memset(t, 0, sizeof(free_later_thread));
+		t->in_use = 1;
+		t->next = __atomic_load_n(&threads, __ATOMIC_SEQ_CST);
+		while (!__atomic_compare_exchange_n(&threads, &t->next, t, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	}
+
+	self = t;
+	pthread_setspecific(thread_key, t);
 }
 
-void
-free_later_stage(void) {
-	// lock to ensure that multiple threads don't do cleanup simultaneously
-	static bool lock = false;
+/**
+ * Adds a full chunk to the end of a thread's list
+ */
+static void
+free_later_append(free_later_thread *t, free_later_chunk *c) {
+	c->next = NULL;
+	if (t->tail) {
+		t->tail->next = c;
+	}
+	else {
+		t->head = c;
+	}
+	t->tail = c;
+}
+
+/**
+ * Stamps the open chunk with the current epoch and queues it
+ */
+static void
+free_later_seal(free_later_thread *t) {
+	free_later_chunk *c = t->open;
+	if (!c || c->count == 0) return;
+	t->open = NULL;
+	// every var in it was unlinked by now, so the current epoch is late enough
+	c->epoch = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+	free_later_append(t, c);
+}
+
+/**
+ * Releases every var of a chunk and keeps the chunk for re-use
+ */
+static void
+free_later_release_chunk(free_later_thread *t, free_later_chunk *c) {
+	for (uint32_t i=0;i<c->count;i++) {
+		c->vars[i].free(c->vars[i].var);
+	}
+	c->count = 0;
+	if (t && t->num_spare < FREE_LATER_SPARE) {
+		c->next = t->spare;
+		t->spare = c;
+		t->num_spare += 1;
+	}
+	else {
+		free(c);
+	}
+}
+
+/**
+ * Moves the epoch forward if every thread inside a section has seen the current one
+ */
+static void
+free_later_advance(void) {
+	uint64_t e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+	for (free_later_thread *t = __atomic_load_n(&threads, __ATOMIC_SEQ_CST); t; t = t->next) {
+		uint64_t announce = __atomic_load_n(&t->announce, __ATOMIC_SEQ_CST);
+		if ((announce & 1) && (announce >> 1) != e) return;
+	}
+	// failure means another thread already advanced it
+	__atomic_compare_exchange_n(&epoch, &e, e + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
 
-	// CAS-based lock in case multiple threads are calling this method
-	acquire_lock(lock);
+/**
+ * Releases the vars of a thread that no other thread can still be using
+ */
+static void
+free_later_collect(free_later_thread *t) {
+	free_later_advance();
+
+	// adopt chunks from threads that exited
+	if (__atomic_load_n(&orphans, __ATOMIC_SEQ_CST)) {
+		free_later_chunk *c = __atomic_exchange_n(&orphans, NULL, __ATOMIC_SEQ_CST);
+		while (c) {
+			free_later_chunk *next = c->next;
+			free_later_append(t, c);
+			c = next;
+		}
+	}
 
-	if (!buffer_prev || buffer_prev->length == 0) {
-		release_lock(lock);
-		return;
+	// a var from two epochs ago was unlinked before any thread now in a section entered
+	uint64_t e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+	while (t->head && t->head->epoch + 2 <= e) {
+		free_later_chunk *c = t->head;
+		t->head = c->next;
+		if (!t->head) t->tail = NULL;
+		free_later_release_chunk(t, c);
 	}
+}
+
+void
+free_later_unregister(void) {
+	free_later_thread *t = self;
+	if (!t) return;
 
-	// swap the buffers
-	buffer_prev = buffer;
-	buffer = list_new();
+	// release what can be released now and hand the rest to the remaining threads
+	free_later_seal(t);
+	free_later_collect(t);
+	if (t->head) {
+		t->tail->next = __atomic_load_n(&orphans, __ATOMIC_SEQ_CST);
+		while (!__atomic_compare_exchange_n(&orphans, &t->tail->next, t->head, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	}
+	t->head = NULL;
+	t->tail = NULL;
+	while (t->spare) {
+		free_later_chunk *c = t->spare;
+		t->spare = c->next;
+		free(c);
+	}
+	t->num_spare = 0;
+	t->depth = 0;
+	__atomic_store_n(&t->announce, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&t->in_use, 0, __ATOMIC_SEQ_CST);
 
-	release_lock(lock);
+	self = NULL;
+	pthread_setspecific(thread_key, NULL);
 }
 
 void
-free_later_run() {
-	// lock to ensure that multiple threads don't do cleanup simultaneously
-	static bool lock = false;
+free_later_enter(void) {
+	if (!self) free_later_register();
+	free_later_thread *t = self;
+
+	if (t->depth++ == 0) {
+		// a stale epoch here only holds back the next advance, it never lets one through
+		uint64_t e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&t->announce, e << 1 | 1, __ATOMIC_SEQ_CST);
+		// the announcement must be visible before any shared data is read
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void
+free_later_exit(void) {
+	free_later_thread *t = self;
+	if (--t->depth == 0) {
+		__atomic_store_n(&t->announce, 0, __ATOMIC_RELEASE);
+	}
+}
 
-	// skip if there is nothing to return
-	if (!buffer_prev) return;
+void
+free_later_run() {
+	if (!self) free_later_register();
+	free_later_seal(self);
+	free_later_collect(self);
+}
 
-	// CAS-based lock in case multiple threads are calling this method
-	acquire_lock(lock);
+void
+free_later (
+	void *var,
+	void release(void *var)) {
+	// nothing to do for data that isn't owned
+	if (!release) return;
+	if (!self) free_later_register();
+	free_later_thread *t = self;
 
-	// At this point, all workers have processed one or more new flow since the 
-	// free_later buffer was filled. No threads are using the old, deleted data.
-	for (list_node *n = buffer_prev->head; n; n = n->next) {
-		free_later_var *v = n->val;
-		v->free(v->var);
-		free(n);
+	// a chunk is only allocated when there is no spare one to re-use
+	if (!t->open) {
+		if (t->spare) {
+			t->open = t->spare;
+			t->spare = t->open->next;
+			t->num_spare -= 1;
+		}
+		else {
+			t->open = malloc(sizeof(free_later_chunk));
+		}
+		t->open->count = 0;
 	}
 
-	free(buffer_prev);
-	buffer_prev = NULL;
+	//register a var for cleanup
+	free_later_var *v = &t->open->vars[t->open->count++];
+	v->var = var;
+	v->free = release;
 
-	release_lock(lock);
+	// a full chunk is queued, which is also when older ones are checked
+	if (t->open->count == FREE_LATER_CHUNK) {
+		free_later_seal(t);
+		free_later_collect(t);
+	}
 }
 
 int
 free_later_term() {
-	// purge anything that is buffered 
-	free_later_run();
-	// stage and purge anything that was unbuffered
-	free_later_stage();
-	free_later_run();
-	// release memory for the buffer
-	free(buffer);
-	buffer = NULL;
+	// no other threads are running, so everything can be released regardless of epoch
+	free_later_chunk *c = __atomic_exchange_n(&orphans, NULL, __ATOMIC_SEQ_CST);
+	for (free_later_thread *t = threads; t; t = t->next) {
+		free_later_seal(t);
+		if (t->head) {
+			t->tail->next = c;
+			c = t->head;
+		}
+		t->head = NULL;
+		t->tail = NULL;
+	}
+	while (c) {
+		free_later_chunk *next = c->next;
+		free_later_release_chunk(NULL, c);
+		c = next;
+	}
 	return 0;
 }
-
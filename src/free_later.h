@@ -4,35 +4,63 @@
  * Several data structures such as `hashmap_del` will remove data; however, it may not
  * be possible to free data until later. For example, if many threads are using the
  * same hashmap, more than one may be using a reference when `hashmap_del` is called.
- * The solution here is to have `hashmap_del` register data that can be deleted later
- * and let the application notify when worker threads are done with old references.
+ * The solution here is epoch-based reclamation: `hashmap_del` registers data that can
+ * be deleted later, and it is released once no thread can still hold a reference.
  *
  * `free_later(void *var, void release(void *))` will register a pointer to have the
  * `release` method called on it later, when it is safe to free memory.
  *
- * `free_later_init()` must be called before using `free_later`, and `free_later_term()`
- * should be called before application termination. It'll ensure all registerd vars
- * have their `release()` callback invoked.
+ * Threads read shared data between `free_later_enter()` and `free_later_exit()`. The
+ * data structures in this repo do that inside each of their methods, so most code
+ * never calls them directly. Code that keeps using a pointer it got from one, such as
+ * a value returned by `hashmap_get`, can wrap its own section around both since
+ * sections nest.
  *
- * `free_later_stage()` should be called before a round of work starts. It'll stage
- * all buffered values to a list that can't be updated, and make a new list to
- * register any new `free_later()` invocations. After all worker threads have
- * progressed with work, call `free_later_run()` to have every value in the staged
- * buffer released.
+ * A global epoch advances once every thread that is inside a section has seen the
+ * current one. Data registered during epoch `e` is released once the epoch reaches
+ * `e + 2`, because by then every thread that could have seen it has left its section.
+ *
+ * Each thread adds its vars to a chunk of `FREE_LATER_CHUNK` entries that belongs to
+ * it alone, so `free_later` neither allocates nor touches shared memory in the common
+ * case. Whenever a chunk fills up the thread tries to advance the epoch and releases
+ * its chunks that are old enough, so nothing has to coordinate the workers.
+ *
+ * Threads are registered the first time they use `free_later`. Data a thread still
+ * holds when it exits is handed to the threads that remain. `free_later_term()` should
+ * be called before application termination, once no other threads are using it. It'll
+ * ensure all registered vars have their `release()` callback invoked.
  */
 #ifndef JFALKNER_FREE_LATER_H
 #define JFALKNER_FREE_LATER_H
 
+#include <stdint.h>
+
+// vars per chunk, which is also how many calls to `free_later` there are between
+// attempts to advance the epoch and release data
+#define FREE_LATER_CHUNK 256
+// released chunks each thread keeps for re-use
+#define FREE_LATER_SPARE 4
+
 
 // lifecycle events. _init() must be called before use and _term() once at the end
 int free_later_init(void);
 int free_later_term(void);
 
-// signals that worker threads are done with old references
-void free_later_ready(void);
-void free_later_stage(void);
+// registers the calling thread. optional, since threads are registered on first use
+void free_later_register(void);
+// hands the calling thread's unreleased data to other threads and frees its slot
+void free_later_unregister(void);
+
+// brackets code that reads shared data. sections nest, and vars registered while any
+// thread is in one are kept until that thread exits it
+void free_later_enter(void);
+void free_later_exit(void);
+
+// tries to advance the epoch and releases the calling thread's vars that are safe to
+// release. this happens on its own, but is useful before a thread goes idle
+void free_later_run(void);
 
-// adds a var to the cleanup later list
+// adds a var to the cleanup later list. a NULL `release` is ignored
 void free_later(void *var, void release(void *var));
 
 #endif // JFALKNER_FREE_LATER_H
@@ -1,12 +1,63 @@
+#include <string.h>
+
 #include "free_later.h"
 #include "hashmap.h"
 
 // used for testing CAS-retries in tests
-volatile uint32_t hashmap_put_retries = 0;
-volatile uint32_t hashmap_put_replace_fail = 0;
-volatile uint32_t hashmap_put_head_fail = 0;
-volatile uint32_t hashmap_del_fail = 0;
-volatile uint32_t hashmap_del_fail_new_head = 0;
+counter hashmap_put_retries;
+counter hashmap_put_replace_fail;
+counter hashmap_put_head_fail;
+counter hashmap_del_fail;
+counter hashmap_del_fail_new_head;
+// used for testing that tables are resized
+counter hashmap_resizes;
+
+// grow once there is more than one entry per bucket on average
+#define HASHMAP_GROW_LOAD 1
+// shrink once fewer than one in eight buckets would be used
+#define HASHMAP_SHRINK_LOAD 8
+// buckets that each put or del migrates while a resize is running
+#define HASHMAP_MIGRATE_STEP 4
+// old buckets each put or del checks for a claimed group that isn't finished
+#define HASHMAP_MIGRATE_SCAN 64
+// keys that the batch methods hash and prefetch together
+#define HASHMAP_BATCH 16
+
+// the low bit of a bucket head or a `next` link freezes that link for migration. the
+// next bit, only ever set on a node's `next`, marks the node itself as deleted
+#define FROZEN ((uintptr_t)1)
+#define DELETED ((uintptr_t)2)
+#define is_frozen(n) ((uintptr_t)(n) & FROZEN)
+#define is_deleted(n) ((uintptr_t)(n) & DELETED)
+#define freeze(n) ((hashmap_keyval *)((uintptr_t)(n) | FROZEN))
+#define unmark(n) ((hashmap_keyval *)((uintptr_t)(n) & ~(FROZEN | DELETED)))
+
+// bucket heads for buckets that were migrated or that have not been filled in yet
+static hashmap_keyval moved_bucket;
+static hashmap_keyval unfilled_bucket;
+#define MOVED (&moved_bucket)
+#define UNFILLED (&unfilled_bucket)
+
+// a node's `next` and `value`, which are updated together with a 16-byte CAS
+typedef union hashmap_pair_u {
+	struct {
+		hashmap_keyval *next;
+		void *value;
+	} link;
+	unsigned __int128 word;
+} hashmap_pair;
+
+// where a key was found, or where it would be added, in its bucket
+typedef struct hashmap_cursor_s {
+	hashmap_table *table;
+	// head of the bucket, which new nodes are prepended to
+	hashmap_keyval *head;
+	// the link pointing at `match`, either the bucket or the previous node's `next`
+	hashmap_keyval **prev;
+	hashmap_keyval *match;
+	// `match->next` as it was when the key was matched
+	hashmap_keyval *next;
+} hashmap_cursor;
 
 
 hashmap_keyval *
@@ -22,24 +73,62 @@ hashmap_create_node_malloc(void *opaque, const void *key, void *value) {
 
 void
 hashmap_destroy_node_later(void *opaque, hashmap_keyval *node) {
-	// free all of these later in case other threads are using them
-	free_later((void *)node->key, free);
+	// free these later in case other threads are using them. keys belong to the caller
 	free_later(node->value, opaque);
 	free_later(node, free);
 }
 
 void
-hashmap_destroy_value_later(void *opaque, hashmap_keyval *node) {
-        // free later in case other threads are using them
-        free_later(node->value, opaque);
-        free_later(node, free);
+hashmap_destroy_value_later(void *opaque, void *value) {
+	// free later in case other threads are using it
+	free_later(value, opaque);
+}
+
+void
+hashmap_release_node_later(void *opaque, hashmap_keyval *node) {
+	// the key and value live on in a copy of this node, only the node is released
+	free_later(node, free);
+}
+
+hashmap_keyval *
+hashmap_create_node_pool(void *opaque, const void *key, void *value) {
+	hashmap_keyval *next = objpool_alloc(opaque);
+	next->key = key;
+	next->value = value;
+	return next;
+}
+
+void
+hashmap_release_node_pool(void *opaque, hashmap_keyval *node) {
+	// back to the pool once no thread can still be reading the node
+	free_later(node, objpool_release);
+}
+
+void
+hashmap_keep_value(void *opaque, void *value) {
+	// the caller owns values of maps backed by a pool
 }
+
+static hashmap_table *
+hashmap_table_new(uint32_t num_buckets, hashmap_keyval *head) {
+	hashmap_table *table = calloc(1, sizeof(hashmap_table));
+	table->num_buckets = num_buckets;
+	table->buckets = malloc((size_t)num_buckets * sizeof(hashmap_keyval *));
+	for (uint32_t i=0;i<num_buckets;i++) {
+		table->buckets[i] = head;
+	}
+	return table;
+}
+
 void *
 hashmap_new(uint32_t num_buckets, uint8_t cmp(const void *x, const void *y), uint64_t hash(const void *key))
 {
-	hashmap *map = calloc(1, sizeof(hashmap));
-	map->num_buckets = num_buckets;
-	map->buckets = calloc(num_buckets, sizeof(hashmap_keyval *));
+	// the striped length counter needs its cache lines to itself
+	hashmap *map = aligned_alloc(64, sizeof(hashmap));
+	memset(map, 0, sizeof(hashmap));
+	if (num_buckets == 0) num_buckets = 1;
+	map->table = hashmap_table_new(num_buckets, NULL);
+	map->min_buckets = num_buckets;
 	// keep local reference of the two utility functions
 	map->hash = hash;
 	map->cmp = cmp;
@@ -47,27 +136,511 @@ hashmap_new(uint32_t num_buckets, uint8_t cmp(const void *x, const void *y), uin
 	map->opaque = NULL;
 	map->create_node = hashmap_create_node_malloc;
 	map->destroy_node = hashmap_destroy_node_later;
+	map->release_node = hashmap_release_node_later;
+	map->destroy_value = hashmap_destroy_value_later;
+	// keys belong to the caller by default
+	map->release_key = NULL;
 	return map;
 }
 
+void
+hashmap_use_pool(hashmap *map, objpool *pool)
+{
+	map->opaque = pool;
+	map->create_node = hashmap_create_node_pool;
+	map->destroy_node = hashmap_release_node_pool;
+	map->release_node = hashmap_release_node_pool;
+	map->destroy_value = hashmap_keep_value;
+}
+
+void
+hashmap_use_hazards(hashmap *map, hazard_domain *domain, void release(void *value))
+{
+	map->hazards = domain;
+	map->release_value = release;
+}
+
+/**
+ * Releases a node that was unlinked, along with its key and value. Values of maps that
+ * use hazard pointers are retired to the domain since callers may have them protected.
+ */
+static void
+hashmap_destroy_node(hashmap *map, hashmap_keyval *node) {
+	free_later((void *)node->key, map->release_key);
+	if (map->hazards) {
+		hazard_retire(map->hazards, node->value, map->release_value);
+		map->release_node(map->opaque, node);
+	}
+	else {
+		map->destroy_node(map->opaque, node);
+	}
+}
+
+/**
+ * Releases a value that was replaced
+ */
+static void
+hashmap_destroy_value(hashmap *map, void *value) {
+	if (map->hazards) {
+		hazard_retire(map->hazards, value, map->release_value);
+	}
+	else {
+		map->destroy_value(map->opaque, value);
+	}
+}
+
+/**
+ * Buckets are migrated in groups. Group `g` is every bucket of the old and the new
+ * table whose index is `g` modulo the smaller table's size. Since tables only ever
+ * double or halve, all keys in a group's old buckets land in the group's new buckets.
+ */
+static uint32_t
+hashmap_groups(hashmap_table *table) {
+	uint32_t resized = table->next->num_buckets;
+	return table->num_buckets < resized ? table->num_buckets : resized;
+}
+
+/**
+ * Returns the head of the bucket for `hash`, following buckets that were moved to a
+ * newer table. `table` is updated to the table that owns the returned bucket.
+ */
+static hashmap_keyval *
+hashmap_head(hashmap_table **table, uint64_t hash) {
+	hashmap_table *t = *table;
+	hashmap_keyval *head = __atomic_load_n(&t->buckets[hash % t->num_buckets], __ATOMIC_SEQ_CST);
+	while (head == MOVED) {
+		t = __atomic_load_n(&t->next, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&t->buckets[hash % t->num_buckets], __ATOMIC_SEQ_CST);
+	}
+	*table = t;
+	return head;
+}
+
+/**
+ * Freezes a bucket and then every link of its chain, head to tail. Any CAS that
+ * expects an unfrozen link fails afterwards, so the chain can be copied safely.
+ *
+ * Returns the frozen chain or MOVED if the bucket was already migrated.
+ */
+static hashmap_keyval *
+hashmap_freeze_bucket(hashmap_keyval **bucket) {
+	hashmap_keyval *head = __atomic_load_n(bucket, __ATOMIC_SEQ_CST);
+	while (!is_frozen(head)) {
+		if (head == MOVED) return MOVED;
+		if (__atomic_compare_exchange_n(bucket, &head, freeze(head), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break;
+	}
+	head = unmark(head);
+
+	for (hashmap_keyval *n = head; n; ) {
+		hashmap_keyval *next = __atomic_load_n(&n->next, __ATOMIC_SEQ_CST);
+		while (!is_frozen(next)) {
+			if (__atomic_compare_exchange_n(&n->next, &next, freeze(next), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break;
+		}
+		n = unmark(next);
+	}
+	return head;
+}
+
+/**
+ * Migrates one group of buckets from `table` to `table->next`. Any number of threads
+ * may run this for the same group; exactly one of them fills in each new bucket and
+ * exactly one marks each old bucket as MOVED.
+ */
+static void
+hashmap_migrate(hashmap *map, hashmap_table *table, uint32_t group) {
+	hashmap_table *next = __atomic_load_n(&table->next, __ATOMIC_SEQ_CST);
+	uint32_t groups = hashmap_groups(table);
+
+	// a group has at most two old and two new buckets since tables double or halve
+	hashmap_keyval *heads[2];
+	hashmap_keyval *chains[2] = { NULL, NULL };
+	bool moved = false;
+
+	// freeze the old buckets. if any were moved, the new buckets are already filled in
+	for (uint32_t i = group, k = 0; i < table->num_buckets; i += groups, k++) {
+		heads[k] = hashmap_freeze_bucket(&table->buckets[i]);
+		if (heads[k] == MOVED) moved = true;
+	}
+
+	if (!moved) {
+		// copy every entry that wasn't deleted to a private chain for its new bucket
+		for (uint32_t i = group, k = 0; i < table->num_buckets; i += groups, k++) {
+			for (hashmap_keyval *n = heads[k]; n; n = unmark(n->next)) {
+				if (is_deleted(n->next)) continue;
+				uint32_t index = n->hash % next->num_buckets;
+				hashmap_keyval *copy = map->create_node(map->opaque, n->key, n->value);
+				copy->hash = n->hash;
+				copy->next = chains[index / groups];
+				chains[index / groups] = copy;
+			}
+		}
+
+		// publish the copies. a failure means another thread already did
+		for (uint32_t j = group, k = 0; j < next->num_buckets; j += groups, k++) {
+			hashmap_keyval *unfilled = UNFILLED;
+			bool success = __atomic_compare_exchange(&next->buckets[j], &unfilled, &chains[k], false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			if (!success) {
+				for (hashmap_keyval *n = chains[k]; n; ) {
+					hashmap_keyval *tofree = n;
+					n = n->next;
+					map->release_node(map->opaque, tofree);
+				}
+			}
+		}
+	}
+
+	// point readers of the old buckets to the new table and release the old chains
+	for (uint32_t i = group, k = 0; i < table->num_buckets; i += groups, k++) {
+		if (heads[k] == MOVED) continue;
+
+		hashmap_keyval *frozen = freeze(heads[k]);
+		hashmap_keyval *moved_head = MOVED;
+		bool success = __atomic_compare_exchange(&table->buckets[i], &frozen, &moved_head, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		if (!success) continue;
+
+		// deleted nodes that were never unlinked are destroyed here instead
+		for (hashmap_keyval *n = heads[k]; n; ) {
+			hashmap_keyval *tofree = n;
+			hashmap_keyval *next = n->next;
+			n = unmark(next);
+			if (is_deleted(next)) {
+				hashmap_destroy_node(map, tofree);
+			}
+			else {
+				map->release_node(map->opaque, tofree);
+			}
+		}
+
+		// the last bucket to move makes the new table current
+		if (__atomic_add_fetch(&table->migrate_done, 1, __ATOMIC_SEQ_CST) == table->num_buckets) {
+			hashmap_table *old = table;
+			if (__atomic_compare_exchange(&map->table, &old, &next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				free_later(table->buckets, free);
+				free_later(table, free);
+			}
+		}
+	}
+}
+
+/**
+ * Claims and migrates a few groups of buckets if a resize is running.
+ *
+ * Once every group is claimed, the resize would still wait on any thread that was
+ * preempted between claiming a group and moving it. So helpers then scan the old
+ * buckets for ones that aren't MOVED yet and migrate their group themselves, which is
+ * safe since migrating a group twice only repeats work. A MOVED bucket stays MOVED, so
+ * the shared scan position only ever passes buckets that are done.
+ */
+static void
+hashmap_help_resize(hashmap *map) {
+	hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&table->next, __ATOMIC_SEQ_CST)) return;
+
+	uint32_t groups = hashmap_groups(table);
+	int migrated = 0;
+	while (migrated < HASHMAP_MIGRATE_STEP) {
+		// skip the atomic add once every group is claimed
+		if (__atomic_load_n(&table->migrate_next, __ATOMIC_SEQ_CST) >= groups) break;
+		uint32_t group = __atomic_fetch_add(&table->migrate_next, 1, __ATOMIC_SEQ_CST);
+		if (group >= groups) break;
+		hashmap_migrate(map, table, group);
+		migrated++;
+	}
+
+	for (int i=0;i<HASHMAP_MIGRATE_SCAN && migrated < HASHMAP_MIGRATE_STEP;i++) {
+		uint32_t scan = __atomic_load_n(&table->migrate_scan, __ATOMIC_SEQ_CST);
+		if (scan >= table->num_buckets) return;
+		if (__atomic_load_n(&table->buckets[scan], __ATOMIC_SEQ_CST) == MOVED) {
+			__atomic_compare_exchange_n(&table->migrate_scan, &scan, scan + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		hashmap_migrate(map, table, scan % groups);
+		migrated++;
+	}
+}
+
+/**
+ * Starts a resize if the load factor is past a threshold and no resize is running.
+ */
+static void
+hashmap_check_load(hashmap *map) {
+	hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&table->next, __ATOMIC_SEQ_CST)) return;
+
+	uint32_t num_buckets = table->num_buckets;
+	int64_t grow = (int64_t)num_buckets * HASHMAP_GROW_LOAD;
+	int64_t shrink = (int64_t)num_buckets / HASHMAP_SHRINK_LOAD;
+	bool can_grow = num_buckets <= UINT32_MAX / 2;
+	bool can_shrink = num_buckets % 2 == 0 && num_buckets / 2 >= map->min_buckets;
+
+	// the flushed count settles most checks without touching the stripes. only one that
+	// is too close to a threshold to tell sums them
+	int64_t length = counter_read_approx(&map->length);
+	int64_t error = counter_approx_error();
+	bool near_grow = can_grow && length - error <= grow && length + error > grow;
+	bool near_shrink = can_shrink && length - error < shrink && length + error >= shrink;
+	if (near_grow || near_shrink) {
+		length = counter_read(&map->length);
+	}
+
+	uint32_t resized;
+	if (can_grow && length > grow) {
+		resized = num_buckets * 2;
+	}
+	else if (can_shrink && length < shrink) {
+		resized = num_buckets / 2;
+	}
+	else {
+		return;
+	}
+
+	// only one thread gets to link its table. a stale `table` already has a `next`
+	hashmap_table *next = hashmap_table_new(resized, UNFILLED);
+	hashmap_table *none = NULL;
+	bool success = __atomic_compare_exchange(&table->next, &none, &next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	if (success) {
+		counter_add(&hashmap_resizes, 1);
+	}
+	else {
+		free(next->buckets);
+		free(next);
+	}
+}
+
+/**
+ * Walks the bucket for `hash` looking for `key`. Deleted nodes on the way are
+ * unlinked, so a node marked by a stalled `hashmap_del` never blocks other writers,
+ * and frozen buckets are migrated first.
+ *
+ * Returns true if the key was found. Either way `cursor` is filled in.
+ */
+static bool
+hashmap_find(hashmap *map, const void *key, uint64_t hash, hashmap_cursor *cursor) {
+	while (true) {
+		cursor->table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+		cursor->head = hashmap_head(&cursor->table, hash);
+		uint32_t bucket_index = hash % cursor->table->num_buckets;
+
+		// help finish migrating this bucket before changing it in the new table
+		if (is_frozen(cursor->head)) {
+			hashmap_migrate(map, cursor->table, bucket_index % hashmap_groups(cursor->table));
+			continue;
+		}
+
+		cursor->prev = &cursor->table->buckets[bucket_index];
+		cursor->match = cursor->head;
+		while (cursor->match) {
+			cursor->next = __atomic_load_n(&cursor->match->next, __ATOMIC_SEQ_CST);
+			// the chain is being migrated. starting over will help
+			if (is_frozen(cursor->next)) break;
+
+			if (is_deleted(cursor->next)) {
+				// unlink the deleted node. whichever thread does this destroys it
+				hashmap_keyval *deleted = cursor->match;
+				hashmap_keyval *next = unmark(cursor->next);
+				bool success = __atomic_compare_exchange(cursor->prev, &deleted, &next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				if (!success) break;
+
+				hashmap_destroy_node(map, cursor->match);
+				if (cursor->prev == &cursor->table->buckets[bucket_index]) cursor->head = next;
+				cursor->match = next;
+				continue;
+			}
+
+			if (cursor->match->hash == hash && map->cmp(key, cursor->match->key) == 0) return true;
+			cursor->prev = &cursor->match->next;
+			cursor->match = cursor->next;
+		}
+		if (!cursor->match) return false;
+
+		// the chain changed under this walk, start over from the bucket
+		counter_add(&hashmap_put_head_fail, 1);
+	}
+}
+
+/**
+ * Replaces a node's value only if neither the value nor the node's `next` link have
+ * changed. Checking `next` too means a deleted or frozen node can't be updated.
+ */
+static bool
+hashmap_swap_value(hashmap_keyval *node, hashmap_keyval *next, void *old, void *value) {
+	hashmap_pair expected = { .link = { next, old } };
+	hashmap_pair desired = { .link = { next, value } };
+	return __atomic_compare_exchange_n(&((hashmap_pair *)node)->word, &expected.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Prepends a node to the bucket `cursor` walked. `node` is made on the first attempt
+ * and re-used if a retry is needed.
+ */
+static bool
+hashmap_insert(hashmap *map, hashmap_cursor *cursor, hashmap_keyval **node, const void *key, void *value, uint64_t hash) {
+	// make the next key-value pair to append
+	if (!*node) {
+		*node = map->create_node(map->opaque, key, value);
+		(*node)->hash = hash;
+	}
+	(*node)->value = value;
+
+	// make sure the reference to existing nodes is kept
+	(*node)->next = cursor->head;
+
+	// prepend the kv-pair or lazy-make the bucket
+	hashmap_keyval **bucket = &cursor->table->buckets[hash % cursor->table->num_buckets];
+	bool success = __atomic_compare_exchange(bucket, &cursor->head, node, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	if (!success) {
+		// failure means another thead updated head before this one
+		// track the CAS failure for tests -- striped to minimize thread contention
+		counter_add(&hashmap_put_retries, 1);
+		return false;
+	}
+
+	counter_add(&map->length, 1);
+	hashmap_help_resize(map);
+	hashmap_check_load(map);
+	return true;
+}
+
 void *
 hashmap_get(hashmap *map, const void *key)
 {
 	// hash to convert the key to a bucket index where the value would be stored
-	uint32_t index = map->hash(key) % map->num_buckets;
+	uint64_t hash = map->hash(key);
+	void *value = NULL;
+
+	free_later_enter();
+	hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
 
-	// walk the linked list nodes to find any matches
-	hashmap_keyval *n = map->buckets[index];
+	// walk the linked list nodes to find any matches. a frozen chain is still valid
+	hashmap_keyval *n = unmark(hashmap_head(&table, hash));
 	while (n) {
-		if (map->cmp(n->key, key) == 0) {
-			return n->value;
+		hashmap_keyval *next = __atomic_load_n(&n->next, __ATOMIC_SEQ_CST);
+		if (!is_deleted(next) && n->hash == hash && map->cmp(n->key, key) == 0) {
+			value = __atomic_load_n(&n->value, __ATOMIC_SEQ_CST);
+			break;
+		}
+
+		n = unmark(next);
+	}
+	free_later_exit();
+
+	return value;
+}
+
+void *
+hashmap_get_protected(hashmap *map, const void *key, void **slot)
+{
+	hashmap_cursor cursor;
+	void *value = NULL;
+
+	uint64_t hash = map->hash(key);
+	free_later_enter();
+	while (hashmap_find(map, key, hash, &cursor)) {
+		value = __atomic_load_n(&cursor.match->value, __ATOMIC_SEQ_CST);
+		__atomic_store_n(slot, value, __ATOMIC_SEQ_CST);
+
+		// a value is only retired after it is swapped out or its node is marked deleted.
+		// if neither happened once the slot is visible, the retire will see the slot.
+		// `next` being unchanged also means the node wasn't frozen for a resize
+		if (__atomic_load_n(&cursor.match->next, __ATOMIC_SEQ_CST) == cursor.next &&
+				__atomic_load_n(&cursor.match->value, __ATOMIC_SEQ_CST) == value) {
+			break;
+		}
+		value = NULL;
+	}
+	free_later_exit();
+
+	if (!value) __atomic_store_n(slot, NULL, __ATOMIC_SEQ_CST);
+	return value;
+}
+
+uint32_t
+hashmap_length(hashmap *map)
+{
+	int64_t length = counter_read(&map->length);
+	return length > 0 ? length : 0;
+}
+
+void
+hashmap_get_many(hashmap *map, const void **keys, uint32_t count, void **values)
+{
+	uint64_t hashes[HASHMAP_BATCH];
+	hashmap_keyval *nodes[HASHMAP_BATCH];
+
+	for (uint32_t start = 0; start < count; start += HASHMAP_BATCH) {
+		uint32_t batch = count - start < HASHMAP_BATCH ? count - start : HASHMAP_BATCH;
+		const void **k = &keys[start];
+		void **v = &values[start];
+
+		// each batch is its own section so a long call doesn't hold back reclamation
+		free_later_enter();
+		hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+
+		// hash the whole batch and prefetch every bucket
+		for (uint32_t i=0;i<batch;i++) {
+			hashes[i] = map->hash(k[i]);
+			__builtin_prefetch(&table->buckets[hashes[i] % table->num_buckets], 0, 3);
 		}
+		// load the bucket heads and prefetch the first node of each chain
+		uint32_t remaining = 0;
+		for (uint32_t i=0;i<batch;i++) {
+			hashmap_table *t = table;
+			nodes[i] = unmark(hashmap_head(&t, hashes[i]));
+			__builtin_prefetch(nodes[i], 0, 3);
+			v[i] = NULL;
+			if (nodes[i]) remaining++;
+		}
+
+		// walk the chains one node at a time, round robin, prefetching each next node
+		while (remaining) {
+			for (uint32_t i=0;i<batch;i++) {
+				hashmap_keyval *n = nodes[i];
+				if (!n) continue;
 
-		n = n->next;
+				hashmap_keyval *next = __atomic_load_n(&n->next, __ATOMIC_SEQ_CST);
+				if (!is_deleted(next) && n->hash == hashes[i] && map->cmp(n->key, k[i]) == 0) {
+					v[i] = __atomic_load_n(&n->value, __ATOMIC_SEQ_CST);
+					n = NULL;
+				}
+				else {
+					n = unmark(next);
+					__builtin_prefetch(n, 0, 3);
+				}
+				nodes[i] = n;
+				if (!n) remaining--;
+			}
+		}
+		free_later_exit();
 	}
+}
+
+/**
+ * Puts a key whose hash is already known
+ */
+static bool
+hashmap_put_hashed(hashmap *map, const void *key, void *value, uint64_t hash)
+{
+	hashmap_cursor cursor;
+	hashmap_keyval *node = NULL;
 
-	// no matches found
-	return NULL;
+	while (true) {
+		// if the key exists, swap its value in place
+		if (hashmap_find(map, key, hash, &cursor)) {
+			void *old = __atomic_load_n(&cursor.match->value, __ATOMIC_SEQ_CST);
+			if (hashmap_swap_value(cursor.match, cursor.next, old, value)) {
+				// a node made by an earlier attempt was never linked
+				if (node) map->release_node(map->opaque, node);
+				hashmap_destroy_value(map, old);
+				hashmap_help_resize(map);
+				return true;
+			}
+			counter_add(&hashmap_put_replace_fail, 1);
+		}
+		// if the key doesn't exist, try adding it
+		else if (hashmap_insert(map, &cursor, &node, key, value, hash)) {
+			return false;
+		}
+	}
 }
 
 bool
@@ -77,131 +650,374 @@ hashmap_put(hashmap *map, const void *key, void *value)
 	if (!map) return NULL;
 
 	// hash to convert the key to a bucket index where the value would be stored
-	uint32_t bucket_index = map->hash(key) % map->num_buckets;
+	uint64_t hash = map->hash(key);
 
-	hashmap_keyval *kv = NULL;
-	hashmap_keyval *prev = NULL;
-	
-	// known head and next entry to add to the list
-	hashmap_keyval *head = NULL;
-	hashmap_keyval *next = NULL;
+	free_later_enter();
+	bool replaced = hashmap_put_hashed(map, key, value, hash);
+	free_later_exit();
+	return replaced;
+}
+
+uint32_t
+hashmap_put_many(hashmap *map, const void **keys, void **values, uint32_t count)
+{
+	uint64_t hashes[HASHMAP_BATCH];
+	uint32_t replaced = 0;
+
+	// sanity checks
+	if (!map) return 0;
+
+	for (uint32_t start = 0; start < count; start += HASHMAP_BATCH) {
+		uint32_t batch = count - start < HASHMAP_BATCH ? count - start : HASHMAP_BATCH;
+
+		free_later_enter();
+		hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+
+		// hash the whole batch and prefetch every bucket for writing
+		for (uint32_t i=0;i<batch;i++) {
+			hashes[i] = map->hash(keys[start + i]);
+			__builtin_prefetch(&table->buckets[hashes[i] % table->num_buckets], 1, 3);
+		}
+		// prefetch the first node of each chain, which every put walks
+		for (uint32_t i=0;i<batch;i++) {
+			hashmap_table *t = table;
+			__builtin_prefetch(unmark(hashmap_head(&t, hashes[i])), 0, 3);
+		}
+
+		for (uint32_t i=0;i<batch;i++) {
+			if (hashmap_put_hashed(map, keys[start + i], values[start + i], hashes[i])) replaced++;
+		}
+		free_later_exit();
+	}
+	return replaced;
+}
+
+static bool
+hashmap_do_put_if_absent(hashmap *map, const void *key, void *value, uint64_t hash)
+{
+	hashmap_cursor cursor;
+	hashmap_keyval *node = NULL;
 
 	while (true) {
-		// copy the head of the list before checking entries for equality
-		head = map->buckets[bucket_index];
-
-		// find any existing matches to this key
-		prev = NULL;
-		if (head) {
-			for (kv = head; kv; kv = kv->next) {
-				if (map->cmp(key, kv->key) == 0) break;
-				prev = kv;
-			}
-		}
-		// if the key exists, update and return it
-		if (kv) {
-
-			// lazy make the next key-value pair to append
-			if (!next) {
-				next = map->create_node(map->opaque, key, value);
-			}
-			// ensure the linked-list's existing node chain persists
-			next->next = kv->next;
-
-			// CAS-update the reference in the previous node
-			if (prev) {
-				// replace this link, assuming it hasn't changed by another thread
-				bool success = __atomic_compare_exchange(&prev->next, &kv, &next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
-				if (success) {
-					// this node, key and value are never again used by this data structure
-					map->destroy_node(map->opaque, kv);
-					return true;
-				}
-				hashmap_put_replace_fail += 1;
-			}
-			// no previous link, update the head of the list
-			else {
-				// set the head of the list to be whatever this node points to (NULL or other links)
-				bool success = __atomic_compare_exchange(&map->buckets[bucket_index], &kv, &next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
-				if (success) {
-					map->destroy_node(map->opaque, kv);
-					return true;
-				}
+		if (hashmap_find(map, key, hash, &cursor)) {
+			if (node) map->release_node(map->opaque, node);
+			return false;
+		}
+		if (hashmap_insert(map, &cursor, &node, key, value, hash)) {
+			return true;
+		}
+	}
+}
+
+static bool
+hashmap_do_replace_value(hashmap *map, const void *key, void *expected, void *desired, uint64_t hash)
+{
+	hashmap_cursor cursor;
+
+	while (true) {
+		if (!hashmap_find(map, key, hash, &cursor)) return false;
+		if (__atomic_load_n(&cursor.match->value, __ATOMIC_SEQ_CST) != expected) return false;
 
-				// failure means at least one new entry was added, retry the whole match/del process
-				hashmap_put_head_fail += 1;
+		if (hashmap_swap_value(cursor.match, cursor.next, expected, desired)) {
+			hashmap_help_resize(map);
+			return true;
+		}
+		// the node's link changed or another thread swapped the value, look again
+		counter_add(&hashmap_put_replace_fail, 1);
+	}
+}
+
+static void *
+hashmap_do_compute(hashmap *map, const void *key, void *update(const void *key, void *value, void *arg), void *arg, uint64_t hash)
+{
+	hashmap_cursor cursor;
+	hashmap_keyval *node = NULL;
+
+	while (true) {
+		if (hashmap_find(map, key, hash, &cursor)) {
+			void *old = __atomic_load_n(&cursor.match->value, __ATOMIC_SEQ_CST);
+			void *value = update(key, old, arg);
+			if (value == old || hashmap_swap_value(cursor.match, cursor.next, old, value)) {
+				if (node) map->release_node(map->opaque, node);
+				hashmap_help_resize(map);
+				return value;
 			}
+			counter_add(&hashmap_put_replace_fail, 1);
 		}
-		// if the key doesn't exist, try adding it
 		else {
-			// make the next key-value pair to append
-			if (!next) {
-				next = map->create_node(map->opaque, key, value);
+			void *value = update(key, NULL, arg);
+			// nothing to add
+			if (!value) {
+				if (node) map->release_node(map->opaque, node);
+				return NULL;
+			}
+			if (hashmap_insert(map, &cursor, &node, key, value, hash)) {
+				return value;
 			}
-			next->next = NULL;
+		}
+	}
+}
 
-			// make sure the reference to existing nodes is kept
-			if (head) next->next = head;
+static uintptr_t
+hashmap_do_fetch_add(hashmap *map, const void *key, uintptr_t delta, uint64_t hash)
+{
+	hashmap_cursor cursor;
+	hashmap_keyval *node = NULL;
 
-			// prepend the kv-pair or lazy-make the bucket
-			bool success = __atomic_compare_exchange(&map->buckets[bucket_index], &head, &next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
-			if (success) {
-				__atomic_fetch_add(&map->length, 1, __ATOMIC_SEQ_CST);
-				return false;
-			}
-			// failure means another thead updated head before this one
-			else {
-				// track the CAS failure for tests -- non-atomic to minimize thread contention
-				hashmap_put_retries += 1;
+	while (true) {
+		if (hashmap_find(map, key, hash, &cursor)) {
+			uintptr_t old = (uintptr_t)__atomic_load_n(&cursor.match->value, __ATOMIC_SEQ_CST);
+			if (hashmap_swap_value(cursor.match, cursor.next, (void *)old, (void *)(old + delta))) {
+				if (node) map->release_node(map->opaque, node);
+				hashmap_help_resize(map);
+				return old;
 			}
+			counter_add(&hashmap_put_replace_fail, 1);
+		}
+		// a missing key counts from zero
+		else if (hashmap_insert(map, &cursor, &node, key, (void *)delta, hash)) {
+			return 0;
 		}
 	}
 }
 
-bool hashmap_del(hashmap *map, const void *key) {
-	hashmap_keyval *match;
-	hashmap_keyval *prev = NULL;
-
-	if (!map) return false;
+static bool
+hashmap_do_del(hashmap *map, const void *key, uint64_t hash)
+{
+	hashmap_cursor cursor;
 
-	uint32_t bucket_index = (*map->hash)(key) % map->num_buckets;
-	
 	// try to find a match, loop in case a delete attempt fails
 	while (true) {
-		prev = NULL;
-		for (match = map->buckets[bucket_index]; match; match = match->next) {
-			if ((*map->cmp)(key, match->key) == 0) break;
-			prev = match;
+		// exit if no match was found
+		if (!hashmap_find(map, key, hash, &cursor)) return false;
+
+		// mark the node as deleted. just one thread can, and its value can't change after
+		hashmap_keyval *deleted = (hashmap_keyval *)((uintptr_t)cursor.next | DELETED);
+		bool success = __atomic_compare_exchange(&cursor.match->next, &cursor.next, &deleted, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		if (!success) {
+			counter_add(&hashmap_del_fail, 1);
+			continue;
 		}
+		counter_add(&map->length, -1);
 
-		// exit if no match was found
-		if (!match) return false;
-
-		// previous means this not the head but a link in the list
-		if (prev) {
-			// try the delete but fail if another thread did the delete
-			bool success = __atomic_compare_exchange(&prev->next, &match, &match->next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
-			if (success) {
-				__atomic_fetch_sub(&map->length, 1, __ATOMIC_SEQ_CST);
-				map->destroy_node(map->opaque, match);
-				return true;
-			}
-			hashmap_del_fail += 1;
+		// unlink it, or if the previous link changed, walk again so the walk unlinks it
+		hashmap_keyval *match = cursor.match;
+		success = __atomic_compare_exchange(cursor.prev, &match, &cursor.next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		if (success) {
+			hashmap_destroy_node(map, cursor.match);
 		}
-		// no previous link means this needs to leave an empty bucket
 		else {
-			// copy the next link in the list (may be NULL) to the head
-			bool success = __atomic_compare_exchange(&map->buckets[bucket_index], &match, &match->next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
-			if (success) {
-				__atomic_fetch_sub(&map->length, 1, __ATOMIC_SEQ_CST);
-				map->destroy_node(map->opaque, match);
-				return true;
+			counter_add(&hashmap_del_fail_new_head, 1);
+			hashmap_find(map, key, hash, &cursor);
+		}
+
+		hashmap_help_resize(map);
+		hashmap_check_load(map);
+		return true;
+	}
+}
+
+/*
+ * The methods below walk chains that other threads may be unlinking nodes from, so
+ * each runs its walk inside a `free_later` section.
+ */
+
+bool
+hashmap_put_if_absent(hashmap *map, const void *key, void *value)
+{
+	// sanity checks
+	if (!map) return false;
+
+	uint64_t hash = map->hash(key);
+	free_later_enter();
+	bool added = hashmap_do_put_if_absent(map, key, value, hash);
+	free_later_exit();
+	return added;
+}
+
+bool
+hashmap_replace_value(hashmap *map, const void *key, void *expected, void *desired)
+{
+	// sanity checks
+	if (!map) return false;
+
+	uint64_t hash = map->hash(key);
+	free_later_enter();
+	bool replaced = hashmap_do_replace_value(map, key, expected, desired, hash);
+	free_later_exit();
+	return replaced;
+}
+
+void *
+hashmap_compute(hashmap *map, const void *key, void *update(const void *key, void *value, void *arg), void *arg)
+{
+	// sanity checks
+	if (!map) return NULL;
+
+	uint64_t hash = map->hash(key);
+	free_later_enter();
+	void *value = hashmap_do_compute(map, key, update, arg, hash);
+	free_later_exit();
+	return value;
+}
+
+uintptr_t
+hashmap_fetch_add(hashmap *map, const void *key, uintptr_t delta)
+{
+	// sanity checks
+	if (!map) return 0;
+
+	uint64_t hash = map->hash(key);
+	free_later_enter();
+	uintptr_t old = hashmap_do_fetch_add(map, key, delta, hash);
+	free_later_exit();
+	return old;
+}
+
+bool
+hashmap_del(hashmap *map, const void *key)
+{
+	if (!map) return false;
+
+	uint64_t hash = (*map->hash)(key);
+	free_later_enter();
+	bool deleted = hashmap_do_del(map, key, hash);
+	free_later_exit();
+	return deleted;
+}
+
+void
+hashmap_iter_init(hashmap *map, hashmap_iter *iter, uint32_t part, uint32_t parts)
+{
+	// keep nodes that the walk reaches from being released until it is done
+	free_later_enter();
+
+	iter->map = map;
+	iter->part = part;
+	iter->parts = parts ? parts : 1;
+	iter->table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+	iter->overflow = false;
+	iter->num_pending = 0;
+	iter->node = NULL;
+
+	// every table size is `min_buckets` times a power of two, and so is `span`. parts
+	// split `span` into ranges, so threads that started with different tables still
+	// agree on which part an entry belongs to
+	uint64_t span = map->min_buckets;
+	while (span < (uint64_t)iter->parts * HASHMAP_ITER_SPLIT) span <<= 1;
+	iter->span = span;
+	uint64_t first = ((uint64_t)iter->part * span + iter->parts - 1) / iter->parts;
+	uint64_t last = ((uint64_t)(iter->part + 1) * span + iter->parts - 1) / iter->parts;
+
+	// the range repeats every `span` buckets of a larger table. a smaller table folds
+	// the range onto itself, and entries of other parts are skipped in the walk
+	uint32_t num_buckets = iter->table->num_buckets;
+	if (num_buckets >= span) {
+		iter->run = last - first;
+		iter->count = iter->run * (num_buckets / span);
+	}
+	else {
+		iter->run = last - first < num_buckets ? last - first : num_buckets;
+		iter->count = iter->run;
+	}
+	iter->first = first;
+	iter->index = 0;
+}
+
+bool
+hashmap_iter_next(hashmap_iter *iter, const void **key, void **value)
+{
+	while (true) {
+		// walk the current chain
+		while (iter->node) {
+			hashmap_keyval *n = iter->node;
+			hashmap_keyval *next = __atomic_load_n(&n->next, __ATOMIC_SEQ_CST);
+			iter->node = unmark(next);
+
+			if (is_deleted(next)) continue;
+			// a shrink merges buckets, skip entries that belong to another bucket of the walk
+			if (n->hash % iter->from_size != iter->from) continue;
+			if ((n->hash % iter->span) * iter->parts / iter->span != iter->part) continue;
+
+			*key = n->key;
+			*value = __atomic_load_n(&n->value, __ATOMIC_SEQ_CST);
+			return true;
+		}
+
+		// visit the next queued bucket. a moved one queues the buckets it moved to
+		if (iter->num_pending) {
+			iter->num_pending -= 1;
+			hashmap_table *table = iter->pending[iter->num_pending].table;
+			uint32_t bucket = iter->pending[iter->num_pending].bucket;
+			uint32_t from_size = iter->pending[iter->num_pending].from_size;
+			uint32_t from = iter->pending[iter->num_pending].from;
+
+			// a bucket at least as fine as the filter narrows it down to its own entries.
+			// one that holds none of them, as after a shrink and a grow, is skipped
+			if (table->num_buckets >= from_size) {
+				if (bucket % from_size != from) continue;
+				from_size = table->num_buckets;
+				from = bucket;
 			}
 
-			// failure means the whole match/del process needs another attempt 
-			hashmap_del_fail_new_head += 1;
+			hashmap_keyval *head = __atomic_load_n(&table->buckets[bucket], __ATOMIC_SEQ_CST);
+			if (head != MOVED) {
+				iter->node = unmark(head);
+				iter->from_size = from_size;
+				iter->from = from;
+				continue;
+			}
+
+			hashmap_table *next = __atomic_load_n(&table->next, __ATOMIC_SEQ_CST);
+			uint32_t first = bucket % next->num_buckets;
+			uint32_t step = table->num_buckets;
+			if (iter->num_pending + (next->num_buckets - first + step - 1) / step > HASHMAP_ITER_DEPTH) {
+				iter->overflow = true;
+				iter->num_pending = 0;
+				iter->index = iter->count;
+				return false;
+			}
+			for (uint32_t j = first; j < next->num_buckets; j += step) {
+				iter->pending[iter->num_pending].table = next;
+				iter->pending[iter->num_pending].bucket = j;
+				iter->pending[iter->num_pending].from_size = from_size;
+				iter->pending[iter->num_pending].from = from;
+				iter->num_pending += 1;
+			}
+			continue;
 		}
+
+		// move on to the part's next bucket of the table the walk started with
+		if (iter->index >= iter->count) return false;
+		uint64_t offset = iter->first + (uint64_t)(iter->index / iter->run) * iter->span + iter->index % iter->run;
+		iter->bucket = offset % iter->table->num_buckets;
+		iter->index += 1;
+		iter->pending[0].table = iter->table;
+		iter->pending[0].bucket = iter->bucket;
+		iter->pending[0].from_size = 1;
+		iter->pending[0].from = 0;
+		iter->num_pending = 1;
 	}
+}
 
-	return false;
+void
+hashmap_iter_done(hashmap_iter *iter)
+{
+	iter->node = NULL;
+	iter->num_pending = 0;
+	free_later_exit();
+}
+
+void
+hashmap_foreach(hashmap *map, void fn(const void *key, void *value, void *arg), void *arg)
+{
+	hashmap_iter iter;
+	const void *key;
+	void *value;
+
+	hashmap_iter_init(map, &iter, 0, 1);
+	while (hashmap_iter_next(&iter, &key, &value)) {
+		fn(key, value, arg);
+	}
+	hashmap_iter_done(&iter);
 }
@@ -1,8 +1,12 @@
 /**
  * Lock-Free Hashmap
  *
- * This implementation is thread safe and lock free. It will perform well as long as
- * the initial bucket size is large enough.
+ * This implementation is thread safe and lock free. The bucket array grows and
+ * shrinks with the number of entries. A resize links a new table to the current one
+ * and every `hashmap_put` and `hashmap_del` helps migrate a few buckets into it, so
+ * no thread ever has to stop and wait for the whole table to be copied. Once every
+ * bucket has been claimed, helpers also move buckets that another thread claimed but
+ * hasn't finished, so a thread that stalls mid-claim can't hold up the resize.
  */
 #ifndef JFALKNER_HASHMAP_H
 #define JFALKNER_HASHMAP_H
@@ -11,56 +15,269 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
-// links in the linked lists that each bucket uses
+#include "counter.h"
+#include "objpool.h"
+#include "hazard.h"
+
+// links in the linked lists that each bucket uses. `next` and `value` are swapped
+// together with a 16-byte CAS, so `create_node` must return 16-byte aligned memory
 typedef struct hashmap_keyval_s {
 	struct hashmap_keyval_s *next;
-	const void *key;
 	void *value;
-} hashmap_keyval;
+	// result of `hash(key)`, compared before calling `cmp` and re-used on resize
+	uint64_t hash;
+	const void *key;
+} __attribute__((aligned(16))) hashmap_keyval;
 
-// main hashmap struct with buckets of linked lists
-typedef struct hashmap_s {
+// one generation of buckets. a resize links the replacement table as `next`
+typedef struct hashmap_table_s {
 	// buckets
 	hashmap_keyval **buckets;
 	uint32_t num_buckets;
 
-	// total count of entries
-	uint32_t length;
+	// table that buckets are being migrated to. NULL unless a resize is running
+	struct hashmap_table_s *next;
+	// next bucket to claim for migration and how many have been moved so far
+	uint32_t migrate_next;
+	uint32_t migrate_done;
+	// buckets before this one are known to be moved. see `hashmap_help_resize`
+	uint32_t migrate_scan;
+} hashmap_table;
+
+// main hashmap struct with buckets of linked lists
+typedef struct hashmap_s {
+	// current table. may be in the middle of migrating to `table->next`
+	hashmap_table *table;
+	// shrinking never goes below the bucket count the map was made with
+	uint32_t min_buckets;
+
+	// total count of entries. see `hashmap_length`
+	counter length;
 
 	// pointer to the hash and comparison functions
 	uint64_t (*hash)(const void *key);
 	uint8_t (*cmp)(const void *x, const void *y);
-	
-	// custom memory management of internal linked lists 
+
+	// custom memory management of internal linked lists. the default hooks free only the
+	// map's own nodes, and also pass removed or replaced values to `opaque` if it is set
+	// to a release function such as `free`
 	void *opaque;
 	hashmap_keyval * (*create_node)(void *opaque, const void *key, void *data);
 	void (*destroy_node)(void *opaque, hashmap_keyval *node);
+	// releases just the node, not its key or value. used for nodes a resize copied
+	void (*release_node)(void *opaque, hashmap_keyval *node);
+	// releases a value that `hashmap_put` replaced
+	void (*destroy_value)(void *opaque, void *value);
+
+	// when set, removed and replaced values are retired to this domain and released
+	// with `release_value` instead of being passed to the hooks above
+	hazard_domain *hazards;
+	void (*release_value)(void *value);
+
+	// keys belong to the caller unless this is set to a release function such as `free`.
+	// a removed key is passed to it through `free_later`, since other threads may still
+	// be passing it to `cmp`. callers that release keys themselves must do the same
+	void (*release_key)(void *key);
 } hashmap;
 
+// most buckets an iterator can have queued while following buckets into newer tables
+#define HASHMAP_ITER_DEPTH 32
+// least buckets of `span` per part of a walk, so parts differ in size by under 1/64
+#define HASHMAP_ITER_SPLIT 64
+
+// position of a walk over the entries of a hashmap. see `hashmap_iter_init`
+typedef struct hashmap_iter_s {
+	hashmap *map;
+	// only entries with `(hash % span) * parts / span == part` are visited
+	uint32_t part;
+	uint32_t parts;
+	// a table size that is a multiple or a divisor of every size the map can have, so
+	// that a part is a contiguous range of buckets in any table
+	uint64_t span;
+
+	// table the walk started with and the bucket of it being visited
+	hashmap_table *table;
+	uint32_t bucket;
+	// set if the walk stopped because it fell `HASHMAP_ITER_DEPTH` tables behind the map
+	bool overflow;
+	// the part's buckets of `table` are `count` buckets, in runs of `run` that are `span`
+	// apart, starting at `first`. `index` counts the ones already visited
+	uint32_t first;
+	uint32_t run;
+	uint32_t count;
+	uint32_t index;
+
+	// buckets left to walk for `bucket`, which may have moved into newer tables. only
+	// entries with `hash % from_size == from` are returned from each, so that buckets a
+	// shrink merges back together don't return each other's entries
+	struct {
+		hashmap_table *table;
+		uint32_t bucket;
+		uint32_t from_size;
+		uint32_t from;
+	} pending[HASHMAP_ITER_DEPTH];
+	uint32_t num_pending;
+
+	// node to check next, and the entries of its chain that belong to the walk
+	hashmap_keyval *node;
+	uint32_t from_size;
+	uint32_t from;
+} hashmap_iter;
+
 
 /**
  * Creates and initializes a new hashmap
+ *
+ * `hint` is the initial number of buckets. The map grows past it as entries are
+ * added and shrinks back toward it as they are removed.
  */
 void * hashmap_new(uint32_t hint, uint8_t cmp(const void *x, const void *y), uint64_t hash(const void *key));
 
+/**
+ * Makes the map take its nodes from `pool` instead of `malloc`
+ *
+ * Must be called before the map is used. The pool's objects must be at least
+ * `sizeof(hashmap_keyval)` bytes and may be shared by several maps. Removed nodes go
+ * back to the pool through `free_later`, so they are only re-used after the grace
+ * period. The map never releases values when it is backed by a pool. Keys are handled
+ * as in any other map: they belong to the caller unless `release_key` is set, in which
+ * case a removed node's key is passed to it through `free_later`.
+ */
+extern void hashmap_use_pool(hashmap *map, objpool *pool);
+
 /**
  * Returns a value mapped to the key or NULL, if no entry exists for the given key
  */
 extern void * hashmap_get(hashmap *map, const void *key);
 
+/**
+ * Makes the map retire values it removes or replaces through hazard pointers
+ *
+ * Must be called before the map is used. Use this for maps whose readers hold values
+ * for a long time: a reader with a value from `hashmap_get_protected` only keeps that
+ * one value from being released, instead of holding back all reclamation. `release`
+ * is called on each value once no slot protects it, and may be NULL if the caller
+ * owns the values. The map's own nodes are still reclaimed with `free_later`, since
+ * the map only holds on to those for the length of a call.
+ */
+extern void hashmap_use_hazards(hashmap *map, hazard_domain *domain, void release(void *value));
+
+/**
+ * Looks up a key like `hashmap_get` and protects the value with `slot`, which must be
+ * a slot from the map's hazard domain
+ *
+ * The value stays valid until the slot is cleared with `hazard_release`, even if it is
+ * replaced or deleted in the meantime. The slot is cleared if the key isn't found.
+ */
+extern void * hashmap_get_protected(hashmap *map, const void *key, void **slot);
+
+/**
+ * Returns the number of entries in the map
+ *
+ * The count is exact once other threads stop changing the map. Code that only needs
+ * an estimate, such as a load check, can use `counter_read_approx(&map->length)`.
+ */
+extern uint32_t hashmap_length(hashmap *map);
+
 /**
  * Puts the given key, value pair in the map
  *
- * Returns true if an existing matching key was replaced. Otherwise, false.
+ * Returns true if an existing matching key was replaced. Otherwise, false. A replace
+ * swaps the value in place and keeps the key already in the map, so the caller still
+ * owns `key`. The old value is passed to `destroy_value`.
  */
 extern bool hashmap_put(hashmap *map, const void *key, void *value);
 
+/**
+ * Puts the given key, value pair in the map only if the key isn't already in it
+ *
+ * Returns true if the pair was added. Otherwise, false and the map is unchanged.
+ */
+extern bool hashmap_put_if_absent(hashmap *map, const void *key, void *value);
+
+/**
+ * Replaces the key's value with `desired` if it is currently `expected`
+ *
+ * Returns true if the value was replaced. The map does not release `expected`.
+ */
+extern bool hashmap_replace_value(hashmap *map, const void *key, void *expected, void *desired);
+
+/**
+ * Atomically replaces the key's value with `update(key, value, arg)`
+ *
+ * `update` gets NULL if the key is missing, and the key is added unless it returns
+ * NULL too. It may run more than once if other threads change the value, so it must
+ * not have side effects. The map does not release the old value. Returns the new value.
+ */
+extern void * hashmap_compute(hashmap *map, const void *key, void *update(const void *key, void *value, void *arg), void *arg);
+
+/**
+ * Treats the key's value as an integer and adds `delta` to it in place
+ *
+ * A missing key counts from zero. Returns the value from before the add.
+ */
+extern uintptr_t hashmap_fetch_add(hashmap *map, const void *key, uintptr_t delta);
+
+/**
+ * Looks up `count` keys and stores each one's value, or NULL, in `values`
+ *
+ * Keys are hashed and their buckets prefetched a batch at a time, then the chains are
+ * walked in an interleaved fashion, so the cache misses of different keys overlap
+ * instead of being paid one after another.
+ */
+extern void hashmap_get_many(hashmap *map, const void **keys, uint32_t count, void **values);
+
+/**
+ * Puts `count` key, value pairs, prefetching their buckets a batch at a time
+ *
+ * Returns the number of existing matching keys that were replaced.
+ */
+extern uint32_t hashmap_put_many(hashmap *map, const void **keys, void **values, uint32_t count);
+
 /**
  * Removes the given key, value pair in the map
  *
  * Returns true if a key was found. Otherwise, false. This method is guaranteed to
  * return true just once, if multiple threads are attempting to delete the same key.
+ *
+ * The map's key is passed to `release_key` if it is set. Otherwise it stays with the
+ * caller, who must release it with `free_later` rather than `free`, since concurrent
+ * readers may still be comparing it.
  */
 extern bool hashmap_del(hashmap *map, const void *key);
 
+/**
+ * Starts a walk over the entries of the map that may run alongside any other method
+ *
+ * The walk is weakly consistent: every entry that is in the map for the whole walk is
+ * returned exactly once, and entries added or removed during it may or may not be.
+ * The walk stays in a `free_later` section, so nodes it reaches stay valid until
+ * `hashmap_iter_done`, which must be called from the same thread.
+ *
+ * To scan in parallel, give each of `parts` threads a different `part`. Each thread
+ * walks a contiguous range of about 1/`parts` of the buckets and gets the entries of
+ * those buckets, whichever table each thread started with. Use part 0 of 1 to walk
+ * everything.
+ */
+extern void hashmap_iter_init(hashmap *map, hashmap_iter *iter, uint32_t part, uint32_t parts);
+
+/**
+ * Gets the next entry of the walk
+ *
+ * Returns true and sets `key` and `value`, or false once there are no more entries.
+ * Following a bucket through more resizes than the walk has room for also returns
+ * false, with `overflow` set, and the walk should then be started over.
+ */
+extern bool hashmap_iter_next(hashmap_iter *iter, const void **key, void **value);
+
+/**
+ * Ends a walk. Must be called once for every `hashmap_iter_init`
+ */
+extern void hashmap_iter_done(hashmap_iter *iter);
+
+/**
+ * Calls `fn` for every entry of the map, with the same guarantees as `hashmap_iter_init`
+ */
+extern void hashmap_foreach(hashmap *map, void fn(const void *key, void *value, void *arg), void *arg);
+
 #endif // JFALKNER_HASHMAP_H
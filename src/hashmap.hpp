@@ -0,0 +1,842 @@
+/**
+ * Lock-Free Hashmap for C++
+ *
+ * `lockfree::HashMap<K, V, Hash, Eq, Alloc>` is the algorithm of `hashmap.c` as a
+ * C++17 template, so that `Hash` and `Eq` are inlined into the walk instead of being
+ * called through function pointers, and keys and values are real C++ objects instead
+ * of `void *`. The map is header-only and needs only `free_later` and `counter` from
+ * the C library.
+ *
+ * Nodes hold the key and the value. A resize copies nodes into the new table, so keys
+ * that can throw while being copied, such as `std::string`, are constructed once in a
+ * box of their own that the copies share. Values that are trivially copyable and fit in 8
+ * bytes are stored in the node itself and swapped together with `next` in one 16-byte
+ * CAS, like `hashmap`. Any other value is constructed once, in place, in a box of its
+ * own, and the CAS swaps the pointer to the box. Either way a value is never changed
+ * after it is published, so readers need no locks.
+ *
+ * Removed nodes and replaced values are destroyed through `free_later`. Each call of
+ * the map runs inside a `lockfree::Guard`, which enters a `free_later` section for as
+ * long as it lives. `visit` hands the callback a reference that is valid until it
+ * returns, and callers that want to hold on to more can keep a `Guard` of their own,
+ * since sections nest.
+ *
+ * `Hash` may be weak, such as the default `std::hash` of integers, which is the identity.
+ * Its result is mixed before it picks a bucket.
+ *
+ * Lookups are transparent when both `Hash` and `Eq` have an `is_transparent` member,
+ * as `lockfree::StringHash` and `std::equal_to<>` do. A map with `std::string` keys can
+ * then be searched with a `std::string_view` or a C string without making a
+ * `std::string`.
+ *
+ *     lockfree::HashMap<std::string, Session, lockfree::StringHash> sessions;
+ *     sessions.try_emplace(id, user, now);
+ *     sessions.visit(std::string_view(buf, len), [](const Session &s) { ... });
+ *
+ * `Alloc` allocates nodes and boxes, rebound to their types. Since they are released
+ * after the call that removed them has returned, it must be stateless.
+ */
+#ifndef JFALKNER_HASHMAP_HPP
+#define JFALKNER_HASHMAP_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "counter.h"
+#include "free_later.h"
+}
+
+namespace lockfree {
+
+/**
+ * Keeps the calling thread in a `free_later` section for as long as it lives, so that
+ * nothing the map removes meanwhile is destroyed under it
+ */
+class Guard {
+public:
+	Guard() { free_later_enter(); }
+	~Guard() { free_later_exit(); }
+	Guard(const Guard &) = delete;
+	Guard &operator=(const Guard &) = delete;
+};
+
+/**
+ * Hashes `std::string`, `std::string_view` and C strings alike, for transparent lookups
+ */
+struct StringHash {
+	using is_transparent = void;
+	size_t operator()(std::string_view s) const noexcept { return std::hash<std::string_view>()(s); }
+};
+
+template <class K, class V, class Hash = std::hash<K>, class Eq = std::equal_to<>, class Alloc = std::allocator<std::pair<const K, V>>>
+class HashMap {
+	static_assert(std::allocator_traits<Alloc>::is_always_equal::value, "nodes are released by free_later, so the allocator must be stateless");
+
+	// grow, shrink and migrate at the same points as `hashmap`
+	static constexpr uint32_t GROW_LOAD = 1;
+	static constexpr uint32_t SHRINK_LOAD = 8;
+	static constexpr uint32_t MIGRATE_STEP = 4;
+	static constexpr uint32_t MIGRATE_SCAN = 64;
+
+	// values that are stored in the node instead of in a box
+	static constexpr bool INLINE = std::is_trivially_copyable_v<V> && sizeof(V) <= sizeof(uint64_t);
+	// keys that are stored in the node instead of in a box. copying them can't fail
+	// halfway through a resize
+	static constexpr bool KEY_INLINE = std::is_nothrow_copy_constructible_v<K>;
+	using KeySlot = std::conditional_t<KEY_INLINE, K, const K *>;
+
+	struct Box {
+		V value;
+		template <class... Args>
+		explicit Box(Args &&...args) : value(std::forward<Args>(args)...) {}
+	};
+
+	struct alignas(16) Node {
+		// `next` and `value` come first and are swapped together
+		Node *next;
+		// the value's bits, or a pointer to its box
+		uint64_t value;
+		uint64_t hash;
+		// the key, or a pointer to its box
+		KeySlot slot;
+
+		template <class KK>
+		Node(KK &&k, uint64_t h) : next(nullptr), value(0), hash(h), slot(std::forward<KK>(k)) {}
+
+		const K &key() const {
+			if constexpr (KEY_INLINE) return slot;
+			else return *slot;
+		}
+	};
+
+	struct Table {
+		Node **buckets;
+		uint32_t num_buckets;
+		// table that buckets are being migrated to. null unless a resize is running
+		Table *next;
+		uint32_t migrate_next;
+		uint32_t migrate_done;
+		// buckets before this one are known to be moved
+		uint32_t migrate_scan;
+	};
+
+	// where a key was found, or where it would be added, as in `hashmap`
+	struct Cursor {
+		Table *table;
+		Node *head;
+		Node **prev;
+		Node *match;
+		Node *next;
+	};
+
+	union Pair {
+		struct {
+			Node *next;
+			uint64_t value;
+		} link;
+		unsigned __int128 word;
+	};
+
+	using NodeAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Node>;
+	using BoxAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Box>;
+	using KeyAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<K>;
+	using TableAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Table>;
+	using BucketAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Node *>;
+
+	// marks on the low bits of links, as in `hashmap`
+	static constexpr uintptr_t FROZEN = 1;
+	static constexpr uintptr_t DELETED = 2;
+
+	Table *table_;
+	uint32_t min_buckets_;
+	mutable counter length_;
+	Hash hash_;
+	Eq eq_;
+
+public:
+	explicit HashMap(uint32_t hint = 16, const Hash &hash = Hash(), const Eq &eq = Eq())
+		: table_(nullptr), min_buckets_(hint ? hint : 1), length_(), hash_(hash), eq_(eq) {
+		table_ = table_new(min_buckets_, nullptr);
+	}
+
+	/**
+	 * Destroys every entry. No other thread may be using the map
+	 */
+	~HashMap() {
+		if (table_) clear_tables();
+	}
+
+	HashMap(const HashMap &) = delete;
+	HashMap &operator=(const HashMap &) = delete;
+
+	HashMap(HashMap &&other) noexcept
+		: table_(other.table_), min_buckets_(other.min_buckets_), length_(), hash_(std::move(other.hash_)), eq_(std::move(other.eq_)) {
+		counter_add(&length_, counter_read(&other.length_));
+		other.table_ = nullptr;
+		counter_reset(&other.length_);
+	}
+
+	HashMap &operator=(HashMap &&other) noexcept {
+		if (this != &other) {
+			if (table_) clear_tables();
+			table_ = other.table_;
+			min_buckets_ = other.min_buckets_;
+			hash_ = std::move(other.hash_);
+			eq_ = std::move(other.eq_);
+			counter_reset(&length_);
+			counter_add(&length_, counter_read(&other.length_));
+			other.table_ = nullptr;
+			counter_reset(&other.length_);
+		}
+		return *this;
+	}
+
+	/**
+	 * Returns a copy of the key's value, or nothing if the key isn't in the map
+	 */
+	template <class Q>
+	std::optional<V> get(const Q &key) const {
+		std::optional<V> value;
+		visit(key, [&value](const V &v) { value.emplace(v); });
+		return value;
+	}
+
+	/**
+	 * Calls `f` with the key's value and returns true, or returns false if the key isn't
+	 * in the map. The reference is valid until `f` returns
+	 */
+	template <class Q, class F>
+	bool visit(const Q &key, F &&f) const {
+		check_lookup<Q>();
+		uint64_t hash = hash_of(key);
+		Guard guard;
+		Table *table = __atomic_load_n(&table_, __ATOMIC_SEQ_CST);
+		for (Node *n = unmark(head(&table, hash)); n; ) {
+			Node *next = __atomic_load_n(&n->next, __ATOMIC_SEQ_CST);
+			if (!is_deleted(next) && n->hash == hash && eq_(n->key(), key)) {
+				uint64_t bits = __atomic_load_n(&n->value, __ATOMIC_SEQ_CST);
+				if constexpr (INLINE) {
+					f(static_cast<const V &>(from_bits(bits)));
+				}
+				else {
+					f(static_cast<const V &>(reinterpret_cast<Box *>(bits)->value));
+				}
+				return true;
+			}
+			n = unmark(next);
+		}
+		return false;
+	}
+
+	template <class Q>
+	bool contains(const Q &key) const {
+		return visit(key, [](const V &) {});
+	}
+
+	/**
+	 * Adds the key with a value constructed from `args` unless the key is already in the
+	 * map, in which case nothing is constructed. Returns true if it was added
+	 */
+	template <class KK, class... Args>
+	bool try_emplace(KK &&key, Args &&...args) {
+		uint64_t hash = hash_of(key);
+		Guard guard;
+		Cursor cursor;
+		if (find(key, hash, &cursor)) return false;
+
+		Node *node = node_new(std::forward<KK>(key), hash);
+		uint64_t bits = value_new(node, std::forward<Args>(args)...);
+		while (!insert(&cursor, node, bits, hash)) {
+			if (find(node->key(), hash, &cursor)) {
+				destroy_node(node);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Puts the key with `value`, replacing the value it has. Returns true if the key was
+	 * added and false if its value was replaced, like `std::unordered_map`
+	 */
+	template <class KK, class VV>
+	bool insert_or_assign(KK &&key, VV &&value) {
+		uint64_t hash = hash_of(key);
+		Guard guard;
+		Node *node = nullptr;
+		uint64_t bits = value_new(nullptr, std::forward<VV>(value));
+		Cursor cursor;
+		while (true) {
+			// once the key is moved into a node, look for the node's copy of it
+			bool found = node ? find(node->key(), hash, &cursor) : find(key, hash, &cursor);
+			if (found) {
+				uint64_t old = __atomic_load_n(&cursor.match->value, __ATOMIC_SEQ_CST);
+				if (swap_value(cursor.match, cursor.next, old, bits)) {
+					// a node made by an earlier attempt was never linked
+					if (node) discard_node(node);
+					retire_value(old);
+					help_resize();
+					return false;
+				}
+			}
+			else {
+				if (!node) {
+					try {
+						node = node_new(std::forward<KK>(key), hash);
+					}
+					catch (...) {
+						destroy_value(bits);
+						throw;
+					}
+				}
+				if (insert(&cursor, node, bits, hash)) return true;
+			}
+		}
+	}
+
+	/**
+	 * Removes the key. Returns true if it was in the map. Just one of several threads
+	 * that remove the same key gets true
+	 */
+	template <class Q>
+	bool erase(const Q &key) {
+		check_lookup<Q>();
+		uint64_t hash = hash_of(key);
+		Guard guard;
+		Cursor cursor;
+		while (find(key, hash, &cursor)) {
+			// mark the node as deleted. just one thread can, and its value can't change after
+			Node *deleted = mark(cursor.next, DELETED);
+			if (!__atomic_compare_exchange_n(&cursor.match->next, &cursor.next, deleted, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue;
+			counter_add(&length_, -1);
+
+			// unlink it, or if the previous link changed, walk again so the walk unlinks it
+			Node *match = cursor.match;
+			if (__atomic_compare_exchange_n(cursor.prev, &match, cursor.next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				retire_node(cursor.match);
+			}
+			else {
+				find(key, hash, &cursor);
+			}
+			help_resize();
+			check_load();
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Returns the number of entries, exact once other threads stop changing the map
+	 */
+	size_t size() const {
+		int64_t length = counter_read(&length_);
+		return length > 0 ? length : 0;
+	}
+
+private:
+	/**
+	 * Runs the user's hash through splitmix64's finalizer. Buckets are `hash % num_buckets`
+	 * of a power-of-two table, and `std::hash` is the identity for integers and pointers,
+	 * so keys such as aligned pointers would otherwise share a few buckets
+	 */
+	static uint64_t mix(uint64_t hash) {
+		hash ^= hash >> 30;
+		hash *= 0xbf58476d1ce4e5b9ULL;
+		hash ^= hash >> 27;
+		hash *= 0x94d049bb133111ebULL;
+		hash ^= hash >> 31;
+		return hash;
+	}
+
+	template <class Q>
+	uint64_t hash_of(const Q &key) const {
+		return mix(hash_(key));
+	}
+
+	template <class Q>
+	static constexpr void check_lookup() {
+		constexpr bool transparent = is_transparent<Hash>::value && is_transparent<Eq>::value;
+		static_assert(transparent || std::is_convertible_v<const Q &, const K &>,
+			"lookups by another type than K need a Hash and an Eq with is_transparent");
+	}
+
+	template <class T, class = void>
+	struct is_transparent : std::false_type {};
+	template <class T>
+	struct is_transparent<T, std::void_t<typename T::is_transparent>> : std::true_type {};
+
+	static bool is_frozen(Node *n) { return reinterpret_cast<uintptr_t>(n) & FROZEN; }
+	static bool is_deleted(Node *n) { return reinterpret_cast<uintptr_t>(n) & DELETED; }
+	static Node *mark(Node *n, uintptr_t bits) { return reinterpret_cast<Node *>(reinterpret_cast<uintptr_t>(n) | bits); }
+	static Node *unmark(Node *n) { return reinterpret_cast<Node *>(reinterpret_cast<uintptr_t>(n) & ~(FROZEN | DELETED)); }
+
+	// bucket heads of buckets that were migrated or not filled in yet. they are only
+	// compared, never followed, so any 16-byte aligned address without marks works
+	static Node *moved() { return reinterpret_cast<Node *>(uintptr_t(16)); }
+	static Node *unfilled() { return reinterpret_cast<Node *>(uintptr_t(32)); }
+
+	static uint64_t to_bits(const V &value) {
+		uint64_t bits = 0;
+		std::memcpy(&bits, &value, sizeof(V));
+		return bits;
+	}
+
+	static V from_bits(uint64_t bits) {
+		V value;
+		std::memcpy(&value, &bits, sizeof(V));
+		return value;
+	}
+
+	template <class KK>
+	static Node *node_new(KK &&key, uint64_t hash) {
+		if constexpr (KEY_INLINE) {
+			NodeAlloc alloc;
+			Node *node = std::allocator_traits<NodeAlloc>::allocate(alloc, 1);
+			try {
+				std::allocator_traits<NodeAlloc>::construct(alloc, node, std::forward<KK>(key), hash);
+			}
+			catch (...) {
+				std::allocator_traits<NodeAlloc>::deallocate(alloc, node, 1);
+				throw;
+			}
+			return node;
+		}
+		else {
+			KeyAlloc keys;
+			K *k = std::allocator_traits<KeyAlloc>::allocate(keys, 1);
+			try {
+				std::allocator_traits<KeyAlloc>::construct(keys, k, std::forward<KK>(key));
+			}
+			catch (...) {
+				std::allocator_traits<KeyAlloc>::deallocate(keys, k, 1);
+				throw;
+			}
+			try {
+				return node_copy(k, hash);
+			}
+			catch (...) {
+				std::allocator_traits<KeyAlloc>::destroy(keys, k);
+				std::allocator_traits<KeyAlloc>::deallocate(keys, k, 1);
+				throw;
+			}
+		}
+	}
+
+	/**
+	 * Makes a node with a copy of `slot`, which can only throw if the node can't be
+	 * allocated. A boxed key is shared, not copied
+	 */
+	static Node *node_copy(const KeySlot &slot, uint64_t hash) {
+		NodeAlloc alloc;
+		Node *node = std::allocator_traits<NodeAlloc>::allocate(alloc, 1);
+		std::allocator_traits<NodeAlloc>::construct(alloc, node, slot, hash);
+		return node;
+	}
+
+	/**
+	 * Constructs a value from `args` and returns its bits. If that throws, `node` is
+	 * released first
+	 */
+	template <class... Args>
+	static uint64_t value_new(Node *node, Args &&...args) {
+		if constexpr (INLINE) {
+			return to_bits(V(std::forward<Args>(args)...));
+		}
+		else {
+			BoxAlloc alloc;
+			Box *box = std::allocator_traits<BoxAlloc>::allocate(alloc, 1);
+			try {
+				std::allocator_traits<BoxAlloc>::construct(alloc, box, std::forward<Args>(args)...);
+			}
+			catch (...) {
+				std::allocator_traits<BoxAlloc>::deallocate(alloc, box, 1);
+				if (node) discard_node(node);
+				throw;
+			}
+			return reinterpret_cast<uint64_t>(box);
+		}
+	}
+
+	static void destroy_value(uint64_t bits) {
+		if constexpr (!INLINE) {
+			BoxAlloc alloc;
+			Box *box = reinterpret_cast<Box *>(bits);
+			std::allocator_traits<BoxAlloc>::destroy(alloc, box);
+			std::allocator_traits<BoxAlloc>::deallocate(alloc, box, 1);
+		}
+	}
+
+	static void destroy_key(Node *node) {
+		if constexpr (!KEY_INLINE) {
+			KeyAlloc keys;
+			K *key = const_cast<K *>(node->slot);
+			std::allocator_traits<KeyAlloc>::destroy(keys, key);
+			std::allocator_traits<KeyAlloc>::deallocate(keys, key, 1);
+		}
+	}
+
+	// releases just the node, whose boxed key and value live on in a copy of it
+	static void release_node(Node *node) {
+		NodeAlloc alloc;
+		std::allocator_traits<NodeAlloc>::destroy(alloc, node);
+		std::allocator_traits<NodeAlloc>::deallocate(alloc, node, 1);
+	}
+
+	// releases a node that was never linked and has no value yet, along with its key
+	static void discard_node(Node *node) {
+		destroy_key(node);
+		release_node(node);
+	}
+
+	// releases a node along with its key and value
+	static void destroy_node(Node *node) {
+		destroy_value(node->value);
+		destroy_key(node);
+		release_node(node);
+	}
+
+	// `free_later` callbacks for the functions above
+	static void release_node_later(void *node) { release_node(static_cast<Node *>(node)); }
+	static void destroy_node_later(void *node) { destroy_node(static_cast<Node *>(node)); }
+	static void destroy_value_later(void *box) { destroy_value(reinterpret_cast<uint64_t>(box)); }
+
+	/**
+	 * Releases an unlinked node and its value once no thread can be reading them
+	 */
+	static void retire_node(Node *node) {
+		free_later(node, destroy_node_later);
+	}
+
+	/**
+	 * Releases a value that was replaced once no thread can be reading it
+	 */
+	static void retire_value(uint64_t bits) {
+		if constexpr (!INLINE) {
+			free_later(reinterpret_cast<void *>(bits), destroy_value_later);
+		}
+	}
+
+	static Table *table_new(uint32_t num_buckets, Node *head) {
+		TableAlloc tables;
+		BucketAlloc buckets;
+		Table *table = std::allocator_traits<TableAlloc>::allocate(tables, 1);
+		table->buckets = std::allocator_traits<BucketAlloc>::allocate(buckets, num_buckets);
+		table->num_buckets = num_buckets;
+		table->next = nullptr;
+		table->migrate_next = 0;
+		table->migrate_done = 0;
+		table->migrate_scan = 0;
+		for (uint32_t i = 0; i < num_buckets; i++) {
+			table->buckets[i] = head;
+		}
+		return table;
+	}
+
+	static void table_free(Table *table) {
+		TableAlloc tables;
+		BucketAlloc buckets;
+		std::allocator_traits<BucketAlloc>::deallocate(buckets, table->buckets, table->num_buckets);
+		std::allocator_traits<TableAlloc>::deallocate(tables, table, 1);
+	}
+
+	static void table_free_later(void *table) { table_free(static_cast<Table *>(table)); }
+
+	/**
+	 * Destroys every node still linked in a table, with its key and value, and then
+	 * frees the tables. Nodes of buckets that were moved already went to `free_later`
+	 * when they were, and buckets of a newer table that weren't filled yet have none
+	 */
+	void clear_tables() {
+		for (Table *table = table_; table; ) {
+			for (uint32_t i = 0; i < table->num_buckets; i++) {
+				Node *n = unmark(table->buckets[i]);
+				if (n == moved() || n == unfilled()) continue;
+				while (n) {
+					Node *next = unmark(n->next);
+					destroy_node(n);
+					n = next;
+				}
+			}
+			Table *next = table->next;
+			table_free(table);
+			table = next;
+		}
+		table_ = nullptr;
+	}
+
+	static uint32_t groups(Table *table, Table *next) {
+		return table->num_buckets < next->num_buckets ? table->num_buckets : next->num_buckets;
+	}
+
+	/**
+	 * Returns the head of the bucket for `hash`, following buckets that were moved to a
+	 * newer table. `table` is updated to the table that owns the returned bucket
+	 */
+	static Node *head(Table **table, uint64_t hash) {
+		Table *t = *table;
+		Node *head = __atomic_load_n(&t->buckets[hash % t->num_buckets], __ATOMIC_SEQ_CST);
+		while (head == moved()) {
+			t = __atomic_load_n(&t->next, __ATOMIC_SEQ_CST);
+			head = __atomic_load_n(&t->buckets[hash % t->num_buckets], __ATOMIC_SEQ_CST);
+		}
+		*table = t;
+		return head;
+	}
+
+	/**
+	 * Freezes a bucket and then every link of its chain. Returns the chain or `moved()`
+	 */
+	static Node *freeze_bucket(Node **bucket) {
+		Node *head = __atomic_load_n(bucket, __ATOMIC_SEQ_CST);
+		while (!is_frozen(head)) {
+			if (head == moved()) return moved();
+			if (__atomic_compare_exchange_n(bucket, &head, mark(head, FROZEN), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break;
+		}
+		head = unmark(head);
+
+		for (Node *n = head; n; ) {
+			Node *next = __atomic_load_n(&n->next, __ATOMIC_SEQ_CST);
+			while (!is_frozen(next)) {
+				if (__atomic_compare_exchange_n(&n->next, &next, mark(next, FROZEN), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break;
+			}
+			n = unmark(next);
+		}
+		return head;
+	}
+
+	/**
+	 * Migrates one group of buckets from `table` to `table->next`, see `hashmap_migrate`.
+	 * Copies share the value and any boxed key of the node they copy, so the old nodes
+	 * are released without them. Copying can only throw if a node can't be allocated,
+	 * and then the copies are released before anything is published. The frozen buckets
+	 * are moved by the next thread that walks one of them
+	 */
+	void migrate(Table *table, uint32_t group) {
+		Table *next = __atomic_load_n(&table->next, __ATOMIC_SEQ_CST);
+		uint32_t num_groups = groups(table, next);
+		Node *heads[2];
+		Node *chains[2] = { nullptr, nullptr };
+		bool was_moved = false;
+
+		for (uint32_t i = group, k = 0; i < table->num_buckets; i += num_groups, k++) {
+			heads[k] = freeze_bucket(&table->buckets[i]);
+			if (heads[k] == moved()) was_moved = true;
+		}
+
+		if (!was_moved) {
+			// copy every entry that wasn't deleted to a private chain for its new bucket
+			try {
+				for (uint32_t i = group, k = 0; i < table->num_buckets; i += num_groups, k++) {
+					for (Node *n = heads[k]; n; n = unmark(__atomic_load_n(&n->next, __ATOMIC_RELAXED))) {
+						if (is_deleted(__atomic_load_n(&n->next, __ATOMIC_RELAXED))) continue;
+						uint32_t index = n->hash % next->num_buckets;
+						Node *copy = node_copy(n->slot, n->hash);
+						copy->value = n->value;
+						copy->next = chains[index / num_groups];
+						chains[index / num_groups] = copy;
+					}
+				}
+			}
+			catch (...) {
+				for (Node *chain : chains) {
+					while (chain) {
+						Node *tofree = chain;
+						chain = chain->next;
+						release_node(tofree);
+					}
+				}
+				throw;
+			}
+
+			// publish the copies. a failure means another thread already did
+			for (uint32_t j = group, k = 0; j < next->num_buckets; j += num_groups, k++) {
+				Node *expected = unfilled();
+				if (!__atomic_compare_exchange_n(&next->buckets[j], &expected, chains[k], false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+					for (Node *n = chains[k]; n; ) {
+						Node *tofree = n;
+						n = n->next;
+						release_node(tofree);
+					}
+				}
+			}
+		}
+
+		// point readers of the old buckets to the new table and release the old chains
+		for (uint32_t i = group, k = 0; i < table->num_buckets; i += num_groups, k++) {
+			if (heads[k] == moved()) continue;
+
+			Node *frozen = mark(heads[k], FROZEN);
+			if (!__atomic_compare_exchange_n(&table->buckets[i], &frozen, moved(), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue;
+
+			// deleted nodes that were never unlinked weren't copied, so they take their value
+			for (Node *n = heads[k]; n; ) {
+				Node *tofree = n;
+				Node *link = __atomic_load_n(&n->next, __ATOMIC_RELAXED);
+				n = unmark(link);
+				free_later(tofree, is_deleted(link) ? destroy_node_later : release_node_later);
+			}
+
+			// the last bucket to move makes the new table current
+			if (__atomic_add_fetch(&table->migrate_done, 1, __ATOMIC_SEQ_CST) == table->num_buckets) {
+				Table *old = table;
+				if (__atomic_compare_exchange_n(&table_, &old, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+					free_later(table, table_free_later);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Claims and migrates a few groups of buckets if a resize is running. Once every
+	 * group is claimed, groups left by a claimer that stalled are migrated again, as in
+	 * `hashmap`
+	 */
+	void help_resize() {
+		Table *table = __atomic_load_n(&table_, __ATOMIC_SEQ_CST);
+		Table *next = __atomic_load_n(&table->next, __ATOMIC_SEQ_CST);
+		if (!next) return;
+
+		uint32_t num_groups = groups(table, next);
+		uint32_t migrated = 0;
+		while (migrated < MIGRATE_STEP) {
+			if (__atomic_load_n(&table->migrate_next, __ATOMIC_SEQ_CST) >= num_groups) break;
+			uint32_t group = __atomic_fetch_add(&table->migrate_next, 1, __ATOMIC_SEQ_CST);
+			if (group >= num_groups) break;
+			migrate(table, group);
+			migrated++;
+		}
+		for (uint32_t i = 0; i < MIGRATE_SCAN && migrated < MIGRATE_STEP; i++) {
+			uint32_t scan = __atomic_load_n(&table->migrate_scan, __ATOMIC_SEQ_CST);
+			if (scan >= table->num_buckets) return;
+			if (__atomic_load_n(&table->buckets[scan], __ATOMIC_SEQ_CST) == moved()) {
+				__atomic_compare_exchange_n(&table->migrate_scan, &scan, scan + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				continue;
+			}
+			migrate(table, scan % num_groups);
+			migrated++;
+		}
+	}
+
+	/**
+	 * Starts a resize if the load factor is past a threshold and no resize is running
+	 */
+	void check_load() {
+		Table *table = __atomic_load_n(&table_, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&table->next, __ATOMIC_SEQ_CST)) return;
+
+		uint32_t num_buckets = table->num_buckets;
+		int64_t grow = int64_t(num_buckets) * GROW_LOAD;
+		int64_t shrink = int64_t(num_buckets) / SHRINK_LOAD;
+		bool can_grow = num_buckets <= UINT32_MAX / 2;
+		bool can_shrink = num_buckets % 2 == 0 && num_buckets / 2 >= min_buckets_;
+
+		// the flushed count settles most checks, as in `hashmap`
+		int64_t length = counter_read_approx(&length_);
+		int64_t error = counter_approx_error();
+		bool near_grow = can_grow && length - error <= grow && length + error > grow;
+		bool near_shrink = can_shrink && length - error < shrink && length + error >= shrink;
+		if (near_grow || near_shrink) {
+			length = counter_read(&length_);
+		}
+
+		uint32_t resized;
+		if (can_grow && length > grow) {
+			resized = num_buckets * 2;
+		}
+		else if (can_shrink && length < shrink) {
+			resized = num_buckets / 2;
+		}
+		else {
+			return;
+		}
+
+		Table *next = table_new(resized, unfilled());
+		Table *none = nullptr;
+		if (!__atomic_compare_exchange_n(&table->next, &none, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			table_free(next);
+		}
+	}
+
+	/**
+	 * Walks the bucket for `hash` looking for `key`, unlinking deleted nodes on the way
+	 * and helping a migration of the bucket first. Returns true if the key was found.
+	 * Either way `cursor` is filled in
+	 */
+	template <class Q>
+	bool find(const Q &key, uint64_t hash, Cursor *cursor) {
+		while (true) {
+			cursor->table = __atomic_load_n(&table_, __ATOMIC_SEQ_CST);
+			cursor->head = head(&cursor->table, hash);
+			Node **bucket = &cursor->table->buckets[hash % cursor->table->num_buckets];
+
+			if (is_frozen(cursor->head)) {
+				Table *next = __atomic_load_n(&cursor->table->next, __ATOMIC_SEQ_CST);
+				migrate(cursor->table, (hash % cursor->table->num_buckets) % groups(cursor->table, next));
+				continue;
+			}
+
+			cursor->prev = bucket;
+			cursor->match = cursor->head;
+			while (cursor->match) {
+				cursor->next = __atomic_load_n(&cursor->match->next, __ATOMIC_SEQ_CST);
+				if (is_frozen(cursor->next)) break;
+
+				if (is_deleted(cursor->next)) {
+					// unlink the deleted node. whichever thread does this releases it
+					Node *deleted = cursor->match;
+					Node *next = unmark(cursor->next);
+					if (!__atomic_compare_exchange_n(cursor->prev, &deleted, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break;
+
+					retire_node(cursor->match);
+					if (cursor->prev == bucket) cursor->head = next;
+					cursor->match = next;
+					continue;
+				}
+
+				if (cursor->match->hash == hash && eq_(cursor->match->key(), key)) return true;
+				cursor->prev = &cursor->match->next;
+				cursor->match = cursor->next;
+			}
+			if (!cursor->match) return false;
+		}
+	}
+
+	/**
+	 * Replaces a node's value only if neither the value nor the node's `next` link have
+	 * changed, so a deleted or frozen node can't be updated
+	 */
+	static bool swap_value(Node *node, Node *next, uint64_t old, uint64_t value) {
+		Pair expected, desired;
+		expected.link = { next, old };
+		desired.link = { next, value };
+		return __atomic_compare_exchange_n(&reinterpret_cast<Pair *>(node)->word, &expected.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+
+	/**
+	 * Prepends `node` to the bucket `cursor` walked
+	 */
+	bool insert(Cursor *cursor, Node *node, uint64_t value, uint64_t hash) {
+		node->value = value;
+		node->next = cursor->head;
+		Node **bucket = &cursor->table->buckets[hash % cursor->table->num_buckets];
+		if (!__atomic_compare_exchange_n(bucket, &cursor->head, node, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return false;
+
+		counter_add(&length_, 1);
+		help_resize();
+		check_load();
+		return true;
+	}
+};
+
+} // namespace lockfree
+
+#endif // JFALKNER_HASHMAP_HPP
@@ -0,0 +1,534 @@
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "free_later.h"
+#include "hashmap_flat.h"
+
+// used for testing CAS-retries in tests
+counter hashmap_flat_claim_fail;
+counter hashmap_flat_del_fail;
+counter hashmap_flat_put_full;
+counter hashmap_flat_rebuilds;
+
+// control byte of a slot with no key. full slots hold 7 bits of hash, so the high bit is clear
+#define EMPTY 0x80
+// key of a slot that had no key when its group was copied, so it can't be claimed after
+#define SEALED ((const void *)1)
+// low bit of a value that was copied to the next table and can't change any more
+#define FROZEN ((uintptr_t)1)
+// returned internally by an operation that helped finish a rebuild and has to start over
+#define RETRY 2
+
+// a slot as one word, so that a copied key and its value appear together
+typedef union hashmap_flat_pair_u {
+	hashmap_flat_slot slot;
+	unsigned __int128 word;
+} hashmap_flat_pair;
+
+
+void
+hashmap_flat_destroy_value_later(void *opaque, void *value) {
+	// free later in case other threads are using it
+	free_later(value, opaque);
+}
+
+static hashmap_flat_table *
+hashmap_flat_table_new(uint32_t num_groups) {
+	// the striped claim counter needs its cache lines to itself
+	hashmap_flat_table *table = aligned_alloc(64, sizeof(hashmap_flat_table));
+	memset(table, 0, sizeof(hashmap_flat_table));
+	table->num_groups = num_groups;
+	size_t num_slots = (size_t)num_groups * HASHMAP_FLAT_GROUP;
+	// 16-byte alignment lets a group of control bytes load as one SSE2 register, and a
+	// slot be copied with one 16-byte CAS
+	table->ctrl = aligned_alloc(HASHMAP_FLAT_GROUP, num_slots);
+	memset(table->ctrl, EMPTY, num_slots);
+	table->slots = aligned_alloc(sizeof(hashmap_flat_pair), num_slots * sizeof(hashmap_flat_slot));
+	memset(table->slots, 0, num_slots * sizeof(hashmap_flat_slot));
+	table->moved = calloc(num_groups, 1);
+	return table;
+}
+
+static void
+hashmap_flat_table_free(void *ptr) {
+	hashmap_flat_table *table = ptr;
+	free(table->ctrl);
+	free(table->slots);
+	free(table->moved);
+	free(table);
+}
+
+void *
+hashmap_flat_new(uint32_t hint, uint8_t cmp(const void *x, const void *y), uint64_t hash(const void *key))
+{
+	// keep groups at most 7/8 full and round up to a power of two for masking
+	uint64_t wanted = (uint64_t)hint * 8 / 7 / HASHMAP_FLAT_GROUP + 1;
+	uint32_t num_groups = 1;
+	while (num_groups < wanted && num_groups < HASHMAP_FLAT_MAX_GROUPS) num_groups <<= 1;
+
+	hashmap_flat *map = aligned_alloc(64, sizeof(hashmap_flat));
+	memset(map, 0, sizeof(hashmap_flat));
+	map->table = hashmap_flat_table_new(num_groups);
+	// keep local reference of the two utility functions
+	map->hash = hash;
+	map->cmp = cmp;
+	// custom memory management hook
+	map->opaque = NULL;
+	map->destroy_value = hashmap_flat_destroy_value_later;
+	return map;
+}
+
+// a snapshot of the control bytes of one group. every mask of a probe step is computed
+// from the same snapshot, so they agree on which slots were published
+#ifdef __SSE2__
+typedef __m128i hashmap_flat_group;
+#else
+typedef struct hashmap_flat_group_s {
+	uint8_t ctrl[HASHMAP_FLAT_GROUP];
+} hashmap_flat_group;
+#endif
+
+static inline hashmap_flat_group
+hashmap_flat_load(const uint8_t *ctrl) {
+#ifdef __SSE2__
+	return _mm_load_si128((const __m128i *)ctrl);
+#else
+	hashmap_flat_group group;
+	for (int i=0;i<HASHMAP_FLAT_GROUP;i++) {
+		group.ctrl[i] = __atomic_load_n(&ctrl[i], __ATOMIC_RELAXED);
+	}
+	return group;
+#endif
+}
+
+/**
+ * Bit `i` is set if control byte `i` of the group equals `b`
+ */
+static inline uint32_t
+hashmap_flat_match(hashmap_flat_group group, uint8_t b) {
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)b)));
+#else
+	uint32_t bits = 0;
+	for (int i=0;i<HASHMAP_FLAT_GROUP;i++) {
+		if (group.ctrl[i] == b) bits |= 1u << i;
+	}
+	return bits;
+#endif
+}
+
+/**
+ * Bit `i` is set if slot `i` of the group has no key published yet
+ */
+static inline uint32_t
+hashmap_flat_match_empty(hashmap_flat_group group) {
+#ifdef __SSE2__
+	// only EMPTY has the high bit set
+	return _mm_movemask_epi8(group);
+#else
+	return hashmap_flat_match(group, EMPTY);
+#endif
+}
+
+/**
+ * The user's hash is run through splitmix64's finalizer, so that every bit depends on
+ * every other. The group index comes from the low bits and the 7 bits kept in the
+ * control byte from the high bits, so weak hashes such as the identity or aligned
+ * pointers still spread over every group.
+ */
+static inline uint64_t
+hashmap_flat_mix(uint64_t hash) {
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+static inline bool
+is_frozen(void *value) {
+	return (uintptr_t)value & FROZEN;
+}
+
+static inline void *
+unfreeze(void *value) {
+	return (void *)((uintptr_t)value & ~FROZEN);
+}
+
+/**
+ * Finds the slot holding a key. Probing stops at the first group with a slot that has
+ * no key, since puts only move on to the next group once every slot of this one has
+ * been claimed. A slot whose control byte is still EMPTY may already have been claimed
+ * by a put that hasn't published it, so its key is checked as well.
+ *
+ * `sealed` is set if the probe stopped at a slot that was sealed by a rebuild, in which
+ * case the key may be put into the next table once it is current.
+ */
+static hashmap_flat_slot *
+hashmap_flat_find(hashmap_flat *map, hashmap_flat_table *table, const void *key, uint64_t hash, bool *sealed) {
+	uint8_t h2 = hash >> 57;
+	uint32_t mask = table->num_groups - 1;
+	uint32_t group = hash & mask;
+	*sealed = false;
+
+	for (uint32_t probe = 1; probe <= table->num_groups; probe++) {
+		hashmap_flat_group ctrl = hashmap_flat_load(&table->ctrl[group * HASHMAP_FLAT_GROUP]);
+		hashmap_flat_slot *slots = &table->slots[group * HASHMAP_FLAT_GROUP];
+
+		for (uint32_t bits = hashmap_flat_match(ctrl, h2); bits; bits &= bits - 1) {
+			hashmap_flat_slot *slot = &slots[__builtin_ctz(bits)];
+			const void *k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+			if (map->cmp(k, key) == 0) return slot;
+		}
+
+		bool unclaimed = false;
+		for (uint32_t bits = hashmap_flat_match_empty(ctrl); bits; bits &= bits - 1) {
+			hashmap_flat_slot *slot = &slots[__builtin_ctz(bits)];
+			const void *k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+			if (!k || k == SEALED) {
+				unclaimed = true;
+				if (k == SEALED) *sealed = true;
+			}
+			else if (map->cmp(k, key) == 0) {
+				return slot;
+			}
+		}
+		if (unclaimed) return NULL;
+
+		// triangular probing visits every group when the count is a power of two
+		group = (group + probe) & mask;
+	}
+	return NULL;
+}
+
+/**
+ * Copies a live entry of the old table into `next`. Slots of `next` are claimed in
+ * probe order, so every thread copying the same entry meets in one slot, and a key is
+ * only ever written together with its value. A thread that is late to copy an entry
+ * finds it already there and leaves it alone, even after it was replaced or deleted.
+ */
+static void
+hashmap_flat_copy(hashmap_flat *map, hashmap_flat_table *next, const void *key, void *value) {
+	uint64_t hash = hashmap_flat_mix(map->hash(key));
+	uint8_t h2 = hash >> 57;
+	uint32_t mask = next->num_groups - 1;
+	uint32_t group = hash & mask;
+
+	for (uint32_t probe = 1; probe <= next->num_groups; probe++) {
+		for (uint32_t i = 0; i < HASHMAP_FLAT_GROUP; i++) {
+			uint32_t index = group * HASHMAP_FLAT_GROUP + i;
+			hashmap_flat_slot *slot = &next->slots[index];
+			const void *k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+			if (!k) {
+				hashmap_flat_pair expected = { .slot = { NULL, NULL } };
+				hashmap_flat_pair desired = { .slot = { key, value } };
+				if (__atomic_compare_exchange_n((unsigned __int128 *)slot, &expected.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+					counter_add(&next->claimed, 1);
+					k = key;
+				}
+				else {
+					k = expected.slot.key;
+				}
+			}
+			// slots before the entry's are never sealed, so a late copy that meets one
+			// knows the entry is there and `next` is being rebuilt in turn
+			if (k == SEALED) return;
+			if (k == key || map->cmp(k, key) == 0) {
+				__atomic_store_n(&next->ctrl[index], h2, __ATOMIC_RELEASE);
+				return;
+			}
+		}
+
+		// triangular probing visits every group when the count is a power of two
+		group = (group + probe) & mask;
+	}
+}
+
+/**
+ * Copies one group of slots from `table` to `table->next`. Any number of threads may
+ * run this for the same group. Empty slots are sealed and values are frozen first, so
+ * nothing in the group changes while it is copied.
+ */
+static void
+hashmap_flat_migrate(hashmap_flat *map, hashmap_flat_table *table, uint32_t group) {
+	hashmap_flat_table *next = __atomic_load_n(&table->next, __ATOMIC_SEQ_CST);
+	hashmap_flat_slot *slots = &table->slots[group * HASHMAP_FLAT_GROUP];
+
+	for (uint32_t i = 0; i < HASHMAP_FLAT_GROUP; i++) {
+		hashmap_flat_slot *slot = &slots[i];
+		const void *k = NULL;
+		if (__atomic_compare_exchange_n(&slot->key, &k, SEALED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue;
+		if (k == SEALED) continue;
+
+		void *value = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+		while (!is_frozen(value)) {
+			void *frozen = (void *)((uintptr_t)value | FROZEN);
+			if (__atomic_compare_exchange_n(&slot->value, &value, frozen, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break;
+		}
+		// deleted keys, and keys whose put never stored a value, are left behind
+		value = unfreeze(value);
+		if (value) hashmap_flat_copy(map, next, k, value);
+	}
+	__atomic_store_n(&table->moved[group], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Finishes the rebuild of `table` and makes its next table current. Groups are claimed
+ * one at a time, and once every group is claimed, groups that are still not copied are
+ * copied again, so a thread that stalls after claiming one doesn't hold up the rest.
+ */
+static void
+hashmap_flat_help(hashmap_flat *map, hashmap_flat_table *table) {
+	hashmap_flat_table *next = __atomic_load_n(&table->next, __ATOMIC_SEQ_CST);
+	uint32_t groups = table->num_groups;
+
+	// skip the atomic add once every group is claimed
+	while (__atomic_load_n(&table->migrate_next, __ATOMIC_SEQ_CST) < groups) {
+		uint32_t group = __atomic_fetch_add(&table->migrate_next, 1, __ATOMIC_SEQ_CST);
+		if (group >= groups) break;
+		hashmap_flat_migrate(map, table, group);
+	}
+	for (uint32_t group = 0; group < groups; group++) {
+		if (!__atomic_load_n(&table->moved[group], __ATOMIC_ACQUIRE)) {
+			hashmap_flat_migrate(map, table, group);
+		}
+	}
+
+	hashmap_flat_table *old = table;
+	if (__atomic_compare_exchange_n(&map->table, &old, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		free_later(table, hashmap_flat_table_free);
+	}
+}
+
+/**
+ * Starts a rebuild of `table` unless one is already running, and finishes it. The new
+ * table has room for every slot of the old one, so that copies always find a slot, and
+ * twice as much if more than half of the old one is live.
+ *
+ * Returns false if the table already has the most groups and is full of live entries,
+ * so a rebuild wouldn't free any slot.
+ */
+static bool
+hashmap_flat_rebuild(hashmap_flat *map, hashmap_flat_table *table) {
+	if (!__atomic_load_n(&table->next, __ATOMIC_SEQ_CST)) {
+		uint32_t num_groups = table->num_groups;
+		uint64_t num_slots = (uint64_t)num_groups * HASHMAP_FLAT_GROUP;
+		int64_t length = counter_read(&map->length);
+		if (length > (int64_t)(num_slots / 2)) {
+			if (num_groups < HASHMAP_FLAT_MAX_GROUPS) {
+				num_groups *= 2;
+			}
+			else if (length >= (int64_t)(num_slots / 8 * 7)) {
+				return false;
+			}
+		}
+
+		// only one thread gets to link its table
+		hashmap_flat_table *next = hashmap_flat_table_new(num_groups);
+		hashmap_flat_table *none = NULL;
+		if (__atomic_compare_exchange_n(&table->next, &none, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			counter_add(&hashmap_flat_rebuilds, 1);
+		}
+		else {
+			hashmap_flat_table_free(next);
+		}
+	}
+	hashmap_flat_help(map, table);
+	return true;
+}
+
+/**
+ * Rebuilds the table once 7/8 of its slots have been claimed. The flushed count
+ * settles most checks, and only one that is too close to the limit to tell sums the
+ * stripes.
+ */
+static void
+hashmap_flat_check_load(hashmap_flat *map, hashmap_flat_table *table) {
+	int64_t limit = (int64_t)table->num_groups * HASHMAP_FLAT_GROUP / 8 * 7;
+	int64_t claimed = counter_read_approx(&table->claimed);
+	if (claimed + counter_approx_error() <= limit) return;
+	if (counter_read(&table->claimed) <= limit) return;
+	hashmap_flat_rebuild(map, table);
+}
+
+uint32_t
+hashmap_flat_length(hashmap_flat *map)
+{
+	int64_t length = counter_read(&map->length);
+	return length > 0 ? length : 0;
+}
+
+void *
+hashmap_flat_get(hashmap_flat *map, const void *key)
+{
+	uint64_t hash = hashmap_flat_mix(map->hash(key));
+	void *value;
+
+	// old tables are freed once no thread can still be reading them
+	free_later_enter();
+	while (true) {
+		hashmap_flat_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+		bool sealed;
+		hashmap_flat_slot *slot = hashmap_flat_find(map, table, key, hash, &sealed);
+		value = slot ? __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE) : NULL;
+		if (!sealed && !is_frozen(value)) break;
+
+		// frozen values are current until the next table is, since writes only go to
+		// it after that. a key that isn't here may be there by then
+		if (__atomic_load_n(&map->table, __ATOMIC_SEQ_CST) == table) {
+			value = unfreeze(value);
+			break;
+		}
+	}
+	free_later_exit();
+
+	return value;
+}
+
+/**
+ * Swaps the value of a slot that holds the key. Returns `RETRY` if the slot was frozen
+ * by a rebuild, after helping to finish it
+ */
+static int
+hashmap_flat_replace(hashmap_flat *map, hashmap_flat_table *table, hashmap_flat_slot *slot, void *value) {
+	void *old = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+	do {
+		if (is_frozen(old)) {
+			hashmap_flat_help(map, table);
+			return RETRY;
+		}
+	} while (!__atomic_compare_exchange_n(&slot->value, &old, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	if (old) {
+		map->destroy_value(map->opaque, old);
+		return true;
+	}
+	// the key was deleted or was still being claimed, so this adds an entry
+	counter_add(&map->length, 1);
+	return false;
+}
+
+static int
+hashmap_flat_put_table(hashmap_flat *map, hashmap_flat_table *table, const void *key, void *value, uint64_t hash)
+{
+	uint8_t h2 = hash >> 57;
+	uint32_t mask = table->num_groups - 1;
+	uint32_t group = hash & mask;
+
+	for (uint32_t probe = 1; probe <= table->num_groups; probe++) {
+		uint8_t *ctrl = &table->ctrl[group * HASHMAP_FLAT_GROUP];
+		hashmap_flat_slot *slots = &table->slots[group * HASHMAP_FLAT_GROUP];
+		// one snapshot for both masks. a key published after it shows as empty and is
+		// met again when claiming its slot fails, instead of being skipped by both
+		hashmap_flat_group snapshot = hashmap_flat_load(ctrl);
+
+		// check for the key among published slots
+		for (uint32_t bits = hashmap_flat_match(snapshot, h2); bits; bits &= bits - 1) {
+			hashmap_flat_slot *slot = &slots[__builtin_ctz(bits)];
+			const void *k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+			if (map->cmp(k, key) == 0) {
+				return hashmap_flat_replace(map, table, slot, value);
+			}
+		}
+
+		// try to claim an empty slot, in order, so racing puts of a key meet in one slot
+		for (uint32_t bits = hashmap_flat_match_empty(snapshot); bits; bits &= bits - 1) {
+			uint32_t i = __builtin_ctz(bits);
+			hashmap_flat_slot *slot = &slots[i];
+			const void *k = NULL;
+			bool success = __atomic_compare_exchange_n(&slot->key, &k, key, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			if (success) {
+				counter_add(&table->claimed, 1);
+			}
+			else if (k == SEALED) {
+				// the group was copied, so the key goes in the next table
+				hashmap_flat_help(map, table);
+				return RETRY;
+			}
+			else {
+				counter_add(&hashmap_flat_claim_fail, 1);
+				// another thread claimed it. it may be putting this same key
+				if (map->cmp(k, key) != 0) continue;
+			}
+
+			int replaced = hashmap_flat_replace(map, table, slot, value);
+			if (replaced == RETRY) return RETRY;
+			// publishing the control byte makes the key visible to the SSE2 filter
+			__atomic_store_n(&ctrl[i], h2, __ATOMIC_RELEASE);
+			if (success) hashmap_flat_check_load(map, table);
+			return replaced;
+		}
+
+		// triangular probing visits every group when the count is a power of two
+		group = (group + probe) & mask;
+	}
+
+	// every slot has a key. a rebuild frees the slots of deleted keys
+	if (hashmap_flat_rebuild(map, table)) return RETRY;
+	counter_add(&hashmap_flat_put_full, 1);
+	return HASHMAP_FLAT_FULL;
+}
+
+int
+hashmap_flat_put(hashmap_flat *map, const void *key, void *value)
+{
+	// sanity checks
+	if (!map) return false;
+	// a NULL value reads as a deleted key, so it has to be counted as a delete
+	if (!value) return hashmap_flat_del(map, key);
+
+	uint64_t hash = hashmap_flat_mix(map->hash(key));
+	int ret;
+
+	free_later_enter();
+	do {
+		hashmap_flat_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+		ret = hashmap_flat_put_table(map, table, key, value, hash);
+	} while (ret == RETRY);
+	free_later_exit();
+
+	return ret;
+}
+
+bool
+hashmap_flat_del(hashmap_flat *map, const void *key)
+{
+	if (!map) return false;
+
+	uint64_t hash = hashmap_flat_mix(map->hash(key));
+	bool deleted = false;
+
+	free_later_enter();
+	while (true) {
+		hashmap_flat_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+		bool sealed;
+		hashmap_flat_slot *slot = hashmap_flat_find(map, table, key, hash, &sealed);
+		if (!slot) {
+			if (!sealed) break;
+			// the key may have been put into the next table, once it is current
+			hashmap_flat_help(map, table);
+			continue;
+		}
+
+		// the key stays in its slot, only the value is cleared
+		void *value = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+		while (value && !is_frozen(value)) {
+			deleted = __atomic_compare_exchange_n(&slot->value, &value, NULL, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			if (deleted) {
+				counter_add(&map->length, -1);
+				map->destroy_value(map->opaque, value);
+				break;
+			}
+			counter_add(&hashmap_flat_del_fail, 1);
+		}
+		if (deleted || !value) break;
+		// frozen by a rebuild. the key is in the next table once it is current
+		hashmap_flat_help(map, table);
+	}
+	free_later_exit();
+
+	return deleted;
+}
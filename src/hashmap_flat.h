@@ -0,0 +1,114 @@
+/**
+ * Lock-Free Open-Addressing Hashmap
+ *
+ * An alternative to `hashmap` with the same API that keeps entries in one flat array
+ * instead of chains of nodes. Slots are grouped 16 at a time and each slot has a
+ * control byte holding 7 bits of the key's hash, so a single SSE2 compare filters a
+ * whole group before any key is passed to `cmp`. A lookup usually touches the group's
+ * control bytes and the one slot that matched.
+ *
+ * Keys are claimed into empty slots with CAS and never move within a table. Values are
+ * swapped with CAS and deleting an entry clears its value, leaving the key in place for
+ * re-use.
+ *
+ * Once 7/8 of the slots of a table have been claimed, including those of deleted keys,
+ * the live entries are copied into a new table. It has as many slots as the old one if
+ * at most half of them are live, and twice as many otherwise. Copying freezes each slot
+ * of the old table by setting the lowest bit of its value, so values must be pointers
+ * whose lowest bit is clear. Gets keep reading frozen values until the new table is
+ * current. A put or del that meets a frozen slot first helps finish the copy, so no
+ * thread waits on another, and the new table only takes writes once it is current.
+ */
+#ifndef JFALKNER_HASHMAP_FLAT_H
+#define JFALKNER_HASHMAP_FLAT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "counter.h"
+
+// slots per group, one control byte each so a group is one SSE2 register
+#define HASHMAP_FLAT_GROUP 16
+// returned by `hashmap_flat_put` when a new key finds no free slot
+#define HASHMAP_FLAT_FULL -1
+// most groups a table can have
+#define HASHMAP_FLAT_MAX_GROUPS (1u << 27)
+
+// a key and its value. a NULL value means the key was deleted
+typedef struct hashmap_flat_slot_s {
+	const void *key;
+	void *value;
+} hashmap_flat_slot;
+
+// groups of slots and their control bytes
+typedef struct hashmap_flat_table_s {
+	// control bytes and slots, HASHMAP_FLAT_GROUP per group
+	uint8_t *ctrl;
+	hashmap_flat_slot *slots;
+	// always a power of two
+	uint32_t num_groups;
+	// table that live entries are copied to. NULL unless a rebuild is running
+	struct hashmap_flat_table_s *next;
+	// next group to claim for copying, and which groups have been copied
+	uint32_t migrate_next;
+	uint8_t *moved;
+	// slots that were given a key, including keys that have been deleted since
+	counter claimed;
+} hashmap_flat_table;
+
+// main hashmap struct with the current table
+typedef struct hashmap_flat_s {
+	hashmap_flat_table *table;
+
+	// total count of entries. see `hashmap_flat_length`
+	counter length;
+
+	// pointer to the hash and comparison functions
+	uint64_t (*hash)(const void *key);
+	uint8_t (*cmp)(const void *x, const void *y);
+
+	// custom memory management of values that are replaced or deleted. by default they
+	// are passed to `opaque` if it is set to a release function such as `free`
+	void *opaque;
+	void (*destroy_value)(void *opaque, void *value);
+} hashmap_flat;
+
+
+/**
+ * Creates and initializes a new hashmap with room for at least `hint` keys
+ */
+void * hashmap_flat_new(uint32_t hint, uint8_t cmp(const void *x, const void *y), uint64_t hash(const void *key));
+
+/**
+ * Returns a value mapped to the key or NULL, if no entry exists for the given key
+ */
+extern void * hashmap_flat_get(hashmap_flat *map, const void *key);
+
+/**
+ * Returns the number of entries in the map, exact once other threads stop changing it
+ */
+extern uint32_t hashmap_flat_length(hashmap_flat *map);
+
+/**
+ * Puts the given key, value pair in the map
+ *
+ * Returns true if an existing matching key was replaced and false if it was added. The
+ * map keeps the key it already has on a replace, so the caller still owns `key`.
+ * A NULL `value` deletes the key as `hashmap_flat_del` does, and returns its result.
+ *
+ * Returns `HASHMAP_FLAT_FULL` if the key is new and the table already has
+ * `HASHMAP_FLAT_MAX_GROUPS` groups with no free slot. The value was not put and still
+ * belongs to the caller.
+ */
+extern int hashmap_flat_put(hashmap_flat *map, const void *key, void *value);
+
+/**
+ * Removes the given key, value pair in the map
+ *
+ * Returns true if a key was found. Otherwise, false. This method is guaranteed to
+ * return true just once, if multiple threads are attempting to delete the same key.
+ */
+extern bool hashmap_flat_del(hashmap_flat *map, const void *key);
+
+#endif // JFALKNER_HASHMAP_FLAT_H
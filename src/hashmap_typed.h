@@ -0,0 +1,584 @@
+/**
+ * Typed Lock-Free Hashmaps
+ *
+ * `hashmap` keeps `const void *` keys and values and calls `hash` and `cmp` through
+ * function pointers, so every probe is an indirect call and integer keys have to live
+ * somewhere else just so that they can be pointed at. `HASHMAP_TYPED` instead expands
+ * to a map specialized for one key and value type, in the spirit of khash. Keys and
+ * values are stored in the nodes themselves, and the hash and equality are macros or
+ * inline functions that the compiler inlines into the walk.
+ *
+ *     HASHMAP_TYPED(flowmap, uint64_t, struct flow *, hashmap_typed_hash_u64, hashmap_typed_eq)
+ *
+ *     flowmap *flows = flowmap_new(1024);
+ *     flowmap_put(flows, id, flow, NULL);
+ *     struct flow *f;
+ *     if (flowmap_get(flows, id, &f)) ...
+ *
+ * declares the types `flowmap`, `flowmap_node` and `flowmap_table`, and the functions
+ * below with the `flowmap_` prefix. The functions are `static inline`, so a map may be
+ * instantiated in a header and shared by several files.
+ *
+ * The map is the same lock-free algorithm as `hashmap`: chains of nodes whose `next`
+ * and value are swapped together with a 16-byte CAS, marks on `next` for deleted nodes
+ * and for frozen chains, and an incremental resize that every put and del helps with.
+ * Because of that CAS, a value can be at most 8 bytes, such as an integer or a pointer.
+ * A key can be of any type that can be assigned, including a struct.
+ *
+ * Removed nodes are released through `free_later`. The map never releases values.
+ * `_put` and `_del` hand back the value they replaced or removed instead, so that the
+ * caller can pass it to `free_later` if it is a pointer.
+ *
+ * Functions of a map named `name`:
+ *
+ *     name * name_new(uint32_t hint)
+ *     void name_free(name **map)
+ *     bool name_get(name *map, key_type key, value_type *value)
+ *     bool name_put(name *map, key_type key, value_type value, value_type *old)
+ *     bool name_put_if_absent(name *map, key_type key, value_type value)
+ *     bool name_del(name *map, key_type key, value_type *old)
+ *     uint32_t name_length(name *map)
+ *
+ * `hint`, the return values and the lengths mean the same as for `hashmap`. `value`
+ * and `old` are only written when the call returns true, and `old` may be NULL.
+ */
+#ifndef JFALKNER_HASHMAP_TYPED_H
+#define JFALKNER_HASHMAP_TYPED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "counter.h"
+#include "free_later.h"
+
+// grow, shrink and migrate at the same points as `hashmap`
+#define HASHMAP_TYPED_GROW_LOAD 1
+#define HASHMAP_TYPED_SHRINK_LOAD 8
+#define HASHMAP_TYPED_MIGRATE_STEP 4
+#define HASHMAP_TYPED_MIGRATE_SCAN 64
+
+// marks on the low bits of links, as in `hashmap`
+#define HASHMAP_TYPED_FROZEN ((uintptr_t)1)
+#define HASHMAP_TYPED_DELETED ((uintptr_t)2)
+#define hashmap_typed_is_frozen(n) ((uintptr_t)(n) & HASHMAP_TYPED_FROZEN)
+#define hashmap_typed_is_deleted(n) ((uintptr_t)(n) & HASHMAP_TYPED_DELETED)
+#define hashmap_typed_mark(n, bits) ((__typeof__(n))((uintptr_t)(n) | (bits)))
+#define hashmap_typed_unmark(n) ((__typeof__(n))((uintptr_t)(n) & ~(HASHMAP_TYPED_FROZEN | HASHMAP_TYPED_DELETED)))
+
+// bucket heads of buckets that were migrated or that have not been filled in yet. they
+// are only ever compared, never followed, so any 16-byte aligned address without marks
+// works, and every file that instantiates a map agrees on them
+#define HASHMAP_TYPED_MOVED ((void *)16)
+#define HASHMAP_TYPED_UNFILLED ((void *)32)
+
+// the functions of every map. unused ones don't warn, since most users need a few
+#define HASHMAP_TYPED_FN static inline __attribute__((unused))
+
+/**
+ * Splitmix64's finalizer, a hash for integer keys that spreads consecutive keys over
+ * every bucket
+ */
+static inline uint64_t
+hashmap_typed_hash_u64(uint64_t key) {
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+/**
+ * FNV-1a, a hash for NUL-terminated string keys
+ */
+static inline uint64_t
+hashmap_typed_hash_str(const char *key) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *key; key++) {
+		hash = (hash ^ (uint8_t)*key) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// equality of scalar keys, and of string keys
+#define hashmap_typed_eq(x, y) ((x) == (y))
+#define hashmap_typed_eq_str(x, y) (strcmp((x), (y)) == 0)
+
+// a node's `next` and the bits of its value, which are updated together
+typedef union hashmap_typed_pair_u {
+	struct {
+		void *next;
+		uint64_t value;
+	} link;
+	unsigned __int128 word;
+} hashmap_typed_pair;
+
+/**
+ * Replaces a node's value only if neither the value nor the node's `next` link have
+ * changed. Every node type starts with `next` and the value, so this works for all
+ */
+static inline bool
+hashmap_typed_swap(void *node, void *next, uint64_t old, uint64_t value) {
+	hashmap_typed_pair expected = { .link = { next, old } };
+	hashmap_typed_pair desired = { .link = { next, value } };
+	return __atomic_compare_exchange_n(&((hashmap_typed_pair *)node)->word, &expected.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Buckets migrate in groups, as in `hashmap`. Returns how many groups a resize between
+ * tables of these sizes has
+ */
+static inline uint32_t
+hashmap_typed_groups(uint32_t from, uint32_t to) {
+	return from < to ? from : to;
+}
+
+/**
+ * Declares the map `name` from `key_type` to `value_type`. `hash_fn(key)` returns a
+ * `uint64_t` and `eq_fn(x, y)` is true for equal keys. Both may be macros
+ */
+#define HASHMAP_TYPED(name, key_type, value_type, hash_fn, eq_fn) \
+_Static_assert(sizeof(value_type) <= sizeof(uint64_t), "values of a typed hashmap must fit in 8 bytes"); \
+\
+typedef struct name##_node_s { \
+	/* `next` and `value` come first and are swapped together */ \
+	struct name##_node_s *next; \
+	uint64_t value; \
+	uint64_t hash; \
+	key_type key; \
+} __attribute__((aligned(16))) name##_node; \
+\
+typedef struct name##_table_s { \
+	name##_node **buckets; \
+	uint32_t num_buckets; \
+	/* table that buckets are being migrated to. NULL unless a resize is running */ \
+	struct name##_table_s *next; \
+	uint32_t migrate_next; \
+	uint32_t migrate_done; \
+	/* buckets before this one are known to be moved */ \
+	uint32_t migrate_scan; \
+} name##_table; \
+\
+typedef struct name##_s { \
+	name##_table *table; \
+	uint32_t min_buckets; \
+	counter length; \
+} name; \
+\
+/* where a key was found, or where it would be added, as in `hashmap` */ \
+typedef struct name##_cursor_s { \
+	name##_table *table; \
+	name##_node *head; \
+	name##_node **prev; \
+	name##_node *match; \
+	name##_node *next; \
+} name##_cursor; \
+\
+HASHMAP_TYPED_FN uint64_t \
+name##_bits(value_type value) { \
+	uint64_t bits = 0; \
+	memcpy(&bits, &value, sizeof(value_type)); \
+	return bits; \
+} \
+\
+HASHMAP_TYPED_FN value_type \
+name##_value(uint64_t bits) { \
+	value_type value; \
+	memcpy(&value, &bits, sizeof(value_type)); \
+	return value; \
+} \
+\
+HASHMAP_TYPED_FN name##_table * \
+name##_table_new(uint32_t num_buckets, name##_node *head) { \
+	name##_table *table = calloc(1, sizeof(name##_table)); \
+	table->num_buckets = num_buckets; \
+	table->buckets = malloc((size_t)num_buckets * sizeof(name##_node *)); \
+	for (uint32_t i = 0; i < num_buckets; i++) { \
+		table->buckets[i] = head; \
+	} \
+	return table; \
+} \
+\
+HASHMAP_TYPED_FN name * \
+name##_new(uint32_t hint) { \
+	name *map = aligned_alloc(64, sizeof(name)); \
+	memset(map, 0, sizeof(name)); \
+	if (hint == 0) hint = 1; \
+	map->table = name##_table_new(hint, NULL); \
+	map->min_buckets = hint; \
+	return map; \
+} \
+\
+/* releases the map and its nodes, but not the values, and NULLs the pointer. no other \
+ * thread may be using it */ \
+HASHMAP_TYPED_FN void \
+name##_free(name **map) { \
+	name##_table *table = (*map)->table; \
+	while (table) { \
+		for (uint32_t i = 0; i < table->num_buckets; i++) { \
+			name##_node *n = hashmap_typed_unmark(table->buckets[i]); \
+			if (n == HASHMAP_TYPED_MOVED || n == HASHMAP_TYPED_UNFILLED) continue; \
+			while (n) { \
+				name##_node *tofree = n; \
+				n = hashmap_typed_unmark(n->next); \
+				free(tofree); \
+			} \
+		} \
+		name##_table *next = table->next; \
+		free(table->buckets); \
+		free(table); \
+		table = next; \
+	} \
+	free(*map); \
+	*map = NULL; \
+} \
+\
+HASHMAP_TYPED_FN uint32_t \
+name##_length(name *map) { \
+	int64_t length = counter_read(&map->length); \
+	return length > 0 ? length : 0; \
+} \
+\
+/* returns the head of the bucket for `hash`, following buckets that were moved */ \
+HASHMAP_TYPED_FN name##_node * \
+name##_head(name##_table **table, uint64_t hash) { \
+	name##_table *t = *table; \
+	name##_node *head = __atomic_load_n(&t->buckets[hash % t->num_buckets], __ATOMIC_SEQ_CST); \
+	while (head == HASHMAP_TYPED_MOVED) { \
+		t = __atomic_load_n(&t->next, __ATOMIC_SEQ_CST); \
+		head = __atomic_load_n(&t->buckets[hash % t->num_buckets], __ATOMIC_SEQ_CST); \
+	} \
+	*table = t; \
+	return head; \
+} \
+\
+/* freezes a bucket and every link of its chain. returns the chain or MOVED */ \
+HASHMAP_TYPED_FN name##_node * \
+name##_freeze_bucket(name##_node **bucket) { \
+	name##_node *head = __atomic_load_n(bucket, __ATOMIC_SEQ_CST); \
+	while (!hashmap_typed_is_frozen(head)) { \
+		if (head == HASHMAP_TYPED_MOVED) return HASHMAP_TYPED_MOVED; \
+		if (__atomic_compare_exchange_n(bucket, &head, hashmap_typed_mark(head, HASHMAP_TYPED_FROZEN), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break; \
+	} \
+	head = hashmap_typed_unmark(head); \
+\
+	for (name##_node *n = head; n; ) { \
+		name##_node *next = __atomic_load_n(&n->next, __ATOMIC_SEQ_CST); \
+		while (!hashmap_typed_is_frozen(next)) { \
+			if (__atomic_compare_exchange_n(&n->next, &next, hashmap_typed_mark(next, HASHMAP_TYPED_FROZEN), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break; \
+		} \
+		n = hashmap_typed_unmark(next); \
+	} \
+	return head; \
+} \
+\
+/* migrates one group of buckets from `table` to `table->next`, see `hashmap_migrate` */ \
+HASHMAP_TYPED_FN void \
+name##_migrate(name *map, name##_table *table, uint32_t group) { \
+	name##_table *next = __atomic_load_n(&table->next, __ATOMIC_SEQ_CST); \
+	uint32_t groups = hashmap_typed_groups(table->num_buckets, next->num_buckets); \
+	name##_node *heads[2]; \
+	name##_node *chains[2] = { NULL, NULL }; \
+	bool moved = false; \
+\
+	for (uint32_t i = group, k = 0; i < table->num_buckets; i += groups, k++) { \
+		heads[k] = name##_freeze_bucket(&table->buckets[i]); \
+		if (heads[k] == HASHMAP_TYPED_MOVED) moved = true; \
+	} \
+\
+	if (!moved) { \
+		/* copy every entry that wasn't deleted to a private chain for its new bucket */ \
+		for (uint32_t i = group, k = 0; i < table->num_buckets; i += groups, k++) { \
+			for (name##_node *n = heads[k]; n; n = hashmap_typed_unmark(__atomic_load_n(&n->next, __ATOMIC_RELAXED))) { \
+				if (hashmap_typed_is_deleted(__atomic_load_n(&n->next, __ATOMIC_RELAXED))) continue; \
+				uint32_t index = n->hash % next->num_buckets; \
+				name##_node *copy = malloc(sizeof(name##_node)); \
+				copy->key = n->key; \
+				copy->value = n->value; \
+				copy->hash = n->hash; \
+				copy->next = chains[index / groups]; \
+				chains[index / groups] = copy; \
+			} \
+		} \
+\
+		/* publish the copies. a failure means another thread already did */ \
+		for (uint32_t j = group, k = 0; j < next->num_buckets; j += groups, k++) { \
+			name##_node *unfilled = HASHMAP_TYPED_UNFILLED; \
+			if (!__atomic_compare_exchange_n(&next->buckets[j], &unfilled, chains[k], false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) { \
+				for (name##_node *n = chains[k]; n; ) { \
+					name##_node *tofree = n; \
+					n = n->next; \
+					free(tofree); \
+				} \
+			} \
+		} \
+	} \
+\
+	/* point readers of the old buckets to the new table and release the old chains */ \
+	for (uint32_t i = group, k = 0; i < table->num_buckets; i += groups, k++) { \
+		if (heads[k] == HASHMAP_TYPED_MOVED) continue; \
+\
+		name##_node *frozen = hashmap_typed_mark(heads[k], HASHMAP_TYPED_FROZEN); \
+		if (!__atomic_compare_exchange_n(&table->buckets[i], &frozen, HASHMAP_TYPED_MOVED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue; \
+		for (name##_node *n = heads[k]; n; ) { \
+			name##_node *tofree = n; \
+			n = hashmap_typed_unmark(__atomic_load_n(&n->next, __ATOMIC_RELAXED)); \
+			free_later(tofree, free); \
+		} \
+\
+		/* the last bucket to move makes the new table current */ \
+		if (__atomic_add_fetch(&table->migrate_done, 1, __ATOMIC_SEQ_CST) == table->num_buckets) { \
+			name##_table *old = table; \
+			if (__atomic_compare_exchange_n(&map->table, &old, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) { \
+				free_later(table->buckets, free); \
+				free_later(table, free); \
+			} \
+		} \
+	} \
+} \
+\
+/* claims and migrates a few groups of buckets if a resize is running. once every group \
+ * is claimed, groups left by a claimer that stalled are migrated again, as in `hashmap` */ \
+HASHMAP_TYPED_FN void \
+name##_help_resize(name *map) { \
+	name##_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST); \
+	name##_table *next = __atomic_load_n(&table->next, __ATOMIC_SEQ_CST); \
+	if (!next) return; \
+\
+	uint32_t groups = hashmap_typed_groups(table->num_buckets, next->num_buckets); \
+	int migrated = 0; \
+	while (migrated < HASHMAP_TYPED_MIGRATE_STEP) { \
+		if (__atomic_load_n(&table->migrate_next, __ATOMIC_SEQ_CST) >= groups) break; \
+		uint32_t group = __atomic_fetch_add(&table->migrate_next, 1, __ATOMIC_SEQ_CST); \
+		if (group >= groups) break; \
+		name##_migrate(map, table, group); \
+		migrated++; \
+	} \
+	for (int i = 0; i < HASHMAP_TYPED_MIGRATE_SCAN && migrated < HASHMAP_TYPED_MIGRATE_STEP; i++) { \
+		uint32_t scan = __atomic_load_n(&table->migrate_scan, __ATOMIC_SEQ_CST); \
+		if (scan >= table->num_buckets) return; \
+		if (__atomic_load_n(&table->buckets[scan], __ATOMIC_SEQ_CST) == HASHMAP_TYPED_MOVED) { \
+			__atomic_compare_exchange_n(&table->migrate_scan, &scan, scan + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+			continue; \
+		} \
+		name##_migrate(map, table, scan % groups); \
+		migrated++; \
+	} \
+} \
+\
+/* starts a resize if the load factor is past a threshold and no resize is running */ \
+HASHMAP_TYPED_FN void \
+name##_check_load(name *map) { \
+	name##_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST); \
+	if (__atomic_load_n(&table->next, __ATOMIC_SEQ_CST)) return; \
+\
+	uint32_t num_buckets = table->num_buckets; \
+	int64_t grow = (int64_t)num_buckets * HASHMAP_TYPED_GROW_LOAD; \
+	int64_t shrink = (int64_t)num_buckets / HASHMAP_TYPED_SHRINK_LOAD; \
+	bool can_grow = num_buckets <= UINT32_MAX / 2; \
+	bool can_shrink = num_buckets % 2 == 0 && num_buckets / 2 >= map->min_buckets; \
+\
+	/* the flushed count settles most checks, as in `hashmap` */ \
+	int64_t length = counter_read_approx(&map->length); \
+	int64_t error = counter_approx_error(); \
+	bool near_grow = can_grow && length - error <= grow && length + error > grow; \
+	bool near_shrink = can_shrink && length - error < shrink && length + error >= shrink; \
+	if (near_grow || near_shrink) { \
+		length = counter_read(&map->length); \
+	} \
+\
+	uint32_t resized; \
+	if (can_grow && length > grow) { \
+		resized = num_buckets * 2; \
+	} \
+	else if (can_shrink && length < shrink) { \
+		resized = num_buckets / 2; \
+	} \
+	else { \
+		return; \
+	} \
+\
+	name##_table *next = name##_table_new(resized, HASHMAP_TYPED_UNFILLED); \
+	name##_table *none = NULL; \
+	if (!__atomic_compare_exchange_n(&table->next, &none, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) { \
+		free(next->buckets); \
+		free(next); \
+	} \
+} \
+\
+/* walks the bucket for `hash` looking for `key`, unlinking deleted nodes on the way. \
+ * returns true if the key was found. either way `cursor` is filled in */ \
+HASHMAP_TYPED_FN bool \
+name##_find(name *map, key_type key, uint64_t hash, name##_cursor *cursor) { \
+	while (true) { \
+		cursor->table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST); \
+		cursor->head = name##_head(&cursor->table, hash); \
+		name##_node **bucket = &cursor->table->buckets[hash % cursor->table->num_buckets]; \
+\
+		if (hashmap_typed_is_frozen(cursor->head)) { \
+			name##_table *next = __atomic_load_n(&cursor->table->next, __ATOMIC_SEQ_CST); \
+			uint32_t groups = hashmap_typed_groups(cursor->table->num_buckets, next->num_buckets); \
+			name##_migrate(map, cursor->table, (hash % cursor->table->num_buckets) % groups); \
+			continue; \
+		} \
+\
+		cursor->prev = bucket; \
+		cursor->match = cursor->head; \
+		while (cursor->match) { \
+			cursor->next = __atomic_load_n(&cursor->match->next, __ATOMIC_SEQ_CST); \
+			if (hashmap_typed_is_frozen(cursor->next)) break; \
+\
+			if (hashmap_typed_is_deleted(cursor->next)) { \
+				/* unlink the deleted node. whichever thread does this releases it */ \
+				name##_node *deleted = cursor->match; \
+				name##_node *next = hashmap_typed_unmark(cursor->next); \
+				if (!__atomic_compare_exchange_n(cursor->prev, &deleted, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break; \
+\
+				free_later(cursor->match, free); \
+				if (cursor->prev == bucket) cursor->head = next; \
+				cursor->match = next; \
+				continue; \
+			} \
+\
+			if (cursor->match->hash == hash && eq_fn(cursor->match->key, key)) return true; \
+			cursor->prev = &cursor->match->next; \
+			cursor->match = cursor->next; \
+		} \
+		if (!cursor->match) return false; \
+	} \
+} \
+\
+/* prepends a node to the bucket `cursor` walked. `node` is made on the first attempt \
+ * and re-used if a retry is needed */ \
+HASHMAP_TYPED_FN bool \
+name##_insert(name *map, name##_cursor *cursor, name##_node **node, key_type key, uint64_t value, uint64_t hash) { \
+	if (!*node) { \
+		*node = malloc(sizeof(name##_node)); \
+		(*node)->key = key; \
+		(*node)->hash = hash; \
+	} \
+	(*node)->value = value; \
+	(*node)->next = cursor->head; \
+\
+	name##_node **bucket = &cursor->table->buckets[hash % cursor->table->num_buckets]; \
+	if (!__atomic_compare_exchange_n(bucket, &cursor->head, *node, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return false; \
+\
+	counter_add(&map->length, 1); \
+	name##_help_resize(map); \
+	name##_check_load(map); \
+	return true; \
+} \
+\
+HASHMAP_TYPED_FN bool \
+name##_get(name *map, key_type key, value_type *value) { \
+	uint64_t hash = hash_fn(key); \
+	bool found = false; \
+\
+	free_later_enter(); \
+	name##_table *table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST); \
+	name##_node *n = hashmap_typed_unmark(name##_head(&table, hash)); \
+	while (n) { \
+		name##_node *next = __atomic_load_n(&n->next, __ATOMIC_SEQ_CST); \
+		if (!hashmap_typed_is_deleted(next) && n->hash == hash && eq_fn(n->key, key)) { \
+			*value = name##_value(__atomic_load_n(&n->value, __ATOMIC_SEQ_CST)); \
+			found = true; \
+			break; \
+		} \
+		n = hashmap_typed_unmark(next); \
+	} \
+	free_later_exit(); \
+	return found; \
+} \
+\
+HASHMAP_TYPED_FN bool \
+name##_put(name *map, key_type key, value_type value, value_type *old) { \
+	uint64_t hash = hash_fn(key); \
+	uint64_t bits = name##_bits(value); \
+	name##_cursor cursor; \
+	name##_node *node = NULL; \
+	bool replaced; \
+\
+	free_later_enter(); \
+	while (true) { \
+		if (name##_find(map, key, hash, &cursor)) { \
+			uint64_t prior = __atomic_load_n(&cursor.match->value, __ATOMIC_SEQ_CST); \
+			if (hashmap_typed_swap(cursor.match, cursor.next, prior, bits)) { \
+				/* a node made by an earlier attempt was never linked */ \
+				free(node); \
+				if (old) *old = name##_value(prior); \
+				name##_help_resize(map); \
+				replaced = true; \
+				break; \
+			} \
+		} \
+		else if (name##_insert(map, &cursor, &node, key, bits, hash)) { \
+			replaced = false; \
+			break; \
+		} \
+	} \
+	free_later_exit(); \
+	return replaced; \
+} \
+\
+HASHMAP_TYPED_FN bool \
+name##_put_if_absent(name *map, key_type key, value_type value) { \
+	uint64_t hash = hash_fn(key); \
+	name##_cursor cursor; \
+	name##_node *node = NULL; \
+	bool added; \
+\
+	free_later_enter(); \
+	while (true) { \
+		if (name##_find(map, key, hash, &cursor)) { \
+			free(node); \
+			added = false; \
+			break; \
+		} \
+		if (name##_insert(map, &cursor, &node, key, name##_bits(value), hash)) { \
+			added = true; \
+			break; \
+		} \
+	} \
+	free_later_exit(); \
+	return added; \
+} \
+\
+HASHMAP_TYPED_FN bool \
+name##_del(name *map, key_type key, value_type *old) { \
+	uint64_t hash = hash_fn(key); \
+	name##_cursor cursor; \
+	bool deleted = false; \
+\
+	free_later_enter(); \
+	while (name##_find(map, key, hash, &cursor)) { \
+		/* mark the node as deleted along with the value it has, so that value is the \
+		 * one handed back */ \
+		uint64_t prior = __atomic_load_n(&cursor.match->value, __ATOMIC_SEQ_CST); \
+		name##_node *marked = hashmap_typed_mark(cursor.next, HASHMAP_TYPED_DELETED); \
+		hashmap_typed_pair expected = { .link = { cursor.next, prior } }; \
+		hashmap_typed_pair desired = { .link = { marked, prior } }; \
+		if (!__atomic_compare_exchange_n(&((hashmap_typed_pair *)cursor.match)->word, &expected.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue; \
+		counter_add(&map->length, -1); \
+		if (old) *old = name##_value(prior); \
+\
+		/* unlink it, or if the previous link changed, walk again so the walk unlinks it */ \
+		name##_node *match = cursor.match; \
+		if (__atomic_compare_exchange_n(cursor.prev, &match, cursor.next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) { \
+			free_later(cursor.match, free); \
+		} \
+		else { \
+			name##_find(map, key, hash, &cursor); \
+		} \
+\
+		name##_help_resize(map); \
+		name##_check_load(map); \
+		deleted = true; \
+		break; \
+	} \
+	free_later_exit(); \
+	return deleted; \
+}
+
+#endif // JFALKNER_HASHMAP_TYPED_H
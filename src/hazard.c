@@ -0,0 +1,254 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hazard.h"
+
+// fewest pointers a thread retires between scans, so small domains don't scan constantly
+#define HAZARD_SCAN_MIN 64
+// domains a thread remembers its record for
+#define HAZARD_CACHE 4
+
+// records of the calling thread, by domain
+typedef struct hazard_cached_s {
+	hazard_domain *domain;
+	uint64_t id;
+	hazard_record *record;
+	// next of the records kept in `overflow`
+	struct hazard_cached_s *next;
+} hazard_cached;
+
+static uint64_t next_id = 0;
+static __thread hazard_cached cached[HAZARD_CACHE];
+static __thread uint32_t next_evict = 0;
+// records the thread claimed while every cached one had slots taken. they are kept
+// until the thread exits, so the thread never owns more than one record per domain
+static __thread hazard_cached *overflow = NULL;
+
+// gives records back when a thread exits
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+
+hazard_domain *
+hazard_new(void) {
+	hazard_domain *domain = calloc(1, sizeof(hazard_domain));
+	domain->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_SEQ_CST);
+	return domain;
+}
+
+/**
+ * Hands a thread's record back to its domain. Anything still retired goes to the
+ * domain's orphans
+ */
+static void
+hazard_record_give_back(hazard_record *r) {
+	for (int i=0;i<HAZARD_SLOTS;i++) {
+		__atomic_store_n(&r->slots[i], NULL, __ATOMIC_SEQ_CST);
+	}
+	r->taken = 0;
+
+	if (r->retired) {
+		hazard_retired *last = r->retired;
+		while (last->next) last = last->next;
+		hazard_domain *domain = r->domain;
+		last->next = __atomic_load_n(&domain->orphans, __ATOMIC_SEQ_CST);
+		while (!__atomic_compare_exchange_n(&domain->orphans, &last->next, r->retired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	}
+	r->retired = NULL;
+	r->num_retired = 0;
+	__atomic_store_n(&r->in_use, 0, __ATOMIC_SEQ_CST);
+}
+
+static void
+hazard_thread_exit(void *unused) {
+	for (int i=0;i<HAZARD_CACHE;i++) {
+		if (cached[i].record) hazard_record_give_back(cached[i].record);
+		cached[i].domain = NULL;
+		cached[i].record = NULL;
+	}
+	while (overflow) {
+		hazard_cached *c = overflow;
+		overflow = c->next;
+		hazard_record_give_back(c->record);
+		free(c);
+	}
+}
+
+static void
+hazard_make_key(void) {
+	pthread_key_create(&thread_key, hazard_thread_exit);
+}
+
+/**
+ * Returns the calling thread's record in a domain, claiming one the first time
+ */
+static hazard_record *
+hazard_record_of(hazard_domain *domain) {
+	for (int i=0;i<HAZARD_CACHE;i++) {
+		if (cached[i].domain == domain && cached[i].id == domain->id) return cached[i].record;
+	}
+	for (hazard_cached *c = overflow; c; c = c->next) {
+		if (c->domain == domain && c->id == domain->id) return c->record;
+	}
+
+	// re-use the record of a thread that exited
+	hazard_record *r = __atomic_load_n(&domain->records, __ATOMIC_SEQ_CST);
+	for (; r; r = r->next) {
+		uint32_t unused = 0;
+		if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break;
+	}
+
+	// or add a new one. records are never removed, so walking them needs no protection
+	if (!r) {
+		r = aligned_alloc(64, sizeof(hazard_record));
+		memset(r, 0, sizeof(hazard_record));
+		r->in_use = 1;
+		r->domain = domain;
+		r->next = __atomic_load_n(&domain->records, __ATOMIC_SEQ_CST);
+		while (!__atomic_compare_exchange_n(&domain->records, &r->next, r, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+		__atomic_fetch_add(&domain->num_records, 1, __ATOMIC_SEQ_CST);
+	}
+
+	// remember it, making room by giving back a record that has no slots in use
+	pthread_once(&thread_key_once, hazard_make_key);
+	pthread_setspecific(thread_key, cached);
+	for (int tries=0;tries<HAZARD_CACHE;tries++) {
+		hazard_cached *c = &cached[next_evict++ % HAZARD_CACHE];
+		if (c->record && c->record->taken) continue;
+		if (c->record) hazard_record_give_back(c->record);
+		c->domain = domain;
+		c->id = domain->id;
+		c->record = r;
+		return r;
+	}
+
+	// every cached record has slots in use, so keep this one aside
+	hazard_cached *c = malloc(sizeof(hazard_cached));
+	c->domain = domain;
+	c->id = domain->id;
+	c->record = r;
+	c->next = overflow;
+	overflow = c;
+	return r;
+}
+
+void **
+hazard_acquire(hazard_domain *domain) {
+	hazard_record *r = hazard_record_of(domain);
+	for (int i=0;i<HAZARD_SLOTS;i++) {
+		if (!(r->taken & (1u << i))) {
+			r->taken |= 1u << i;
+			return &r->slots[i];
+		}
+	}
+	return NULL;
+}
+
+void
+hazard_release(void **slot) {
+	__atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+	// slots are the first field of a record, so the record and index follow from the slot
+	hazard_record *r = (hazard_record *)((uintptr_t)slot & ~(uintptr_t)63);
+	r->taken &= ~(1u << (slot - r->slots));
+}
+
+void *
+hazard_protect(void **slot, void **src) {
+	void *p = __atomic_load_n(src, __ATOMIC_SEQ_CST);
+	while (true) {
+		__atomic_store_n(slot, p, __ATOMIC_SEQ_CST);
+		// if `src` still holds it, it wasn't retired before the slot was visible
+		void *again = __atomic_load_n(src, __ATOMIC_SEQ_CST);
+		if (again == p) return p;
+		p = again;
+	}
+}
+
+uint32_t
+hazard_scan_limit(hazard_domain *domain) {
+	uint32_t limit = 2 * HAZARD_SLOTS * __atomic_load_n(&domain->num_records, __ATOMIC_SEQ_CST);
+	return limit > HAZARD_SCAN_MIN ? limit : HAZARD_SCAN_MIN;
+}
+
+static int
+hazard_cmp(const void *x, const void *y) {
+	uintptr_t a = *(const uintptr_t *)x;
+	uintptr_t b = *(const uintptr_t *)y;
+	return a < b ? -1 : a > b;
+}
+
+void
+hazard_scan(hazard_domain *domain) {
+	hazard_record *me = hazard_record_of(domain);
+
+	// take everything retired so far, including anything left by threads that exited
+	hazard_retired *list = me->retired;
+	me->retired = NULL;
+	me->num_retired = 0;
+	if (__atomic_load_n(&domain->orphans, __ATOMIC_SEQ_CST)) {
+		hazard_retired *v = __atomic_exchange_n(&domain->orphans, NULL, __ATOMIC_SEQ_CST);
+		while (v) {
+			hazard_retired *next = v->next;
+			v->next = list;
+			list = v;
+			v = next;
+		}
+	}
+	if (!list) return;
+
+	// copy every published pointer. a record added after this can't publish a pointer
+	// that was already retired, since it is no longer reachable. records are linked
+	// before `num_records` counts them, so the buffer grows with the walk
+	uint32_t max = __atomic_load_n(&domain->num_records, __ATOMIC_SEQ_CST) * HAZARD_SLOTS + HAZARD_SLOTS;
+	uintptr_t *hazards = malloc(max * sizeof(uintptr_t));
+	uint32_t count = 0;
+	for (hazard_record *r = __atomic_load_n(&domain->records, __ATOMIC_SEQ_CST); r; r = r->next) {
+		if (count + HAZARD_SLOTS > max) {
+			max *= 2;
+			hazards = realloc(hazards, max * sizeof(uintptr_t));
+		}
+		for (int i=0;i<HAZARD_SLOTS;i++) {
+			void *p = __atomic_load_n(&r->slots[i], __ATOMIC_SEQ_CST);
+			if (p) hazards[count++] = (uintptr_t)p;
+		}
+	}
+	qsort(hazards, count, sizeof(uintptr_t), hazard_cmp);
+
+	// release what isn't published and keep the rest for the next scan
+	while (list) {
+		hazard_retired *v = list;
+		list = v->next;
+		uintptr_t p = (uintptr_t)v->ptr;
+		if (bsearch(&p, hazards, count, sizeof(uintptr_t), hazard_cmp)) {
+			v->next = me->retired;
+			me->retired = v;
+			me->num_retired += 1;
+		}
+		else {
+			v->release(v->ptr);
+			free(v);
+		}
+	}
+	free(hazards);
+}
+
+void
+hazard_retire(hazard_domain *domain, void *ptr, void release(void *ptr)) {
+	// nothing to do for data that isn't owned
+	if (!release) return;
+	hazard_record *r = hazard_record_of(domain);
+
+	hazard_retired *v = malloc(sizeof(hazard_retired));
+	v->ptr = ptr;
+	v->release = release;
+	v->next = r->retired;
+	r->retired = v;
+	r->num_retired += 1;
+
+	if (r->num_retired >= hazard_scan_limit(domain)) {
+		hazard_scan(domain);
+	}
+}
@@ -0,0 +1,101 @@
+/**
+ * Hazard Pointers
+ *
+ * An alternative to `free_later` for data that readers hold on to for a long time, for
+ * example while they block on I/O. Epoch-based reclamation can't release anything
+ * while such a reader is inside a section, so one slow reader makes memory pile up for
+ * every thread. With hazard pointers a reader instead publishes the one pointer it is
+ * using in a slot, and only that pointer is kept back.
+ *
+ * `hazard_retire(domain, ptr, release)` registers a pointer to have `release` called on
+ * it once no slot of the domain holds it. Each thread scans the slots after retiring
+ * `hazard_scan_limit()` pointers, so a thread never has more than that many pointers
+ * waiting, no matter how slow a reader is.
+ *
+ * A reader takes a slot with `hazard_acquire`, loads a pointer through
+ * `hazard_protect` and gives the slot back with `hazard_release` once it is done. Data
+ * structures may protect pointers on behalf of their callers, see
+ * `hashmap_get_protected`.
+ *
+ * Threads are registered with a domain the first time they use it, and whatever they
+ * still have retired when they exit is handed to the threads that remain. Domains are
+ * meant to live as long as the process.
+ */
+#ifndef JFALKNER_HAZARD_H
+#define JFALKNER_HAZARD_H
+
+#include <stdint.h>
+
+// slots each thread has in a domain
+#define HAZARD_SLOTS 4
+
+typedef struct hazard_retired_s {
+	struct hazard_retired_s *next;
+	void *ptr;
+	void (*release)(void *ptr);
+} hazard_retired;
+
+// a thread's slots in a domain. only `slots` is read by other threads
+typedef struct hazard_record_s {
+	void *slots[HAZARD_SLOTS];
+	// set while a thread owns this record. records of exited threads are re-used
+	uint32_t in_use;
+	struct hazard_record_s *next;
+	struct hazard_domain_s *domain;
+
+	// bit `i` is set while slot `i` is acquired
+	uint32_t taken;
+	// pointers retired by the owner that are waiting for a scan
+	hazard_retired *retired;
+	uint32_t num_retired;
+} __attribute__((aligned(64))) hazard_record;
+
+typedef struct hazard_domain_s {
+	// every record that was ever made for the domain
+	hazard_record *records;
+	uint32_t num_records;
+	// pointers left behind by threads that exited, adopted by the next scan
+	hazard_retired *orphans;
+	// tells a new domain apart from an old one that was at the same address
+	uint64_t id;
+} hazard_domain;
+
+
+/**
+ * Creates a new domain
+ */
+hazard_domain * hazard_new(void);
+
+/**
+ * Takes one of the calling thread's slots. Returns NULL if all of them are taken
+ */
+void ** hazard_acquire(hazard_domain *domain);
+
+/**
+ * Clears a slot and gives it back
+ */
+void hazard_release(void **slot);
+
+/**
+ * Loads `*src` and publishes it in `slot`, retrying until the published pointer is
+ * still what `*src` holds. A pointer that is reachable from `src` after this can't be
+ * released until the slot is cleared.
+ */
+void * hazard_protect(void **slot, void **src);
+
+/**
+ * Registers `ptr` to have `release` called on it once no slot holds it
+ */
+void hazard_retire(hazard_domain *domain, void *ptr, void release(void *ptr));
+
+/**
+ * Releases every pointer the calling thread retired that no slot holds
+ */
+void hazard_scan(hazard_domain *domain);
+
+/**
+ * Most pointers a thread keeps retired before it scans
+ */
+uint32_t hazard_scan_limit(hazard_domain *domain);
+
+#endif // JFALKNER_HAZARD_H
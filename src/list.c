@@ -1,52 +1,176 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
+#include "backoff.h"
+#include "free_later.h"
 #include "list.h"
 
-volatile uint32_t list_retries_empty = 0;
-volatile uint32_t list_retries_populated = 0;
+// used for testing CAS-retries in tests
+counter list_retries_empty;
+counter list_retries_populated;
 
 static const list_node *empty = NULL;
 
 
 list * list_new()
 {
-	list *l = calloc(1, sizeof(list_node));
+	list *l = aligned_alloc(64, sizeof(list));
+	memset(l, 0, sizeof(list));
 	l->head = (list_node *)empty;
-	l->length = 0;
 	return l;
 }
 
-void list_add(list *l, void *val)
+list * list_new_pool(objpool *pool)
 {
-	// wrap the value as a node in the linked list
-	list_node *v = calloc(1, sizeof(list_node));
-	v->val = val;
+	list *l = list_new();
+	l->pool = pool;
+	return l;
+}
+
+/**
+ * Reads the head and tag. A torn read only means the first CAS fails and reloads both
+ */
+static inline void
+list_load_top(list *l, list_node **head, uintptr_t *tag)
+{
+	*head = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+	*tag = __atomic_load_n(&l->tag, __ATOMIC_RELAXED);
+}
+
+/**
+ * Swaps in a new head if the head and tag are still the expected ones. On failure the
+ * expected ones are updated to the current ones
+ */
+static inline bool
+list_cas_top(list *l, list_node **head, uintptr_t *tag, list_node *new_head, uintptr_t new_tag)
+{
+	list_top expected = { .head = *head, .tag = *tag };
+	list_top desired = { .head = new_head, .tag = new_tag };
+	bool b = __atomic_compare_exchange_n(&l->top, &expected.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	*head = expected.head;
+	*tag = expected.tag;
+	return b;
+}
 
-	// try adding to the front of the list
+/**
+ * Links the chain from `first` to `last` in front of the list with one CAS
+ */
+static void
+list_push(list *l, list_node *first, list_node *last, int64_t count)
+{
+	// try adding to the front of the list. only pops change the tag, which is enough for
+	// a pop to notice a node being added again. a node taken from the list may still be
+	// read by a pop that is about to fail, so `next` is written atomically
+	list_node *n;
+	uintptr_t tag;
+	list_load_top(l, &n, &tag);
+	uint32_t spins = BACKOFF_MIN;
 	while (true) {
-		list_node *n = l->head;
 		// case for if this is the first link in the list
 		if (n == empty) {
-			v->next = NULL;
-	        	bool b = __atomic_compare_exchange(&l->head, &empty, &v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
-			if (b) {
-				__atomic_fetch_add(&l->length, 1, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&last->next, NULL, __ATOMIC_RELAXED);
+			if (list_cas_top(l, &n, &tag, first, tag)) {
+				counter_add(&l->length, count);
 				return;
 			}
-			list_retries_empty++;
+			counter_add(&list_retries_empty, 1);
 		}
 		// case for inserting when an existing link is present
 		else {
-			v->next = n;
-	        	bool b = __atomic_compare_exchange(&l->head, &n, &v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
-			if (b) {
-				__atomic_fetch_add(&l->length, 1, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&last->next, n, __ATOMIC_RELAXED);
+			if (list_cas_top(l, &n, &tag, first, tag)) {
+				counter_add(&l->length, count);
 				return;
 			}
-			list_retries_populated++;
+			counter_add(&list_retries_populated, 1);
+		}
+		backoff_wait(&spins);
+	}
+}
+
+list_node * list_new_node(list *l, void *val)
+{
+	list_node *v = l->pool ? objpool_alloc(l->pool) : calloc(1, sizeof(list_node));
+	v->next = NULL;
+	v->val = val;
+	return v;
+}
+
+void list_add(list *l, void *val)
+{
+	// wrap the value as a node in the linked list
+	list_node *v = list_new_node(l, val);
+	list_push(l, v, v, 1);
+}
+
+void list_add_chain(list *l, list_node *chain)
+{
+	if (!chain) {
+		return;
+	}
+	// the chain isn't shared yet, so finding its end needs no care
+	int64_t count = 1;
+	list_node *last = chain;
+	while (last->next) {
+		last = last->next;
+		count += 1;
+	}
+	list_push(l, chain, last, count);
+}
+
+void * list_pop(list *l)
+{
+	// the first node may be popped and released by another thread while it is read
+	free_later_enter();
+	list_node *n;
+	uintptr_t tag;
+	list_load_top(l, &n, &tag);
+	uint32_t spins = BACKOFF_MIN;
+	while (n != empty) {
+		// a stale `next` is harmless, the tag has changed and the CAS fails
+		list_node *next = __atomic_load_n(&n->next, __ATOMIC_RELAXED);
+		if (list_cas_top(l, &n, &tag, next, tag + 1)) {
+			break;
 		}
+		backoff_wait(&spins);
+	}
+	free_later_exit();
 
+	if (n == empty) {
+		return NULL;
+	}
+	counter_add(&l->length, -1);
+	// other pops may still be reading `next`, so the node is left as it is
+	void *val = n->val;
+	free_later(n, l->pool ? objpool_release : free);
+	return val;
+}
+
+list_node * list_pop_all(list *l)
+{
+	list_node *n;
+	uintptr_t tag;
+	list_load_top(l, &n, &tag);
+	while (n != empty && !list_cas_top(l, &n, &tag, (list_node *)empty, tag + 1));
+
+	int64_t count = 0;
+	for (list_node *v = n; v; v = v->next) {
+		count += 1;
+	}
+	if (count) {
+		counter_add(&l->length, -count);
+	}
+	return n;
+}
+
+void list_free_nodes(list *l, list_node *nodes)
+{
+	while (nodes) {
+		// copy ->next before free'ing
+		list_node *tofree = nodes;
+		nodes = nodes->next;
+		free_later(tofree, l->pool ? objpool_release : free);
 	}
 }
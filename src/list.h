@@ -1,30 +1,84 @@
 /**
  * Lock-Free Linked List
  *
- * This is an add-only linked list that does not use user-space mutexes. It relies on
- * hardware specific memory locking, typically via compare-and-swap (CAS) operations.
- * 
- * The implementation currently is add-only.
+ * This is a linked list that does not use user-space mutexes. It relies on hardware
+ * specific memory locking, typically via compare-and-swap (CAS) operations.
+ *
+ * Values are added to and popped from the front, so the list doubles as a lock-free
+ * stack (a Treiber stack), for example as a pool of recycled buffers or a stack of
+ * tasks. A node that was popped and added again can make the head look unchanged to a
+ * slow pop (the ABA problem), so the head is paired with a tag that every pop changes,
+ * and both are updated with one 16-byte CAS. Contended CASes back off exponentially.
+ *
+ * Popped nodes are released through `free_later`, since another pop may still be
+ * reading them.
+ *
+ * Producers that have many values at once can link them into a chain and publish it
+ * with `list_add_chain`, and consumers can take everything with `list_pop_all`. Either
+ * way the whole batch costs one CAS on the head instead of one per value.
  */
 #ifndef JFALKNER_LIST_H
 #define JFALKNER_LIST_H
 
 #include <stdint.h>
 
+#include "counter.h"
+#include "objpool.h"
+
 
 typedef struct list_node_s {
 	struct list_node_s *next;
 	void *val;
 } list_node;
 
+// head and tag of a list as one 16-byte word
+typedef union list_top_u {
+	struct {
+		list_node *head;
+		uintptr_t tag;
+	};
+	unsigned __int128 word;
+} list_top;
+
 typedef struct list_s {
-	// list of nodes in the linked-list
-	list_node *head;
-	uint32_t length;
+	// list of nodes in the linked-list, and a tag that changes on every pop. both are
+	// swapped together through `top`
+	union {
+		struct {
+			list_node *head;
+			uintptr_t tag;
+		};
+		unsigned __int128 top;
+	} __attribute__((aligned(16)));
+	counter length;
+	// where nodes come from. NULL uses calloc
+	objpool *pool;
 } list;
 
 list * list_new();
 
+// makes a list whose nodes come from `pool`, which must hold objects of at least
+// `sizeof(list_node)` bytes
+list * list_new_pool(objpool *pool);
+
 void list_add(list *list, void *val);
 
+// makes a node for `val` from the list's pool, or calloc if it has none, so that chains
+// for `list_add_chain` can be built up front
+list_node * list_new_node(list *list, void *val);
+
+// adds a chain of nodes linked through `next`, keeping their order, with a single CAS.
+// the nodes must come from `list_new_node` or `list_pop_all` on a list with the same pool
+void list_add_chain(list *list, list_node *chain);
+
+// removes the first value and returns it, or NULL if the list is empty
+void * list_pop(list *list);
+
+// removes every node at once and returns them, first to last. the nodes belong to the
+// caller, who should hand them back with `list_free_nodes` once done with the values
+list_node * list_pop_all(list *list);
+
+// releases nodes returned by `list_pop_all`, once no pop can be reading them
+void list_free_nodes(list *list, list_node *nodes);
+
 #endif // JFALKNER_LIST_H
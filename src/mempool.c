@@ -1,10 +1,18 @@
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "mempool.h"
 
+// mbind policy that prefers a node but falls back to others when it is full. from
+// <numaif.h>, which would otherwise need libnuma
+#define MEMPOOL_MPOL_PREFERRED 1
+
 // all data types to ensure data alighment
 union align {
 	int i;
@@ -22,104 +30,526 @@ union header {
 	union align a;
 };
 
+// a thread's region in a pool. only the thread itself reads or writes it
+typedef struct mempool_region_s {
+	mempool *pool;
+	uint64_t id;
+	uint8_t *avail;
+	uint8_t *limit;
+	// CPU the thread last refilled the region on, and that CPU's NUMA node
+	int cpu;
+	uint32_t node;
+} mempool_region;
+
+static uint64_t next_id = 0;
+static __thread mempool_region regions[MEMPOOL_REGIONS];
+static __thread uint32_t next_evict = 0;
+
 mempool*
 mempool_new_default(void) {
 	// default to 10k per block and consider 3x older blocks
 	return mempool_new(10 * 1024, 3);
 }
 
+mempool*
+mempool_new_mapped(uint32_t chunk_size, uint8_t lookback, uint32_t flags) {
+	return mempool_new_flags(chunk_size, lookback, flags | MEMPOOL_MMAP);
+}
+
+mempool*
+mempool_new_flags(uint32_t chunk_size, uint8_t lookback, uint32_t flags) {
+	mempool *pool = mempool_new(chunk_size, lookback);
+	if (pool == NULL)
+		return NULL;
+	pool->flags = flags;
+	return pool;
+}
+
 mempool*
 mempool_new(uint32_t chunk_size, uint8_t lookback) {
-	mempool *pool = malloc(sizeof (mempool));
+	mempool *pool = aligned_alloc(64, sizeof (mempool));
 	if (pool == NULL)
 		return NULL;
+	memset(pool, 0, sizeof (mempool));
 	pool->chunks = NULL;
 	pool->chunk_size = chunk_size;
 	pool->lookback = lookback;
+	pool->region_size = chunk_size / MEMPOOL_REGION_SPLIT / sizeof (union align) * sizeof (union align);
+	pool->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
 	return pool;
 }
 
-void
-mempool_free(mempool **pool) {
-	mempool_chunk *c = (*pool)->chunks;
+/**
+ * Frees a list of chunks the same way they were allocated
+ */
+static void
+mempool_free_chunks(mempool *pool, mempool_chunk *c) {
 	while (c) {
 		// tofree is a linked-list node. copy ->next before free'ing
 		mempool_chunk *tofree = c;
 		c = c->next;
 		// free the old node
-		free(tofree);
+		if (pool->flags & MEMPOOL_MMAP) {
+			munmap(tofree, tofree->limit - (uint8_t *)tofree);
+		}
+		else {
+			free(tofree);
+		}
 	}
+}
+
+void
+mempool_free(mempool **pool) {
+	mempool_free_chunks(*pool, (*pool)->chunks);
 	(*pool)->chunks = NULL;
+	for (int i=0;i<MEMPOOL_NODES;i++) {
+		mempool_free_chunks(*pool, (*pool)->node_chunks[i]);
+		(*pool)->node_chunks[i] = NULL;
+	}
+	mempool_free_chunks(*pool, (*pool)->spare);
+	(*pool)->spare = NULL;
+	mempool_free_chunks(*pool, (*pool)->spare_large);
+	(*pool)->spare_large = NULL;
 
 	// release memory allocated for the mempool struct and NULL the pointer
 	free(*pool);
 	*pool = NULL;
 }
 
-void *
-mempool_alloc(mempool *pool, uint32_t nbytes) {
-	uint8_t *avail_bytes;
+/**
+ * Tries to take `nbytes` from a chunk. Returns NULL if it doesn't have enough left
+ */
+static inline void *
+mempool_chunk_take(mempool *pool, mempool_chunk *chunk, uint32_t nbytes) {
+	// try to fake-alloc a section of this memory chunk that fits the data
+	uint8_t *avail_bytes = __atomic_load_n(&chunk->avail, __ATOMIC_RELAXED);
+	while (nbytes <= chunk->limit - avail_bytes) {
+		// available bytes must not change for this CAS
+		uint8_t *updated_avail_bytes = avail_bytes + nbytes;
+		bool success = __atomic_compare_exchange(&chunk->avail, &avail_bytes, &updated_avail_bytes, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		if (success) {
+			return avail_bytes;
+		}
+		else {
+			// striped so that counting doesn't add to the contention being counted
+			counter_add(&pool->cas_alloc_retries, 1);
+		}
+	}
+	return NULL;
+}
 
-	// sanity check that a valid pool and non-zero bytes are being allocated
-	if (!pool || nbytes <= 0)
+/**
+ * Returns the NUMA node of the CPU the calling thread is running on. This is a
+ * syscall, see `mempool_node_of` for the cached one
+ */
+static inline uint32_t
+mempool_node(void) {
+	unsigned cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		return 0;
+	return node;
+}
+
+/**
+ * Returns the bytes of a chunk with room for `nbytes`, including its header
+ */
+static inline size_t
+mempool_chunk_bytes(mempool *pool, uint32_t nbytes) {
+	size_t size = sizeof (union header) + nbytes;
+	if (!(pool->flags & MEMPOOL_MMAP))
+		return size;
+	// mapped chunks are whole pages
+	size_t page = pool->flags & MEMPOOL_HUGEPAGES ? MEMPOOL_HUGEPAGE : (size_t)sysconf(_SC_PAGESIZE);
+	return (size + page - 1) / page * page;
+}
+
+/**
+ * Maps `size` bytes for a chunk on `node`. Returns NULL if the memory couldn't be
+ * mapped
+ */
+static void *
+mempool_map(mempool *pool, size_t size, uint32_t node) {
+	void *mem = MAP_FAILED;
+	if (pool->flags & MEMPOOL_HUGEPAGES) {
+		// reserved hugepages first. without any, ask for transparent ones instead
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+		if (pool->flags & MEMPOOL_HUGEPAGES)
+			madvise(mem, size, MADV_HUGEPAGE);
+	}
+
+	// place the pages on this thread's node. nothing has touched them yet, so none are
+	// placed already. a failure only means the kernel decides where they go
+	if (pool->flags & MEMPOOL_NUMA_LOCAL) {
+		unsigned long mask = 1UL << (node % (8 * sizeof mask));
+		syscall(SYS_mbind, mem, size, MEMPOOL_MPOL_PREFERRED, &mask, 8 * sizeof mask, 0);
+	}
+	return mem;
+}
+
+/**
+ * Makes a chunk with room for `nbytes`, of which the first `used` are taken, on `node`
+ */
+static mempool_chunk *
+mempool_chunk_new(mempool *pool, uint32_t nbytes, uint32_t used, uint32_t node) {
+	// the rest of the last page of a mapped chunk is part of the chunk
+	size_t chunk_size = mempool_chunk_bytes(pool, nbytes);
+	mempool_chunk *chunk;
+	if (pool->flags & MEMPOOL_MMAP) {
+		chunk = mempool_map(pool, chunk_size, node);
+	}
+	else {
+		chunk = malloc(chunk_size);
+	}
+	if (chunk == NULL)
 		return NULL;
+	chunk->next = NULL;
+	chunk->ptr = (uint8_t *)((union header *)chunk + 1);
+	chunk->avail = chunk->ptr + used;
+	chunk->limit = (uint8_t *)chunk + chunk_size;
+	__atomic_add_fetch(&pool->reserved, chunk_size, __ATOMIC_RELAXED);
+	return chunk;
+}
+
+/**
+ * Takes a chunk that `mempool_rewind` or `mempool_reset` emptied from one of the lists
+ * of spares, if it has room for `nbytes`. Returns NULL if the first one doesn't
+ */
+static mempool_chunk *
+mempool_pop_spare(mempool_chunk **spares, uint32_t nbytes) {
+	mempool_chunk *c = __atomic_load_n(spares, __ATOMIC_ACQUIRE);
+	// chunks only become spares while no thread is allocating, so a chunk that was
+	// popped can't come back and fool this CAS. its `next` may be stale, but then the
+	// CAS fails
+	while (c && (uint64_t)(c->limit - c->ptr) >= nbytes && !__atomic_compare_exchange_n(spares, &c, __atomic_load_n(&c->next, __ATOMIC_RELAXED), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return c && (uint64_t)(c->limit - c->ptr) >= nbytes ? c : NULL;
+}
+
+/**
+ * Returns the list of chunks that the calling thread should allocate from
+ */
+static inline mempool_chunk **
+mempool_chunks_of(mempool *pool, uint32_t node) {
+	if (pool->flags & MEMPOOL_NUMA_LOCAL)
+		return &pool->node_chunks[node % MEMPOOL_NODES];
+	return &pool->chunks;
+}
+
+/**
+ * Takes `nbytes`, already padded, from the chunks shared by every thread running on
+ * `node`
+ */
+static void *
+mempool_alloc_shared(mempool *pool, uint32_t nbytes, uint32_t node) {
+	mempool_chunk **chunks = mempool_chunks_of(pool, node);
+
+	// an oversized request gets a chunk of its own. it goes behind the head, so that the
+	// head keeps serving smaller requests. it is at least as large as any other chunk, so
+	// lookback can use the rest of it and it can become a spare
+	if (nbytes > pool->chunk_size / 2) {
+		// regular spares hold at least `chunk_size`, and the largest of the larger ones
+		// comes first. what is left of one stays usable by lookback
+		mempool_chunk *own = nbytes <= pool->chunk_size ? mempool_pop_spare(&pool->spare, nbytes) : mempool_pop_spare(&pool->spare_large, nbytes);
+		if (own)
+			own->avail = own->ptr + nbytes;
+		else
+			own = mempool_chunk_new(pool, nbytes > pool->chunk_size ? nbytes : pool->chunk_size, nbytes, node);
+		if (own == NULL)
+			return NULL;
+		while (true) {
+			mempool_chunk *head = __atomic_load_n(chunks, __ATOMIC_ACQUIRE);
+			mempool_chunk **link = head ? &head->next : chunks;
+			own->next = head ? __atomic_load_n(&head->next, __ATOMIC_ACQUIRE) : NULL;
+			mempool_chunk *expected = head ? own->next : NULL;
+			if (__atomic_compare_exchange_n(link, &expected, own, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				return own->ptr;
+			}
+			counter_add(&pool->cas_chunk_append_retries, 1);
+		}
+	}
 
-	// pad nbytes to ensure data alignment cause data to go past bounds
-	nbytes = ((nbytes + sizeof (union align) - 1) / (sizeof (union align))) * (sizeof (union align));
 	while (true) {
 		// memory chunk that we're checking
-		mempool_chunk *chunk = pool->chunks;
-		if (chunk) {
-			// try to fake-alloc a section of this memory chunk that fits the data
-			while (nbytes < chunk->limit - chunk->avail) {
-				// available bytes must not change for this CAS
-				avail_bytes = chunk->avail;
-				uint8_t *updated_avail_bytes = avail_bytes + nbytes;
-				bool success = __atomic_compare_exchange(&chunk->avail, &avail_bytes, &updated_avail_bytes, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
-				if (success) {
-					return avail_bytes;
-				}
-				else {
-					// this count won't be perfect. no need to impact performance to make it perfect
-					pool->cas_alloc_retries++;
-				}
-			}
+		mempool_chunk *chunk = __atomic_load_n(chunks, __ATOMIC_ACQUIRE);
+
+		// try the head, then up to `lookback` older chunks, which often still have room
+		// for a request that didn't fit the head
+		mempool_chunk *c = chunk;
+		for (uint32_t i = 0; c && i <= pool->lookback; i++) {
+			void *ptr = mempool_chunk_take(pool, c, nbytes);
+			if (ptr)
+				return ptr;
+			c = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE);
 		}
 
 		// if another thread already made a new chunk, try it
-		if (chunk != pool->chunks)
+		if (chunk != __atomic_load_n(chunks, __ATOMIC_ACQUIRE))
 			continue;
 
-		// make a new chunk of memory for the pool
-		uint32_t chunk_size = sizeof (union header) + nbytes + pool->chunk_size;
-		mempool_chunk *next_chunk = malloc(chunk_size);
+		// make a new chunk of memory for the pool, re-using a spare one if there is one
+		mempool_chunk *next_chunk = mempool_pop_spare(&pool->spare, pool->chunk_size);
+		if (next_chunk)
+			next_chunk->avail = next_chunk->ptr + nbytes;
+		else
+			next_chunk = mempool_chunk_new(pool, pool->chunk_size, nbytes, node);
 		if (next_chunk == NULL)
 			return NULL;
-		next_chunk->avail = (uint8_t *)((union header *)next_chunk + 1);
-		next_chunk->avail += nbytes;
-		next_chunk->limit = (uint8_t *)next_chunk + chunk_size;
-
-		// copy this before another thread might edit it
-		avail_bytes = next_chunk->avail - nbytes;
 
 		// prepend this new chunk to the pool's list
 		while (true) {
 			// cache existing list and point this link at it
-			chunk = pool->chunks;
-			pool->chunks = chunk;
+			chunk = *chunks;
+			next_chunk->next = chunk;
 			// available bytes must not change for this CAS
-			bool success = __atomic_compare_exchange(&pool->chunks, &chunk, &next_chunk, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			bool success = __atomic_compare_exchange(chunks, &chunk, &next_chunk, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 			if (success) {
-				return avail_bytes;
+				return next_chunk->ptr;
 			}
 			else {
-				// this count won't be perfect. no need to impact performance to make it perfect
-				pool->cas_chunk_append_retries++;
+				// striped so that counting doesn't add to the contention being counted
+				counter_add(&pool->cas_chunk_append_retries, 1);
 			}
 		}
 	}
 }
 
+// a free block's first word links it to the next block of its class, and the second
+// holds its size. blocks of the smallest class are too short for it, and hold exactly
+// the size of the class
+#define next_block(block) (((void **)(block))[0])
+#define block_size(block) (((uint64_t *)(block))[1])
+
+/**
+ * Returns the smallest class whose blocks hold `nbytes`, or MEMPOOL_CLASSES if none do
+ */
+static inline uint32_t
+mempool_class_fitting(uint32_t nbytes) {
+	uint32_t c = 0;
+	while (c < MEMPOOL_CLASSES && (1u << (c + MEMPOOL_CLASS_MIN)) < nbytes) c++;
+	return c;
+}
+
+/**
+ * Returns the largest class whose blocks are no larger than `nbytes`. Released blocks
+ * are filed there, so every block of a class holds at least its size
+ */
+static inline uint32_t
+mempool_class_holding(uint64_t nbytes) {
+	uint32_t c = 0;
+	while (c + 1 < MEMPOOL_CLASSES && (1u << (c + 1 + MEMPOOL_CLASS_MIN)) <= nbytes) c++;
+	return c;
+}
+
+/**
+ * Pops a block off a class's free list. Returns NULL if it is empty
+ */
+static void *
+mempool_pop(mempool_class *class) {
+	mempool_top top, desired;
+	// a torn read only means the first CAS fails and reloads both halves
+	top.top.block = __atomic_load_n(&class->free_list.top.block, __ATOMIC_ACQUIRE);
+	top.top.tag = __atomic_load_n(&class->free_list.top.tag, __ATOMIC_RELAXED);
+	while (top.top.block) {
+		// the block may already have been popped and written to by another thread, in
+		// which case this reads garbage but the tag has changed and the CAS fails. chunks
+		// are only released by `mempool_free`, so the read itself is safe
+		desired.top.block = __atomic_load_n(&next_block(top.top.block), __ATOMIC_RELAXED);
+		desired.top.tag = top.top.tag + 1;
+		if (__atomic_compare_exchange_n(&class->free_list.word, &top.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			return top.top.block;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Pushes a block onto a class's free list
+ */
+static void
+mempool_push(mempool_class *class, void *block) {
+	mempool_top top, desired;
+	top.top.block = __atomic_load_n(&class->free_list.top.block, __ATOMIC_RELAXED);
+	top.top.tag = __atomic_load_n(&class->free_list.top.tag, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&next_block(block), top.top.block, __ATOMIC_RELAXED);
+		desired.top.block = block;
+		// only pops change the tag, which is enough for a pop to notice a re-push
+		desired.top.tag = top.top.tag;
+	} while (!__atomic_compare_exchange_n(&class->free_list.word, &top.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+/**
+ * Returns the calling thread's region in a pool, making room for it if the thread
+ * doesn't have one yet
+ */
+static inline mempool_region *
+mempool_region_of(mempool *pool) {
+	for (int i=0;i<MEMPOOL_REGIONS;i++) {
+		if (regions[i].pool == pool && regions[i].id == pool->id) return &regions[i];
+	}
+	// the rest of an evicted region is left unused
+	mempool_region *r = &regions[next_evict++ % MEMPOOL_REGIONS];
+	r->pool = pool;
+	r->id = pool->id;
+	r->avail = NULL;
+	r->limit = NULL;
+	r->cpu = -1;
+	return r;
+}
+
+/**
+ * Returns the NUMA node the calling thread is running on, for pools with
+ * `MEMPOOL_NUMA_LOCAL`, and 0 for the rest. The node is cached in the thread's region
+ * `r`, or in its region of the pool if `r` is NULL, and only looked up again once
+ * `sched_getcpu`, which doesn't need a syscall, shows the thread on another CPU
+ */
+static inline uint32_t
+mempool_node_of(mempool *pool, mempool_region *r) {
+	if (!(pool->flags & MEMPOOL_NUMA_LOCAL))
+		return 0;
+	if (r == NULL)
+		r = mempool_region_of(pool);
+	int cpu = sched_getcpu();
+	if (cpu != r->cpu) {
+		r->cpu = cpu;
+		r->node = mempool_node();
+	}
+	return r->node;
+}
+
+/**
+ * Takes `nbytes`, already padded, from the calling thread's region, or from the shared
+ * chunks if it is too large for a region
+ */
+static void *
+mempool_carve(mempool *pool, uint32_t nbytes) {
+	// large requests would waste too much of a region
+	if (nbytes > pool->region_size / 2)
+		return mempool_alloc_shared(pool, nbytes, mempool_node_of(pool, NULL));
+
+	// bump allocate from this thread's region, refilling it once it runs out. what is
+	// left of the old region is too small for this request and is left unused
+	mempool_region *r = mempool_region_of(pool);
+	if (nbytes > (uint32_t)(r->limit - r->avail)) {
+		uint8_t *region = mempool_alloc_shared(pool, pool->region_size, mempool_node_of(pool, r));
+		if (region == NULL)
+			return NULL;
+		r->avail = region;
+		r->limit = region + pool->region_size;
+	}
+	uint8_t *ptr = r->avail;
+	r->avail += nbytes;
+	return ptr;
+}
+
+/**
+ * Files a free block of `nbytes` under the largest class it holds
+ */
+static void
+mempool_file(mempool *pool, void *block, uint64_t nbytes) {
+	uint32_t c = mempool_class_holding(nbytes);
+	if (c > 0)
+		__atomic_store_n(&block_size(block), nbytes, __ATOMIC_RELAXED);
+	counter_add(&pool->classes[c].free, nbytes);
+	mempool_push(&pool->classes[c], block);
+}
+
+/**
+ * Returns the bytes a block for a padded request of `nbytes` holds, and sets `*c` to
+ * the class the request fits, which is MEMPOOL_CLASSES if it fits none
+ */
+static inline uint64_t
+mempool_block_bytes(mempool *pool, uint32_t nbytes, uint32_t *c) {
+	*c = mempool_class_fitting(nbytes);
+	if (*c < MEMPOOL_CLASSES && pool->flags & MEMPOOL_RELEASE)
+		return 1u << (*c + MEMPOOL_CLASS_MIN);
+	return nbytes;
+}
+
+/**
+ * Pops a released block off a class's free list and files what it has beyond `nbytes`
+ * as a block of its own. Returns NULL if the list is empty
+ */
+static void *
+mempool_reuse(mempool *pool, uint32_t c, uint64_t nbytes) {
+	mempool_class *class = &pool->classes[c];
+	// the empty check is a plain load so that pools which never release anything don't
+	// pay for a CAS
+	if (!__atomic_load_n(&class->free_list.top.block, __ATOMIC_RELAXED))
+		return NULL;
+	void *block = mempool_pop(class);
+	if (!block)
+		return NULL;
+	uint64_t size = c == 0 ? 1u << MEMPOOL_CLASS_MIN : block_size(block);
+	counter_add(&class->free, -(int64_t)size);
+	if (size - nbytes >= 1u << MEMPOOL_CLASS_MIN)
+		mempool_file(pool, (uint8_t *)block + nbytes, size - nbytes);
+	return block;
+}
+
+void *
+mempool_alloc(mempool *pool, uint32_t nbytes) {
+	// sanity check that a valid pool and non-zero bytes are being allocated
+	if (!pool || nbytes <= 0)
+		return NULL;
+
+	// pad nbytes to ensure data alignment cause data to go past bounds
+	nbytes = ((nbytes + sizeof (union align) - 1) / (sizeof (union align))) * (sizeof (union align));
+
+	uint32_t c;
+	uint64_t size = mempool_block_bytes(pool, nbytes, &c);
+	if (c >= MEMPOOL_CLASSES) {
+		void *ptr = mempool_carve(pool, nbytes);
+		if (ptr)
+			counter_add(&pool->in_use_large, nbytes);
+		return ptr;
+	}
+
+	// re-use a released block if the class has one. every block filed under the class
+	// holds the request
+	void *ptr = mempool_reuse(pool, c, size);
+	if (!ptr)
+		ptr = mempool_carve(pool, size);
+	if (ptr)
+		counter_add(&pool->classes[c].in_use, size);
+	return ptr;
+}
+
+void
+mempool_release(mempool *pool, void *ptr, uint32_t nbytes) {
+	if (!pool || !ptr || nbytes <= 0)
+		return;
+
+	// the same padding as when the block was allocated. what a re-used block had beyond
+	// that was filed separately when it was handed out
+	nbytes = ((nbytes + sizeof (union align) - 1) / (sizeof (union align))) * (sizeof (union align));
+	uint32_t c;
+	uint64_t size = mempool_block_bytes(pool, nbytes, &c);
+	if (c < MEMPOOL_CLASSES)
+		counter_add(&pool->classes[c].in_use, -(int64_t)size);
+	else
+		counter_add(&pool->in_use_large, -(int64_t)size);
+	mempool_file(pool, ptr, size);
+}
+
+void
+mempool_stats(mempool *pool, mempool_usage *usage) {
+	memset(usage, 0, sizeof (mempool_usage));
+	usage->reserved = __atomic_load_n(&pool->reserved, __ATOMIC_RELAXED);
+	usage->in_use = counter_read(&pool->in_use_large);
+	for (uint32_t c=0;c<MEMPOOL_CLASSES;c++) {
+		usage->classes[c].size = 1u << (c + MEMPOOL_CLASS_MIN);
+		usage->classes[c].in_use = counter_read(&pool->classes[c].in_use);
+		usage->classes[c].free = counter_read(&pool->classes[c].free);
+		usage->in_use += usage->classes[c].in_use;
+		usage->free += usage->classes[c].free;
+	}
+}
+
 void *
 mempool_calloc(mempool *pool, uint32_t count, uint32_t size) {
 	void *ptr;
@@ -134,3 +564,146 @@ mempool_calloc(mempool *pool, uint32_t count, uint32_t size) {
 
 	return ptr;
 }
+
+/**
+ * Returns one of the pool's lists of chunks. 0 is `chunks`, the rest are the NUMA nodes
+ */
+static inline mempool_chunk **
+mempool_list(mempool *pool, int i) {
+	return i == 0 ? &pool->chunks : &pool->node_chunks[i - 1];
+}
+
+/**
+ * Forgets every released block and every thread's region. Memory handed out after a
+ * point that is rewound to may sit on a free list or in a region, and would be handed
+ * out twice
+ */
+static void
+mempool_forget(mempool *pool) {
+	for (uint32_t c=0;c<MEMPOOL_CLASSES;c++) {
+		pool->classes[c].free_list.top.block = NULL;
+		counter_reset(&pool->classes[c].free);
+	}
+	// threads only use a region while the pool's id matches theirs
+	pool->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+}
+
+void
+mempool_mark(mempool *pool, mempool_savepoint *mark) {
+	for (int i=0;i<=MEMPOOL_NODES;i++) {
+		mempool_chunk *head = *mempool_list(pool, i);
+		mark->heads[i] = head;
+		mark->avail[i] = head ? head->avail : NULL;
+		mark->after[i] = head ? head->next : NULL;
+	}
+	for (uint32_t c=0;c<MEMPOOL_CLASSES;c++) {
+		mark->in_use[c] = counter_read(&pool->classes[c].in_use);
+	}
+	mark->in_use_large = counter_read(&pool->in_use_large);
+}
+
+/**
+ * Empties chunks that were taken out of a list and keeps them as spares, up to `keep`
+ * of them. Those too small to serve as a regular chunk are freed, and those larger
+ * than one are kept apart, largest first
+ */
+static void
+mempool_spare(mempool *pool, mempool_chunk *c, uint32_t keep) {
+	uint32_t kept = 0;
+	for (mempool_chunk *s = pool->spare; s; s = s->next) kept++;
+	for (mempool_chunk *s = pool->spare_large; s; s = s->next) kept++;
+	size_t regular = mempool_chunk_bytes(pool, pool->chunk_size);
+	while (c) {
+		mempool_chunk *next = c->next;
+		size_t bytes = c->limit - (uint8_t *)c;
+		if (kept < keep && (uint64_t)(c->limit - c->ptr) >= pool->chunk_size) {
+			c->avail = c->ptr;
+			mempool_chunk **link = &pool->spare;
+			if (bytes > regular) {
+				link = &pool->spare_large;
+				while (*link && (size_t)((*link)->limit - (uint8_t *)*link) > bytes) link = &(*link)->next;
+			}
+			c->next = *link;
+			*link = c;
+			kept += 1;
+		}
+		else {
+			pool->reserved -= bytes;
+			c->next = NULL;
+			mempool_free_chunks(pool, c);
+		}
+		c = next;
+	}
+}
+
+void
+mempool_rewind(mempool *pool, mempool_savepoint *mark) {
+	// chunks made after the mark become spares, and the newest chunk at the time of the
+	// mark goes back to what it had then
+	for (int i=0;i<=MEMPOOL_NODES;i++) {
+		mempool_chunk **list = mempool_list(pool, i);
+		mempool_chunk *newer = *list;
+		if (newer == mark->heads[i])
+			newer = NULL;
+		else {
+			mempool_chunk *c = newer;
+			while (c->next != mark->heads[i]) c = c->next;
+			c->next = NULL;
+		}
+		*list = mark->heads[i];
+		mempool_spare(pool, newer, MEMPOOL_KEEP_ALL);
+		if (*list == NULL)
+			continue;
+		(*list)->avail = mark->avail[i];
+
+		// so do the chunks of oversized requests that went in behind that chunk
+		mempool_chunk *behind = (*list)->next;
+		if (behind != mark->after[i]) {
+			mempool_chunk *c = behind;
+			while (c->next != mark->after[i]) c = c->next;
+			c->next = NULL;
+			(*list)->next = mark->after[i];
+			mempool_spare(pool, behind, MEMPOOL_KEEP_ALL);
+		}
+	}
+	mempool_forget(pool);
+
+	for (uint32_t c=0;c<MEMPOOL_CLASSES;c++) {
+		counter_reset(&pool->classes[c].in_use);
+		counter_add(&pool->classes[c].in_use, mark->in_use[c]);
+	}
+	counter_reset(&pool->in_use_large);
+	counter_add(&pool->in_use_large, mark->in_use_large);
+}
+
+void
+mempool_reset(mempool *pool, uint32_t keep) {
+	// every chunk becomes a spare
+	for (int i=0;i<=MEMPOOL_NODES;i++) {
+		mempool_chunk **list = mempool_list(pool, i);
+		mempool_spare(pool, *list, MEMPOOL_KEEP_ALL);
+		*list = NULL;
+	}
+	// and all but `keep` of them are freed, the larger ones first
+	uint32_t kept = 0;
+	mempool_chunk **link = &pool->spare;
+	for (; *link && kept < keep; kept++) {
+		link = &(*link)->next;
+	}
+	mempool_chunk *extra = *link;
+	*link = NULL;
+	link = &pool->spare_large;
+	for (; *link && kept < keep; kept++) {
+		link = &(*link)->next;
+	}
+	mempool_chunk *extra_large = *link;
+	*link = NULL;
+	mempool_spare(pool, extra, 0);
+	mempool_spare(pool, extra_large, 0);
+	mempool_forget(pool);
+
+	for (uint32_t c=0;c<MEMPOOL_CLASSES;c++) {
+		counter_reset(&pool->classes[c].in_use);
+	}
+	counter_reset(&pool->in_use_large);
+}
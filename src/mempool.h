@@ -1,23 +1,163 @@
+/**
+ * Lock-Free Memory Pool
+ *
+ * Hands out memory from large chunks by bumping a pointer, and gives it all back at
+ * once with `mempool_free`. Chunks are shared by every thread, and taking memory from
+ * one is a CAS on its `avail` pointer.
+ *
+ * So that threads don't all CAS the same pointer, each thread carves a region of
+ * `region_size` bytes out of the shared chunks and bump allocates from it with plain
+ * stores. Only refilling a region, or a request larger than half a region, goes
+ * through the shared chunks. A thread remembers its region for the last
+ * `MEMPOOL_REGIONS` pools it used.
+ *
+ * A request that doesn't fit the newest chunk tries up to `lookback` older chunks
+ * before a new one is made, so the ends of chunks get used instead of wasted. A request
+ * larger than half a chunk gets a chunk of its own that is linked in behind the newest
+ * one, leaving the newest one to serve smaller requests. A request larger than a chunk
+ * gets a chunk of its size.
+ *
+ * Chunks come from `malloc` unless the pool is made with `mempool_new_mapped`, which
+ * maps them with `mmap` instead. That suits pools with chunks of megabytes, which
+ * should then also be given `MEMPOOL_HUGEPAGES` to cut TLB misses. With
+ * `MEMPOOL_NUMA_LOCAL` every NUMA node has its own list of chunks whose pages are
+ * placed on that node, and threads refill their regions from the list of the node they
+ * are running on.
+ *
+ * Memory can also be given back one block at a time with `mempool_release`, for pools
+ * that live as long as a service and would otherwise only grow. Released blocks go to
+ * a lock-free free list for the largest power of 2 size class they hold, and keep
+ * their size in their second word. `mempool_alloc` hands a block of the class a
+ * request fits out again before it carves new memory, and files what the request
+ * doesn't need as a block of its own. Requests are carved with their own size, so that
+ * pools which never release anything don't pay for size classes. Pools made with
+ * `MEMPOOL_RELEASE` round requests up to their class instead, so that a released block
+ * fits the next request of its class exactly and usage levels off under steady churn.
+ * `mempool_stats` reports how the memory of a pool is used.
+ *
+ * Pools used as arenas, for example for the objects of one request, can hand all of
+ * their memory out again without giving it back to the system. `mempool_mark` saves a
+ * point and `mempool_rewind` makes everything allocated since then available again,
+ * and `mempool_reset` does so for everything, keeping up to `keep` chunks. Chunks that
+ * are emptied this way are kept as spares and used before any new chunk is allocated.
+ * Spares larger than a chunk are kept apart, largest first, for requests that need them.
+ * Neither may run while other threads use the pool.
+ */
 #ifndef JFALKNER_MEMPOOL_H
 #define JFALKNER_MEMPOOL_H
 
+#include <stdint.h>
+
+#include "counter.h"
+
+// pools a thread keeps a region for
+#define MEMPOOL_REGIONS 4
+// regions carved from each chunk
+#define MEMPOOL_REGION_SPLIT 8
+// flags for `mempool_new_flags`. chunks are mapped with `mmap`
+#define MEMPOOL_MMAP 1
+// chunks are mapped with hugepages, or if none are reserved, with transparent ones
+#define MEMPOOL_HUGEPAGES 2
+// chunks are placed on the NUMA node of the thread that makes them
+#define MEMPOOL_NUMA_LOCAL 4
+// blocks are given back with `mempool_release`. requests are rounded up to their class
+#define MEMPOOL_RELEASE 8
+// bytes per hugepage that mapped chunks are rounded up to
+#define MEMPOOL_HUGEPAGE (2 * 1024 * 1024)
+// NUMA nodes that get their own list of chunks. nodes beyond that share lists
+#define MEMPOOL_NODES 8
+
+// `mempool_reset` keeps every chunk
+#define MEMPOOL_KEEP_ALL UINT32_MAX
+
+// size classes, 8 bytes to 64 KiB. larger released blocks are filed under the largest
+#define MEMPOOL_CLASS_MIN 3
+#define MEMPOOL_CLASSES 14
+
 
 // chunks of preallocated memory
 typedef struct mempool_chunk_s {
 	struct mempool_chunk_s *next;
+	// first byte of the chunk's memory
 	uint8_t * ptr;
+	// first byte not handed out yet
 	uint8_t * avail;
+	// end of the chunk's memory
 	uint8_t * limit;
 } mempool_chunk;
 
+// top of a class's free list, with a tag that changes on every pop to avoid ABA
+typedef union mempool_top_u {
+	struct {
+		void *block;
+		uintptr_t tag;
+	} top;
+	unsigned __int128 word;
+} mempool_top;
+
+// released blocks of one size class, and how many bytes of that class are in use
+typedef struct mempool_class_s {
+	mempool_top free_list __attribute__((aligned(64)));
+	counter in_use;
+	counter free;
+} mempool_class;
+
+// how the memory of a pool is used, see `mempool_stats`
+typedef struct mempool_usage_s {
+	// bytes of every chunk the pool has
+	uint64_t reserved;
+	// bytes handed out by `mempool_alloc` and not released, including larger requests
+	int64_t in_use;
+	// bytes on the free lists
+	int64_t free;
+	struct {
+		// bytes of the smallest block of the class
+		uint32_t size;
+		// bytes handed out and not released for requests that fit the class but not
+		// the one below it
+		int64_t in_use;
+		// bytes of released blocks that hold the class but not the one above it
+		int64_t free;
+	} classes[MEMPOOL_CLASSES];
+} mempool_usage;
+
+// a point that `mempool_rewind` goes back to, see `mempool_mark`
+typedef struct mempool_savepoint_s {
+	// newest chunk of each list of chunks and where its free memory started
+	mempool_chunk *heads[MEMPOOL_NODES + 1];
+	uint8_t *avail[MEMPOOL_NODES + 1];
+	// chunk behind each head. chunks of oversized requests made since go in between
+	mempool_chunk *after[MEMPOOL_NODES + 1];
+	int64_t in_use[MEMPOOL_CLASSES];
+	int64_t in_use_large;
+} mempool_savepoint;
+
 // tracks allocated memory from a contiguous block
 typedef struct mempool_s {
 	mempool_chunk *chunks;
+	// chunks of each NUMA node, used instead of `chunks` with `MEMPOOL_NUMA_LOCAL`
+	mempool_chunk *node_chunks[MEMPOOL_NODES];
+	// empty chunks left by `mempool_rewind` and `mempool_reset`, used before new ones
+	mempool_chunk *spare;
+	// spares larger than a regular chunk, largest first
+	mempool_chunk *spare_large;
+	// `MEMPOOL_` flags of where chunks come from and how requests are sized
+	uint32_t flags;
 	uint32_t chunk_size;
+	// older chunks tried when the newest one doesn't have room
 	uint8_t lookback;
+	// bytes a thread takes from the chunks at a time for its own region
+	uint32_t region_size;
+	// tells a new pool apart from an old one that was at the same address
+	uint64_t id;
+	// bytes of every chunk
+	uint64_t reserved;
+	// released blocks by size class, and bytes of larger requests in use
+	mempool_class classes[MEMPOOL_CLASSES];
+	counter in_use_large;
 	// tracking of CAS failures for tests and estimating thread contention
-	uint32_t cas_alloc_retries;
-	uint32_t cas_chunk_append_retries;
+	counter cas_alloc_retries;
+	counter cas_chunk_append_retries;
 } mempool;
 
 
@@ -25,10 +165,38 @@ mempool * mempool_new_default();
 
 mempool * mempool_new(uint32_t chunk_size, uint8_t lookback);
 
+// makes a pool whose chunks are mapped with `mmap`. `flags` can add `MEMPOOL_HUGEPAGES`
+// and `MEMPOOL_NUMA_LOCAL`
+mempool * mempool_new_mapped(uint32_t chunk_size, uint8_t lookback, uint32_t flags);
+
+// makes a pool with any of the `MEMPOOL_` flags. hugepages and node placement only
+// apply with `MEMPOOL_MMAP`
+mempool * mempool_new_flags(uint32_t chunk_size, uint8_t lookback, uint32_t flags);
+
 void * mempool_alloc(mempool *pool, uint32_t size);
 
 void * mempool_calloc(mempool *pool, uint32_t count, uint32_t size);
 
+// gives back a block from `mempool_alloc` for re-use. `size` is the size it was
+// allocated with. pools that do this often should be made with `MEMPOOL_RELEASE`
+void mempool_release(mempool *pool, void *ptr, uint32_t size);
+
+// fills in how the memory of the pool is used. counts are exact when no other thread
+// is using the pool
+void mempool_stats(mempool *pool, mempool_usage *usage);
+
+// saves the point that `mempool_rewind` goes back to
+void mempool_mark(mempool *pool, mempool_savepoint *mark);
+
+// makes memory allocated since `mark` available again, and forgets released blocks.
+// memory that came from chunks older than the newest one at the mark stays in use
+// until `mempool_reset`
+void mempool_rewind(mempool *pool, mempool_savepoint *mark);
+
+// makes all memory of the pool available again. up to `keep` of the newest chunks are
+// kept and the rest are freed. `MEMPOOL_KEEP_ALL` keeps every chunk
+void mempool_reset(mempool *pool, uint32_t keep);
+
 void mempool_free(mempool **pool);
 
 #endif // JFALKNER_MEMPOOL_H
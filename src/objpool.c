@@ -0,0 +1,188 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "objpool.h"
+
+// start of every chunk. objects follow it, starting on their own cache line
+typedef struct objpool_chunk_s {
+	objpool *pool;
+	struct objpool_chunk_s *next;
+} objpool_chunk;
+#define OBJPOOL_HEADER 64
+
+// a free object's first word links it to the next object of its batch. the second
+// word of a batch's first object links to the next batch of the free list
+#define next_obj(obj) (((void **)(obj))[0])
+#define next_batch(obj) (((void **)(obj))[1])
+
+// hands out caches to threads as they first use a pool
+static uint32_t next_cache = 0;
+// cache of this thread plus one, so 0 means one hasn't been picked yet
+static __thread uint32_t thread_cache = 0;
+
+
+objpool *
+objpool_new(uint32_t size) {
+	// pad objects so that each one is 16-byte aligned and can hold the two links
+	size = size < 16 ? 16 : (size + 15) / 16 * 16;
+	if (size > OBJPOOL_CHUNK - OBJPOOL_HEADER)
+		return NULL;
+
+	objpool *pool = aligned_alloc(64, sizeof (objpool));
+	if (pool == NULL)
+		return NULL;
+	memset(pool, 0, sizeof (objpool));
+	pool->size = size;
+	return pool;
+}
+
+void
+objpool_free_all(objpool **pool) {
+	objpool_chunk *c = (*pool)->chunks;
+	while (c) {
+		// copy ->next before free'ing
+		objpool_chunk *tofree = c;
+		c = c->next;
+		free(tofree);
+	}
+
+	// release memory allocated for the pool struct and NULL the pointer
+	free(*pool);
+	*pool = NULL;
+}
+
+static inline objpool_cache *
+objpool_cache_of(objpool *pool) {
+	if (!thread_cache) {
+		thread_cache = __atomic_fetch_add(&next_cache, 1, __ATOMIC_RELAXED) % OBJPOOL_CACHES + 1;
+	}
+	return &pool->caches[thread_cache - 1];
+}
+
+/**
+ * Pushes a chain of objects onto the free list as one batch
+ */
+static void
+objpool_push(objpool *pool, void *batch) {
+	objpool_top top, desired;
+	// a torn read only means the first CAS fails and reloads both halves
+	top.top.batch = __atomic_load_n(&pool->free_list.top.batch, __ATOMIC_RELAXED);
+	top.top.tag = __atomic_load_n(&pool->free_list.top.tag, __ATOMIC_RELAXED);
+	do {
+		next_batch(batch) = top.top.batch;
+		desired.top.batch = batch;
+		// only pops change the tag, which is enough for a pop to notice a re-push
+		desired.top.tag = top.top.tag;
+	} while (!__atomic_compare_exchange_n(&pool->free_list.word, &top.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+/**
+ * Pops a batch of objects off the free list. Returns NULL if it is empty
+ */
+static void *
+objpool_pop(objpool *pool) {
+	objpool_top top, desired;
+	top.top.batch = __atomic_load_n(&pool->free_list.top.batch, __ATOMIC_RELAXED);
+	top.top.tag = __atomic_load_n(&pool->free_list.top.tag, __ATOMIC_RELAXED);
+	while (top.top.batch) {
+		// the batch may already have been popped and re-used by another thread, in which
+		// case this reads garbage but the tag has changed and the CAS fails. chunks are
+		// never released while the pool is in use, so the read itself is safe
+		desired.top.batch = __atomic_load_n(&next_batch(top.top.batch), __ATOMIC_RELAXED);
+		desired.top.tag = top.top.tag + 1;
+		if (__atomic_compare_exchange_n(&pool->free_list.word, &top.word, desired.word, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			return top.top.batch;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Carves a new chunk into batches. The first batch is returned and the rest are pushed
+ * onto the free list for other threads
+ */
+static void *
+objpool_grow(objpool *pool) {
+	objpool_chunk *chunk = aligned_alloc(OBJPOOL_CHUNK, OBJPOOL_CHUNK);
+	if (chunk == NULL)
+		return NULL;
+	chunk->pool = pool;
+
+	// remember the chunk so that `objpool_free_all` can release it
+	chunk->next = __atomic_load_n((objpool_chunk **)&pool->chunks, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n((objpool_chunk **)&pool->chunks, &chunk->next, chunk, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	uint8_t *objs = (uint8_t *)chunk + OBJPOOL_HEADER;
+	uint32_t count = (OBJPOOL_CHUNK - OBJPOOL_HEADER) / pool->size;
+	for (uint32_t i = 0; i < count; i += OBJPOOL_CACHE) {
+		uint32_t end = i + OBJPOOL_CACHE < count ? i + OBJPOOL_CACHE : count;
+		for (uint32_t j = i; j < end; j++) {
+			next_obj(objs + (size_t)j * pool->size) = j + 1 < end ? objs + (size_t)(j + 1) * pool->size : NULL;
+		}
+		if (i) objpool_push(pool, objs + (size_t)i * pool->size);
+	}
+	return objs;
+}
+
+void *
+objpool_alloc(objpool *pool) {
+	objpool_cache *cache = objpool_cache_of(pool);
+
+	uint32_t busy = 0;
+	if (!__atomic_compare_exchange_n(&cache->busy, &busy, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		// a thread sharing this cache has it. take one object from a batch of the free
+		// list and give the rest of the batch back
+		void *obj = objpool_pop(pool);
+		if (!obj) obj = objpool_grow(pool);
+		if (obj && next_obj(obj)) objpool_push(pool, next_obj(obj));
+		return obj;
+	}
+
+	// a batch is at most OBJPOOL_CACHE objects, so `count` never undercounts the cache
+	if (!cache->head) {
+		cache->head = objpool_pop(pool);
+		if (!cache->head) cache->head = objpool_grow(pool);
+		cache->count = OBJPOOL_CACHE;
+	}
+	void *obj = cache->head;
+	if (obj) {
+		cache->head = next_obj(obj);
+		cache->count -= 1;
+	}
+
+	__atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+	return obj;
+}
+
+void
+objpool_free(objpool *pool, void *obj) {
+	objpool_cache *cache = objpool_cache_of(pool);
+
+	uint32_t busy = 0;
+	if (!__atomic_compare_exchange_n(&cache->busy, &busy, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		// a thread sharing this cache has it. give the object back as a batch of one
+		next_obj(obj) = NULL;
+		objpool_push(pool, obj);
+		return;
+	}
+
+	// a full cache goes to the free list as one batch
+	if (cache->count >= OBJPOOL_CACHE) {
+		if (cache->head) objpool_push(pool, cache->head);
+		cache->head = NULL;
+		cache->count = 0;
+	}
+	next_obj(obj) = cache->head;
+	cache->head = obj;
+	cache->count += 1;
+
+	__atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+}
+
+void
+objpool_release(void *obj) {
+	objpool_chunk *chunk = (objpool_chunk *)((uintptr_t)obj & ~(uintptr_t)(OBJPOOL_CHUNK - 1));
+	objpool_free(chunk->pool, obj);
+}
@@ -0,0 +1,82 @@
+/**
+ * Lock-Free Fixed-Size Object Pool
+ *
+ * Hands out objects of one size, such as `hashmap_keyval` or `list_node`, without
+ * calling `malloc` for each one. Objects are carved out of large aligned chunks and
+ * freed objects are kept for re-use instead of being returned to the system.
+ *
+ * Each thread allocates from and frees to its own small cache in the pool. Caches that
+ * run dry or fill up trade whole batches of objects with a lock-free global free list,
+ * so the shared list is touched once per `OBJPOOL_CACHE` objects at most.
+ *
+ * A freed object can be handed out again right away. Lock-free readers may still be
+ * looking at it, so data structures should pass `objpool_release` to `free_later`
+ * rather than call `objpool_free` directly. That way an object is only re-used after
+ * the same grace period that `free` would have waited for.
+ */
+#ifndef JFALKNER_OBJPOOL_H
+#define JFALKNER_OBJPOOL_H
+
+#include <stdint.h>
+
+// bytes per chunk. chunks are aligned to their size so an object can find its pool
+#define OBJPOOL_CHUNK (64 * 1024)
+// most objects a thread's cache holds before it hands a batch to the free list
+#define OBJPOOL_CACHE 32
+// caches per pool. threads share caches round robin once there are more threads
+#define OBJPOOL_CACHES 32
+
+// a thread's cache of free objects. `busy` is held while a thread is using it
+typedef struct objpool_cache_s {
+	uint32_t busy;
+	uint32_t count;
+	void *head;
+} __attribute__((aligned(64))) objpool_cache;
+
+// top of the free list of batches, with a tag that changes on every pop to avoid ABA
+typedef union objpool_top_u {
+	struct {
+		void *batch;
+		uintptr_t tag;
+	} top;
+	unsigned __int128 word;
+} objpool_top;
+
+typedef struct objpool_s {
+	// bytes per object, a multiple of 16 so every object is 16-byte aligned
+	uint32_t size;
+	// chunks that objects were carved out of, released by `objpool_free_all`
+	void *chunks;
+
+	objpool_top free_list __attribute__((aligned(16)));
+	objpool_cache caches[OBJPOOL_CACHES];
+} objpool;
+
+
+/**
+ * Creates a pool of objects of `size` bytes
+ */
+objpool * objpool_new(uint32_t size);
+
+/**
+ * Returns an unused object, or NULL if memory for a new chunk couldn't be allocated
+ */
+void * objpool_alloc(objpool *pool);
+
+/**
+ * Returns an object to the pool it came from, making it available to `objpool_alloc`
+ */
+void objpool_free(objpool *pool, void *obj);
+
+/**
+ * Same as `objpool_free` but finds the pool from the object, so that it can be used as
+ * the `release` callback of `free_later`
+ */
+void objpool_release(void *obj);
+
+/**
+ * Releases every chunk of the pool and the pool itself, and NULLs the pointer
+ */
+void objpool_free_all(objpool **pool);
+
+#endif // JFALKNER_OBJPOOL_H
@@ -0,0 +1,126 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backoff.h"
+#include "free_later.h"
+#include "queue.h"
+
+
+static queue_node *
+queue_new_node(queue *q) {
+	queue_node *n = q->pool ? objpool_alloc(q->pool) : malloc(sizeof(queue_node));
+	n->next = NULL;
+	n->val = NULL;
+	return n;
+}
+
+queue *
+queue_new_pool(objpool *pool) {
+	queue *q = aligned_alloc(64, sizeof(queue));
+	memset(q, 0, sizeof(queue));
+	q->pool = pool;
+	q->head = queue_new_node(q);
+	q->tail = q->head;
+	return q;
+}
+
+queue *
+queue_new(void) {
+	return queue_new_pool(NULL);
+}
+
+void
+queue_free(queue **q) {
+	queue_node *n = (*q)->head;
+	while (n) {
+		// copy ->next before free'ing
+		queue_node *tofree = n;
+		n = n->next;
+		if ((*q)->pool) {
+			objpool_free((*q)->pool, tofree);
+		}
+		else {
+			free(tofree);
+		}
+	}
+
+	// release memory allocated for the queue struct and NULL the pointer
+	free(*q);
+	*q = NULL;
+}
+
+void
+queue_enqueue(queue *q, void *val) {
+	queue_node *n = queue_new_node(q);
+	n->val = val;
+
+	// the last node may be dequeued and released by another thread while it is read
+	free_later_enter();
+	uint32_t spins = BACKOFF_MIN;
+	while (true) {
+		queue_node *tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		queue_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+		if (tail != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+
+		// `tail` lags behind. help the enqueue that linked `next` and try again
+		if (next) {
+			__atomic_compare_exchange_n(&q->tail, &tail, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		// link the node after the last one. moving `tail` may fail if another thread
+		// already helped, which is fine
+		if (__atomic_compare_exchange_n(&tail->next, &next, n, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			__atomic_compare_exchange_n(&q->tail, &tail, n, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			break;
+		}
+		backoff_wait(&spins);
+	}
+	free_later_exit();
+	counter_add(&q->length, 1);
+}
+
+void *
+queue_dequeue(queue *q) {
+	free_later_enter();
+	uint32_t spins = BACKOFF_MIN;
+	queue_node *head;
+	void *val;
+	while (true) {
+		head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		queue_node *tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		queue_node *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+		if (head != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+
+		// nothing after the dummy node means the queue is empty
+		if (!next) {
+			free_later_exit();
+			return NULL;
+		}
+
+		// never let `head` pass `tail`, or `tail` would point at a released node
+		if (head == tail) {
+			__atomic_compare_exchange_n(&q->tail, &tail, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		// read the value before the CAS, since once `next` is the dummy node another
+		// consumer may dequeue past it
+		val = next->val;
+		if (__atomic_compare_exchange_n(&q->head, &head, next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			break;
+		}
+		backoff_wait(&spins);
+	}
+	free_later_exit();
+	counter_add(&q->length, -1);
+
+	// the old dummy node is unlinked, but other threads may still be reading it
+	free_later(head, q->pool ? objpool_release : free);
+	return val;
+}
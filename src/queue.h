@@ -0,0 +1,69 @@
+/**
+ * Lock-Free FIFO Queue
+ *
+ * An unbounded multi-producer/multi-consumer queue, after Michael and Scott's "Simple,
+ * Fast, and Practical Non-Blocking and Blocking Concurrent Queue Algorithms". Values
+ * come out in the order they went in, unlike `list`, which hands them back newest first.
+ *
+ * The queue always holds a dummy node at `head`, so producers only touch `tail` and
+ * consumers only touch `head`, and each side CASes its own cache line. A producer
+ * that finds `tail` lagging behind the last node moves it forward before retrying, so
+ * a stalled producer never blocks the others.
+ *
+ * Dequeued nodes are released through `free_later`, since other consumers may still be
+ * reading them. That also rules out ABA, because a node's memory can't be re-used while
+ * a thread that saw it is still in its section.
+ */
+#ifndef JFALKNER_QUEUE_H
+#define JFALKNER_QUEUE_H
+
+#include <stdint.h>
+
+#include "counter.h"
+#include "objpool.h"
+
+
+typedef struct queue_node_s {
+	struct queue_node_s *next;
+	void *val;
+} queue_node;
+
+typedef struct queue_s {
+	// dummy node in front of the first value. only consumers change it
+	queue_node *head __attribute__((aligned(64)));
+	// last node, or one before it while an enqueue is in progress
+	queue_node *tail __attribute__((aligned(64)));
+	counter length;
+	// where nodes come from. NULL uses calloc
+	objpool *pool;
+} queue;
+
+
+/**
+ * Creates an empty queue
+ */
+queue * queue_new(void);
+
+/**
+ * Creates an empty queue whose nodes come from `pool`, which must hold objects of at
+ * least `sizeof(queue_node)` bytes
+ */
+queue * queue_new_pool(objpool *pool);
+
+/**
+ * Adds a value to the end of the queue. `val` must not be NULL
+ */
+void queue_enqueue(queue *q, void *val);
+
+/**
+ * Removes the value at the front of the queue and returns it, or NULL if it is empty
+ */
+void * queue_dequeue(queue *q);
+
+/**
+ * Releases the queue and its nodes, but not the values still in it, and NULLs the
+ * pointer. No other thread may be using it
+ */
+void queue_free(queue **q);
+
+#endif // JFALKNER_QUEUE_H
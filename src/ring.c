@@ -0,0 +1,207 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backoff.h"
+#include "ring.h"
+
+// smallest capacity, so that the cells fill at least one cache line
+#define RING_MIN 4
+
+
+/**
+ * Rounds a capacity up to a power of 2
+ */
+static uint64_t
+ring_capacity(uint32_t capacity) {
+	uint64_t c = RING_MIN;
+	while (c < capacity) c <<= 1;
+	return c;
+}
+
+ring *
+ring_new(uint32_t capacity) {
+	uint64_t c = ring_capacity(capacity);
+	ring *r = aligned_alloc(64, sizeof(ring));
+	if (r == NULL)
+		return NULL;
+	memset(r, 0, sizeof(ring));
+	r->mask = c - 1;
+	r->cells = aligned_alloc(64, c * sizeof(ring_cell));
+	if (r->cells == NULL) {
+		free(r);
+		return NULL;
+	}
+	// cell `i` is free for the producer of position `i`
+	for (uint64_t i = 0; i < c; i++) {
+		r->cells[i].seq = i;
+		r->cells[i].val = NULL;
+	}
+	return r;
+}
+
+void
+ring_free(ring **r) {
+	free((*r)->cells);
+	free(*r);
+	*r = NULL;
+}
+
+uint32_t
+ring_push_many(ring *r, void **vals, uint32_t count) {
+	if (count == 0) return 0;
+	uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	uint32_t spins = BACKOFF_MIN;
+	while (true) {
+		// count the cells from `pos` on that consumers are done with
+		uint32_t n = 0;
+		while (n < count) {
+			uint64_t seq = __atomic_load_n(&r->cells[(pos + n) & r->mask].seq, __ATOMIC_ACQUIRE);
+			if (seq != pos + n) break;
+			n++;
+		}
+
+		if (n == 0) {
+			// the cell still holds a value from the last lap, so the ring is full
+			uint64_t seq = __atomic_load_n(&r->cells[pos & r->mask].seq, __ATOMIC_ACQUIRE);
+			if ((int64_t)(seq - pos) < 0) return 0;
+			// or another producer already claimed `pos`
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		// claim all of them at once. cells that were free stay free until `tail` passes
+		// them, so they needn't be checked again
+		if (__atomic_compare_exchange_n(&r->tail, &pos, pos + n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			for (uint32_t i = 0; i < n; i++) {
+				ring_cell *cell = &r->cells[(pos + i) & r->mask];
+				cell->val = vals[i];
+				// hands the cell to the consumer of this position
+				__atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+			}
+			return n;
+		}
+		backoff_wait(&spins);
+	}
+}
+
+uint32_t
+ring_pop_many(ring *r, void **vals, uint32_t max) {
+	if (max == 0) return 0;
+	uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	uint32_t spins = BACKOFF_MIN;
+	while (true) {
+		// count the cells from `pos` on that producers have filled
+		uint32_t n = 0;
+		while (n < max) {
+			uint64_t seq = __atomic_load_n(&r->cells[(pos + n) & r->mask].seq, __ATOMIC_ACQUIRE);
+			if (seq != pos + n + 1) break;
+			n++;
+		}
+
+		if (n == 0) {
+			// the cell hasn't been filled yet, so the ring is empty
+			uint64_t seq = __atomic_load_n(&r->cells[pos & r->mask].seq, __ATOMIC_ACQUIRE);
+			if ((int64_t)(seq - (pos + 1)) < 0) return 0;
+			// or another consumer already claimed `pos`
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(&r->head, &pos, pos + n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			for (uint32_t i = 0; i < n; i++) {
+				ring_cell *cell = &r->cells[(pos + i) & r->mask];
+				vals[i] = cell->val;
+				// hands the cell to the producer of the same position one lap later
+				__atomic_store_n(&cell->seq, pos + i + r->mask + 1, __ATOMIC_RELEASE);
+			}
+			return n;
+		}
+		backoff_wait(&spins);
+	}
+}
+
+bool
+ring_push(ring *r, void *val) {
+	return ring_push_many(r, &val, 1) == 1;
+}
+
+void *
+ring_pop(ring *r) {
+	void *val;
+	return ring_pop_many(r, &val, 1) == 1 ? val : NULL;
+}
+
+spsc_ring *
+spsc_ring_new(uint32_t capacity) {
+	uint64_t c = ring_capacity(capacity);
+	spsc_ring *r = aligned_alloc(64, sizeof(spsc_ring));
+	if (r == NULL)
+		return NULL;
+	memset(r, 0, sizeof(spsc_ring));
+	r->mask = c - 1;
+	r->vals = aligned_alloc(64, c * sizeof(void *));
+	if (r->vals == NULL) {
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+void
+spsc_ring_free(spsc_ring **r) {
+	free((*r)->vals);
+	free(*r);
+	*r = NULL;
+}
+
+uint32_t
+spsc_ring_push_many(spsc_ring *r, void **vals, uint32_t count) {
+	uint64_t tail = r->tail;
+	uint64_t capacity = r->mask + 1;
+
+	// only look at the consumer's line when the copy says there isn't enough room
+	if (capacity - (tail - r->head_cache) < count) {
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	}
+	uint64_t room = capacity - (tail - r->head_cache);
+	uint32_t n = room < count ? room : count;
+
+	for (uint32_t i = 0; i < n; i++) {
+		r->vals[(tail + i) & r->mask] = vals[i];
+	}
+	// publishes the values to the consumer
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+uint32_t
+spsc_ring_pop_many(spsc_ring *r, void **vals, uint32_t max) {
+	uint64_t head = r->head;
+
+	// only look at the producer's line when the copy says there aren't enough values
+	if (r->tail_cache - head < max) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	}
+	uint64_t avail = r->tail_cache - head;
+	uint32_t n = avail < max ? avail : max;
+
+	for (uint32_t i = 0; i < n; i++) {
+		vals[i] = r->vals[(head + i) & r->mask];
+	}
+	// hands the cells back to the producer
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+bool
+spsc_ring_push(spsc_ring *r, void *val) {
+	return spsc_ring_push_many(r, &val, 1) == 1;
+}
+
+void *
+spsc_ring_pop(spsc_ring *r) {
+	void *val;
+	return spsc_ring_pop_many(r, &val, 1) == 1 ? val : NULL;
+}
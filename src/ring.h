@@ -0,0 +1,118 @@
+/**
+ * Bounded Ring Buffers
+ *
+ * Fixed-size queues that hand values between threads without allocating anything per
+ * value, unlike `list` and `queue`, which need a node for each one. A full ring refuses
+ * new values instead of growing, so callers decide whether to retry, drop or block.
+ *
+ * `ring` is a multi-producer/multi-consumer ring after Dmitry Vyukov's bounded MPMC
+ * queue. Every cell carries a sequence number that says whose turn it is: a producer
+ * may fill cell `pos` once its sequence is `pos`, and a consumer may empty it once its
+ * sequence is `pos + 1`. Producers and consumers each claim positions with one CAS on
+ * their own index, and never touch the other side's index.
+ *
+ * `spsc_ring` is for exactly one producer and one consumer thread. It needs no CAS at
+ * all and never retries, so both sides are wait-free. Each side keeps a copy of the
+ * other side's index on its own cache line and only re-reads the real one when the copy
+ * says the ring is full or empty.
+ *
+ * The `_many` calls move a whole batch with a single update of the shared index. Both
+ * rings hold `void *` values that must not be NULL, since NULL means empty.
+ */
+#ifndef JFALKNER_RING_H
+#define JFALKNER_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct ring_cell_s {
+	uint64_t seq;
+	void *val;
+} ring_cell;
+
+typedef struct ring_s {
+	// next position to fill. only producers change it
+	uint64_t tail __attribute__((aligned(64)));
+	// next position to empty. only consumers change it
+	uint64_t head __attribute__((aligned(64)));
+	// capacity - 1. the capacity is a power of 2
+	uint64_t mask __attribute__((aligned(64)));
+	ring_cell *cells;
+} ring;
+
+typedef struct spsc_ring_s {
+	// the producer's line: its index and its copy of the consumer's
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t head_cache;
+	// the consumer's line: its index and its copy of the producer's
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail_cache;
+	// capacity - 1. the capacity is a power of 2
+	uint64_t mask __attribute__((aligned(64)));
+	void **vals;
+} spsc_ring;
+
+
+/**
+ * Creates a ring that holds at least `capacity` values, rounded up to a power of 2
+ */
+ring * ring_new(uint32_t capacity);
+
+/**
+ * Releases the ring, but not the values still in it, and NULLs the pointer
+ */
+void ring_free(ring **r);
+
+/**
+ * Adds a value. Returns false if the ring is full
+ */
+bool ring_push(ring *r, void *val);
+
+/**
+ * Removes the oldest value and returns it, or NULL if the ring is empty
+ */
+void * ring_pop(ring *r);
+
+/**
+ * Adds up to `count` values from `vals` in order and returns how many fit
+ */
+uint32_t ring_push_many(ring *r, void **vals, uint32_t count);
+
+/**
+ * Removes up to `max` values into `vals`, oldest first, and returns how many
+ */
+uint32_t ring_pop_many(ring *r, void **vals, uint32_t max);
+
+/**
+ * Creates a single-producer/single-consumer ring that holds at least `capacity` values,
+ * rounded up to a power of 2
+ */
+spsc_ring * spsc_ring_new(uint32_t capacity);
+
+/**
+ * Releases the ring, but not the values still in it, and NULLs the pointer
+ */
+void spsc_ring_free(spsc_ring **r);
+
+/**
+ * Adds a value. Returns false if the ring is full. Only the producer may call this
+ */
+bool spsc_ring_push(spsc_ring *r, void *val);
+
+/**
+ * Removes the oldest value and returns it, or NULL if the ring is empty. Only the
+ * consumer may call this
+ */
+void * spsc_ring_pop(spsc_ring *r);
+
+/**
+ * Adds up to `count` values from `vals` in order and returns how many fit
+ */
+uint32_t spsc_ring_push_many(spsc_ring *r, void **vals, uint32_t count);
+
+/**
+ * Removes up to `max` values into `vals`, oldest first, and returns how many
+ */
+uint32_t spsc_ring_pop_many(spsc_ring *r, void **vals, uint32_t max);
+
+#endif // JFALKNER_RING_H
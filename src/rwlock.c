@@ -0,0 +1,61 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backoff.h"
+#include "rwlock.h"
+
+// hands out stripes to threads as they first take a read lock
+static uint32_t next_stripe = 0;
+// stripe of this thread plus one, so 0 means one hasn't been picked yet
+static __thread uint32_t thread_stripe = 0;
+
+
+static inline rwlock_stripe *
+rwlock_stripe_of(rwlock *l) {
+	if (!thread_stripe) {
+		thread_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) % RWLOCK_STRIPES + 1;
+	}
+	return &l->stripes[thread_stripe - 1];
+}
+
+void
+rwlock_read_acquire(rwlock *l) {
+	rwlock_stripe *s = rwlock_stripe_of(l);
+	uint32_t spins = BACKOFF_MIN;
+	while (true) {
+		// count this reader before looking for a writer. the writer does the opposite,
+		// so at least one of them sees the other
+		__atomic_fetch_add(&s->readers, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&l->writer, __ATOMIC_SEQ_CST)) return;
+
+		// step back so the writer can go ahead, and wait until it's done
+		__atomic_fetch_sub(&s->readers, 1, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&l->writer, __ATOMIC_RELAXED)) {
+			backoff_wait(&spins);
+		}
+	}
+}
+
+void
+rwlock_read_release(rwlock *l) {
+	__atomic_fetch_sub(&rwlock_stripe_of(l)->readers, 1, __ATOMIC_RELEASE);
+}
+
+void
+rwlock_write_acquire(rwlock *l) {
+	// writers may wait for a long time, so they park
+	spinlock_acquire_park(&l->writers);
+	__atomic_store_n(&l->writer, 1, __ATOMIC_SEQ_CST);
+	for (uint32_t i = 0; i < RWLOCK_STRIPES; i++) {
+		uint32_t spins = BACKOFF_MIN;
+		while (__atomic_load_n(&l->stripes[i].readers, __ATOMIC_SEQ_CST) != 0) {
+			backoff_wait(&spins);
+		}
+	}
+}
+
+void
+rwlock_write_release(rwlock *l) {
+	__atomic_store_n(&l->writer, 0, __ATOMIC_RELEASE);
+	spinlock_release(&l->writers);
+}
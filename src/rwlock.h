@@ -0,0 +1,56 @@
+/**
+ * Reader-Biased Read/Write Lock
+ *
+ * A lock that any number of readers hold at once, for data that is read on every
+ * operation and written rarely, but that is too large or too full of pointers for a
+ * `seqlock`.
+ *
+ * An ordinary read/write lock counts its readers on one cache line, so every reader
+ * moves that line between cores and readers scale no better than with an exclusive
+ * lock. Here each thread counts itself on its own padded stripe, the same way
+ * `counter` does, and readers only ever write their own line. The cost moves to the
+ * writer, which announces itself and then waits until the reader count of every
+ * stripe drops to zero. Readers that arrive while a writer is announced step back and
+ * wait until it is done, so a steady stream of readers can't starve writers.
+ *
+ * Zeroed memory is an unlocked lock. Read locks don't nest with a write lock on the
+ * same thread.
+ */
+#ifndef JFALKNER_RWLOCK_H
+#define JFALKNER_RWLOCK_H
+
+#include <stdint.h>
+
+#include "spinlock.h"
+
+// threads share stripes round robin once there are more threads than stripes
+#define RWLOCK_STRIPES 32
+
+typedef struct rwlock_stripe_s {
+	uint32_t readers;
+} __attribute__((aligned(64))) rwlock_stripe;
+
+typedef struct rwlock_s {
+	// set while a writer holds the lock or waits for readers to leave
+	uint32_t writer __attribute__((aligned(64)));
+	// keeps writers out of each other's way
+	spinlock writers;
+	rwlock_stripe stripes[RWLOCK_STRIPES];
+} rwlock;
+
+
+/**
+ * Takes the lock for reading, waiting while a writer has it
+ */
+void rwlock_read_acquire(rwlock *l);
+
+void rwlock_read_release(rwlock *l);
+
+/**
+ * Takes the lock for writing, waiting for other writers and then for readers to leave
+ */
+void rwlock_write_acquire(rwlock *l);
+
+void rwlock_write_release(rwlock *l);
+
+#endif // JFALKNER_RWLOCK_H
@@ -0,0 +1,88 @@
+/**
+ * Sequence Lock
+ *
+ * For small data that is read far more often than it is written, such as a config or a
+ * pointer to a table. Readers never write to shared memory, so any number of them read
+ * at once without moving a cache line between cores. Instead of being kept out while a
+ * writer works, a reader notices afterwards that it may have seen a half-made change and
+ * reads again.
+ *
+ * A writer makes `seq` odd while it changes the data and even again once it is done.
+ * A reader waits for an even `seq`, reads the data, and retries if `seq` changed:
+ *
+ *     uint32_t seq;
+ *     do {
+ *         seq = seqlock_read_begin(&l);
+ *         copy = __atomic_load_n(&config.value, __ATOMIC_RELAXED);
+ *     } while (seqlock_read_retry(&l, seq));
+ *
+ * A reader may see torn data before it retries, so it must only copy the data and not
+ * follow pointers in it or act on it until `seqlock_read_retry` returns false. Fields
+ * are read with relaxed atomics so that the race with the writer is well defined.
+ *
+ * Writers exclude each other through `seq`, so zeroed memory is an unlocked seqlock.
+ * A writer that waits keeps readers waiting too, so writes should be short and rare.
+ */
+#ifndef JFALKNER_SEQLOCK_H
+#define JFALKNER_SEQLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backoff.h"
+
+typedef struct seqlock_s {
+	// odd while a writer holds the lock
+	uint32_t seq;
+} seqlock;
+
+
+/**
+ * Waits until no writer holds the lock and returns the sequence to pass to
+ * `seqlock_read_retry`
+ */
+static inline uint32_t
+seqlock_read_begin(seqlock *l) {
+	uint32_t seq;
+	while ((seq = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE)) & 1) {
+		cpu_relax();
+	}
+	return seq;
+}
+
+/**
+ * Returns true if a writer may have changed the data since `seqlock_read_begin`
+ * returned `seq`, in which case what was read must be thrown away
+ */
+static inline bool
+seqlock_read_retry(seqlock *l, uint32_t seq) {
+	// the reads of the data must not move past the load of `seq`
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&l->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/**
+ * Takes the lock for writing, waiting for any other writer
+ */
+static inline void
+seqlock_write_begin(seqlock *l) {
+	uint32_t spins = BACKOFF_MIN;
+	while (true) {
+		uint32_t seq = __atomic_load_n(&l->seq, __ATOMIC_RELAXED);
+		if (!(seq & 1) && __atomic_compare_exchange_n(&l->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+		backoff_wait(&spins);
+	}
+	// readers must see the odd `seq` before any change to the data
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Publishes the changes and releases the lock
+ */
+static inline void
+seqlock_write_end(seqlock *l) {
+	uint32_t seq = __atomic_load_n(&l->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+#endif // JFALKNER_SEQLOCK_H
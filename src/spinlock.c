@@ -0,0 +1,176 @@
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "spinlock.h"
+
+
+/**
+ * Sleeps while `*addr` is `val`. May return early, so callers check again
+ */
+static void
+futex_wait(uint32_t *addr, uint32_t val) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/**
+ * Wakes one thread sleeping on `addr`
+ */
+static void
+futex_wake(uint32_t *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+bool
+spinlock_try(spinlock *l) {
+	uint32_t free = 0;
+	return __atomic_load_n(&l->state, __ATOMIC_RELAXED) == 0 &&
+		__atomic_compare_exchange_n(&l->state, &free, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void
+spinlock_acquire(spinlock *l) {
+	uint32_t spins = BACKOFF_MIN;
+	while (!spinlock_try(l)) {
+		backoff_wait(&spins);
+	}
+}
+
+void
+spinlock_acquire_park(spinlock *l) {
+	uint32_t spins = BACKOFF_MIN;
+	for (uint32_t i = 0; i < SPINLOCK_SPINS; i++) {
+		if (spinlock_try(l)) return;
+		backoff_wait(&spins);
+	}
+
+	// from here on the lock is taken as 2, since this thread can't tell whether others
+	// are still parked. that costs the release a wake call at most
+	while (__atomic_exchange_n(&l->state, 2, __ATOMIC_ACQUIRE) != 0) {
+		futex_wait(&l->state, 2);
+	}
+}
+
+void
+spinlock_release(spinlock *l) {
+	if (__atomic_exchange_n(&l->state, 0, __ATOMIC_RELEASE) == 2) {
+		futex_wake(&l->state);
+	}
+}
+
+bool
+ticketlock_try(ticketlock *l) {
+	uint32_t owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+	uint32_t next = owner;
+	return __atomic_compare_exchange_n(&l->next, &next, owner + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void
+ticketlock_acquire(ticketlock *l) {
+	uint32_t ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+	uint32_t last = ticket;
+	uint32_t stuck = 0;
+	while (true) {
+		uint32_t owner = __atomic_load_n(&l->owner, __ATOMIC_ACQUIRE);
+		if (owner == ticket) return;
+		// the next thread in line loads `owner` on every pause, so that it takes the lock
+		// as soon as it is released. further back, every thread ahead but the holder
+		// holds the lock for a while, so there's no point loading `owner` again before then
+		uint32_t spins = ticket - owner == 1 ? 1 : (ticket - owner - 1) * TICKETLOCK_SPINS;
+		for (uint32_t i = spins; i > 0; i--) {
+			cpu_relax();
+		}
+
+		// the holder may not be running
+		stuck = owner == last ? stuck + spins : 0;
+		last = owner;
+		if (stuck >= SPINLOCK_YIELD) {
+			sched_yield();
+			stuck = 0;
+		}
+	}
+}
+
+void
+ticketlock_release(ticketlock *l) {
+	// only the holder changes `owner`
+	uint32_t owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->owner, owner + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queues `node` behind the last thread in line. Returns false if the lock was free and
+ * is now held through `node`
+ */
+static bool
+mcslock_enqueue(mcslock *l, mcslock_node *node) {
+	node->next = NULL;
+	__atomic_store_n(&node->locked, 1, __ATOMIC_RELAXED);
+	mcslock_node *prev = __atomic_exchange_n(&l->tail, node, __ATOMIC_ACQ_REL);
+	if (prev == NULL) return false;
+	// from here on the previous thread may hand the lock to `node`
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	return true;
+}
+
+void
+mcslock_acquire(mcslock *l, mcslock_node *node) {
+	if (!mcslock_enqueue(l, node)) return;
+	// the flag is on the node's own line, which nobody else reads
+	uint32_t spins = 0;
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE) != 0) {
+		cpu_relax();
+		// the holder, or a thread ahead in line, may not be running
+		if (++spins == SPINLOCK_YIELD) {
+			sched_yield();
+			spins = 0;
+		}
+	}
+}
+
+void
+mcslock_acquire_park(mcslock *l, mcslock_node *node) {
+	if (!mcslock_enqueue(l, node)) return;
+	uint32_t spins = BACKOFF_MIN;
+	for (uint32_t i = 0; i < SPINLOCK_SPINS; i++) {
+		if (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE) == 0) return;
+		backoff_wait(&spins);
+	}
+
+	// tell the previous thread to wake this one. if the lock was handed over already,
+	// the CAS fails on 0
+	uint32_t waiting = 1;
+	if (!__atomic_compare_exchange_n(&node->locked, &waiting, 2, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) return;
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE) != 0) {
+		futex_wait(&node->locked, 2);
+	}
+}
+
+bool
+mcslock_try(mcslock *l, mcslock_node *node) {
+	mcslock_node *tail = NULL;
+	node->next = NULL;
+	return __atomic_compare_exchange_n(&l->tail, &tail, node, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void
+mcslock_release(mcslock *l, mcslock_node *node) {
+	mcslock_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (next == NULL) {
+		// nobody is in line, unless a thread swapped itself in as `tail` and hasn't
+		// linked itself to `node` yet
+		mcslock_node *self = node;
+		if (__atomic_compare_exchange_n(&l->tail, &self, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+		while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) {
+			cpu_relax();
+		}
+	}
+	// a thread that has parked set its flag to 2. it may also return as soon as the flag
+	// is 0, so a wake can reach a node that is gone, which futexes allow for
+	if (__atomic_exchange_n(&next->locked, 0, __ATOMIC_RELEASE) == 2) {
+		futex_wake(&next->locked);
+	}
+}
@@ -1,17 +1,137 @@
 /**
- * CAS-based spinlock
+ * Spinlocks
  *
- * This is sometimes faster than a mutex and is an alternative to lock/unlock portions
- * of code to ensure that just one thread is executing it at a time.
+ * These are sometimes faster than a mutex and are an alternative to lock/unlock portions
+ * of code to ensure that just one thread is executing it at a time. Zeroed memory is an
+ * unlocked lock of any of the kinds below.
  *
- * Do not use this in lockfree algorithms. It is still effectively a user-space mutex.
+ * `spinlock` is a test-and-test-and-set lock. Waiters spin on plain loads, which are
+ * served from their own cache, and only try the CAS once the lock looks free, backing
+ * off after each failure. It is the smallest and fastest lock while few threads want
+ * it, but it isn't fair.
+ *
+ * `ticketlock` hands the lock out in the order threads asked for it. Each waiter takes
+ * a ticket and waits for `owner` to reach it, pausing longer the further back in line
+ * it is.
+ *
+ * `mcslock` is Mellor-Crummey and Scott's queue lock. Waiters line up in a list of
+ * `mcslock_node`s and each one spins on a flag in its own node, so a release touches
+ * the cache line of exactly one waiter instead of every one of them. It keeps handoffs
+ * cheap and fair however many threads wait. The node is passed to both acquire and
+ * release, and is usually on the stack.
+ *
+ * A fair lock can only go to the next thread in line. When that thread isn't running,
+ * because there are more threads than cores, every other waiter spins until it is
+ * scheduled again. Waiters of `ticketlock` and `mcslock` that see the lock stuck for
+ * `SPINLOCK_YIELD` pauses therefore yield their core.
+ *
+ * The `_park` variants spin for a while and then sleep in the kernel with a futex until
+ * the lock is released, for locks that may be held long or for more threads than
+ * cores. A lock may be acquired with and without parking at the same time.
+ *
+ * Do not use these in lockfree algorithms. They are still effectively user-space mutexes.
  */
 #ifndef JFALKNER_SPINLOCK_H
 #define JFALKNER_SPINLOCK_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backoff.h"
+
+// backoff rounds a `_park` acquire spins for before it sleeps
+#define SPINLOCK_SPINS 16
+// pauses per thread waiting ahead that a ticket lock waiter waits between loads. the
+// next thread in line loads on every pause
+#define TICKETLOCK_SPINS 64
+// pauses a ticket or MCS lock waiter spins without the lock moving before it yields
+#define SPINLOCK_YIELD 4096
+
+
+typedef struct spinlock_s {
+	// 0 free, 1 held, 2 held and threads may be parked on it
+	uint32_t state;
+} spinlock;
+
+typedef struct ticketlock_s {
+	// next ticket to hand out. arriving threads take it without disturbing waiters
+	uint32_t next __attribute__((aligned(64)));
+	// ticket that holds the lock
+	uint32_t owner __attribute__((aligned(64)));
+} ticketlock;
+
+typedef struct mcslock_node_s {
+	struct mcslock_node_s *next;
+	// 1 while the owner of the node waits, 2 once it may be parked, 0 once it holds the lock
+	uint32_t locked;
+} __attribute__((aligned(64))) mcslock_node;
+
+typedef struct mcslock_s {
+	// last thread in line, or NULL if the lock is free
+	mcslock_node *tail;
+} mcslock;
+
+
+/**
+ * Takes the lock, spinning until it is free
+ */
+void spinlock_acquire(spinlock *l);
+
+/**
+ * Takes the lock, sleeping once it has spun for a while
+ */
+void spinlock_acquire_park(spinlock *l);
+
+/**
+ * Takes the lock if it is free. Returns whether it did
+ */
+bool spinlock_try(spinlock *l);
+
+/**
+ * Releases the lock, waking one parked thread if there is any
+ */
+void spinlock_release(spinlock *l);
+
+/**
+ * Takes the lock after every thread that asked for it earlier
+ */
+void ticketlock_acquire(ticketlock *l);
+
+/**
+ * Takes the lock if nobody holds or waits for it. Returns whether it did
+ */
+bool ticketlock_try(ticketlock *l);
+
+void ticketlock_release(ticketlock *l);
+
+/**
+ * Takes the lock, waiting in line on `node`. The node must stay valid until the matching
+ * `mcslock_release`
+ */
+void mcslock_acquire(mcslock *l, mcslock_node *node);
+
+/**
+ * Takes the lock like `mcslock_acquire`, sleeping once it has spun for a while
+ */
+void mcslock_acquire_park(mcslock *l, mcslock_node *node);
+
+/**
+ * Takes the lock if nobody holds or waits for it. Returns whether it did
+ */
+bool mcslock_try(mcslock *l, mcslock_node *node);
+
+/**
+ * Releases the lock, which must have been taken with `node`, to the next thread in line
+ */
+void mcslock_release(mcslock *l, mcslock_node *node);
+
 
-#define acquire_lock(lock) while (!__sync_bool_compare_and_swap(&(lock), 0, 1));
-#define release_lock(lock) __sync_bool_compare_and_swap(&(lock), 1, 0);
+// locks an integer variable directly. new code should use `spinlock`
+#define acquire_lock(lock) { \
+	uint32_t spins_ = BACKOFF_MIN; \
+	while (__atomic_load_n(&(lock), __ATOMIC_RELAXED) || !__sync_bool_compare_and_swap(&(lock), 0, 1)) backoff_wait(&spins_); \
+}
+#define release_lock(lock) __atomic_store_n(&(lock), 0, __ATOMIC_RELEASE);
 
 
 #endif // JFALKNER_SPINLOCK_H
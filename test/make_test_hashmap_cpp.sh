@@ -0,0 +1,18 @@
+set -e
+
+# compile what the C++ map uses. the map itself is in the header
+cd ../src
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o free_later.o free_later.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o counter.o counter.c
+gcc -mcx16 -fPIC -shared -o lockfree.so counter.o free_later.o -lm -lpthread -latomic
+cp lockfree.so liblockfree.so
+
+cd ../test
+# compile the test
+g++ -mcx16 -O3 -Wall -march=native -msse4.2 -D_GNU_SOURCE -L ../src -std=c++17 -I ../src -c -o test_hashmap_cpp.o test_hashmap_cpp.cpp
+g++ -mcx16 -L ../src -o test_hashmap_cpp test_hashmap_cpp.o -lm -lpthread -llockfree -latomic
+
+# run
+export LD_LIBRARY_PATH=../src
+#gdb -ex run --args ./test_hashmap_cpp
+./test_hashmap_cpp
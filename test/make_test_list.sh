@@ -2,8 +2,11 @@ set -e
 
 # compile the list
 cd ../src
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o counter.o counter.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o objpool.o objpool.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o free_later.o free_later.c
 cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o list.o list.c
-gcc -mcx16 -fPIC -shared -o lockfree.so list.o -lm -lpthread
+gcc -mcx16 -fPIC -shared -o lockfree.so list.o counter.o objpool.o free_later.o -lm -lpthread -latomic
 cp lockfree.so liblockfree.so
 
 cd ../test
@@ -2,9 +2,12 @@ set -e
 
 # compile the mempool
 cd ../src
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o counter.o counter.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o objpool.o objpool.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o free_later.o free_later.c
 cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o list.o list.c
 cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o mempool.o mempool.c
-gcc -mcx16 -fPIC -shared -o hashmap.so mempool.o list.o -lm -lpthread
+gcc -mcx16 -fPIC -shared -o hashmap.so mempool.o list.o counter.o objpool.o free_later.o -lm -lpthread -latomic
 cp hashmap.so libhashmap.so
 
 cd ../test
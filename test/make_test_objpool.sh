@@ -0,0 +1,20 @@
+set -e
+
+# compile the pool
+cd ../src
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o counter.o counter.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o objpool.o objpool.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o free_later.o free_later.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o list.o list.c
+gcc -mcx16 -fPIC -shared -o lockfree.so objpool.o list.o counter.o free_later.o -lm -lpthread -latomic
+cp lockfree.so liblockfree.so
+
+cd ../test
+# compile the test
+cc -mcx16 -O3 -Wall -march=native -msse4.2 -D_GNU_SOURCE -L ../src -std=c99 -I ../src -L ../test/lockfree.so -c -o test_objpool.o test_objpool.c
+gcc -mcx16 -L ../src -o test_objpool test_objpool.o -lm -lpthread -llockfree -latomic -I ../src
+
+# run
+export LD_LIBRARY_PATH=../src
+#gdb -ex run --args ./test_objpool
+./test_objpool
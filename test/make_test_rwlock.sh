@@ -0,0 +1,18 @@
+set -e
+
+# compile the locks
+cd ../src
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o spinlock.o spinlock.c
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o rwlock.o rwlock.c
+gcc -mcx16 -fPIC -shared -o lockfree.so rwlock.o spinlock.o -lm -lpthread -latomic
+cp lockfree.so liblockfree.so
+
+cd ../test
+# compile the test
+cc -mcx16 -O3 -Wall -march=native -msse4.2 -D_GNU_SOURCE -L ../src -std=c99 -I ../src -L ../test/lockfree.so -c -o test_rwlock.o test_rwlock.c
+gcc -mcx16 -L ../src -o test_rwlock test_rwlock.o -lm -lpthread -llockfree -latomic -I ../src
+
+# run
+export LD_LIBRARY_PATH=../src
+#gdb -ex run --args ./test_rwlock
+./test_rwlock
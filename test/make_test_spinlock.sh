@@ -0,0 +1,17 @@
+set -e
+
+# compile the locks
+cd ../src
+cc -ggdb -O3 -fPIC -Wall -march=native -msse4.2 -D_GNU_SOURCE -fPIC -shared -MD  -c -o spinlock.o spinlock.c
+gcc -mcx16 -fPIC -shared -o lockfree.so spinlock.o -lm -lpthread -latomic
+cp lockfree.so liblockfree.so
+
+cd ../test
+# compile the test
+cc -mcx16 -O3 -Wall -march=native -msse4.2 -D_GNU_SOURCE -L ../src -std=c99 -I ../src -L ../test/lockfree.so -c -o test_spinlock.o test_spinlock.c
+gcc -mcx16 -L ../src -o test_spinlock test_spinlock.o -lm -lpthread -llockfree -latomic -I ../src
+
+# run
+export LD_LIBRARY_PATH=../src
+#gdb -ex run --args ./test_spinlock
+./test_spinlock
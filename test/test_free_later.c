@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "free_later.h"
+
+// how many threads should run in parallel
+#define NUM_THREADS 10
+// how many times the work loop should repeat
+#define NUM_WORK 10000
+// state for the threads
+static pthread_t threads[NUM_THREADS];
+
+#define ALIVE 0x11111111
+#define DEAD 0xdeadbeef
+
+// shared object that writers keep replacing and readers keep checking
+typedef struct box_s {
+	volatile uint32_t magic;
+	uint32_t value;
+} box;
+
+static box *current = NULL;
+
+static volatile uint32_t retired = 0;
+static volatile uint32_t released = 0;
+static volatile uint32_t bad_reads = 0;
+
+void
+release_box(void *var)
+{
+	box *b = var;
+	// poison it so that a reader that still had it would notice
+	b->magic = DEAD;
+	__atomic_fetch_add(&released, 1, __ATOMIC_SEQ_CST);
+	free(b);
+}
+
+/**
+ * Even threads swap in a new box and retire the old one. Odd threads read the box a
+ * few times inside a section and check it was never released under them.
+ */
+void *
+work(void *args)
+{
+	uintptr_t id = (uintptr_t)args;
+	for (int j=0;j<NUM_WORK;j++) {
+		if (id % 2 == 0) {
+			box *b = malloc(sizeof(box));
+			b->magic = ALIVE;
+			b->value = j;
+			free_later_enter();
+			box *old = __atomic_exchange_n(&current, b, __ATOMIC_SEQ_CST);
+			free_later_exit();
+			free_later(old, release_box);
+			__atomic_fetch_add(&retired, 1, __ATOMIC_SEQ_CST);
+		}
+		else {
+			free_later_enter();
+			box *b = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+			for (int k=0;k<3;k++) {
+				if (b->magic != ALIVE) {
+					__atomic_fetch_add(&bad_reads, 1, __ATOMIC_SEQ_CST);
+				}
+				if (k == 1) sched_yield();
+			}
+			free_later_exit();
+		}
+	}
+	return NULL;
+}
+
+bool
+test_reclaim(void)
+{
+	current = malloc(sizeof(box));
+	current->magic = ALIVE;
+
+	for (uintptr_t i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_create(&threads[i], NULL, work, (void *)i);
+		if (ret != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	// wait for work to finish
+	for (int i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_join(threads[i], NULL);
+		if (ret != 0) {
+			printf("Failed to join thread %d\n", i);
+			exit(1);
+		}
+	}
+
+	if (bad_reads) {
+		printf("test_reclaim() is failing. %u reads saw a released box\n", bad_reads);
+		return false;
+	}
+	// the writers released most of what they retired on their own, without any help
+	if (released < retired / 2) {
+		printf("test_reclaim() is failing. Only %u of %u boxes were released\n", released, retired);
+		return false;
+	}
+	uint32_t before_term = released;
+
+	// vars of exited threads were handed off, so term releases everything that is left
+	free_later_term();
+	if (released != retired) {
+		printf("test_reclaim() is failing. %u of %u boxes were released\n", released, retired);
+		return false;
+	}
+	free(current);
+
+	printf("Done. Released %u of %u boxes while running, the rest at term\n", before_term, retired);
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	free_later_init();
+
+	if (!test_reclaim()) {
+		printf("Failed multi-threaded reclaim test.");
+	}
+}
@@ -22,11 +22,12 @@ static pthread_t threads_del[NUM_THREADS * 2];
 
 static uint32_t MAX_VAL_PLUS_ONE = NUM_THREADS * NUM_WORK + 1;
 
-extern volatile uint32_t hashmap_del_fail;
-extern volatile uint32_t hashmap_del_fail_new_head;
-extern volatile uint32_t hashmap_put_retries;
-extern volatile uint32_t hashmap_put_replace_fail;
-extern volatile uint32_t hashmap_put_head_fail;
+extern counter hashmap_del_fail;
+extern counter hashmap_del_fail_new_head;
+extern counter hashmap_put_retries;
+extern counter hashmap_put_replace_fail;
+extern counter hashmap_put_head_fail;
+extern counter hashmap_resizes;
 
 uint8_t
 cmp_uint32(const void *x, const void *y) {
@@ -136,7 +137,7 @@ test_add ()
 	map = (hashmap *)hashmap_new(10, cmp_uint32, hash_uint32);
 
 	int loops = 0;
-	while (hashmap_put_retries == 0) {
+	while (counter_read(&hashmap_put_retries) == 0) {
 		loops += 1;
 		if (!multi_thread_add_vals()) {
 			printf("Error. Failed to add values!\n");
@@ -156,8 +157,8 @@ test_add ()
 			}
 		}
 		if (found == TOTAL) {
-			printf("Loop %d. All values found. hashmap_put_retries=%u, hashmap_put_head_fail=%u, hashmap_put_replace_fail=%u\n",
-				loops, hashmap_put_retries, hashmap_put_head_fail, hashmap_put_replace_fail);
+			printf("Loop %d. All values found. hashmap_put_retries=%ld, hashmap_put_head_fail=%ld, hashmap_put_replace_fail=%ld\n",
+				loops, counter_read(&hashmap_put_retries), counter_read(&hashmap_put_head_fail), counter_read(&hashmap_put_replace_fail));
 		}
 		else {
 			printf("Found %d of %d values. Where are the missing ones?", found, TOTAL);
@@ -176,10 +177,10 @@ test_del(){
 	// keep looping until a CAS retry was needed by hashmap_del
 	uint32_t loops = 0;
 	// make sure test counters are zeroed
-	hashmap_del_fail = 0;
-	hashmap_del_fail_new_head = 0;
+	counter_reset(&hashmap_del_fail);
+	counter_reset(&hashmap_del_fail_new_head);
 
-	while (hashmap_del_fail == 0 || hashmap_del_fail_new_head == 0) {
+	while (counter_read(&hashmap_del_fail) == 0 || counter_read(&hashmap_del_fail_new_head) == 0) {
 		map = hashmap_new(10, cmp_uint32, hash_uint32);
 
 		// multi-thread add values
@@ -210,11 +211,504 @@ test_del(){
 	return true;
 }
 
+bool
+test_resize() {
+	// start tiny so that multi-threaded adds have to grow the table several times
+	map = hashmap_new(2, cmp_uint32, hash_uint32);
+	counter_reset(&hashmap_resizes);
+
+	if (!multi_thread_add_vals()) {
+		printf("test_resize() is failing. Can't complete multi_thread_add_vals()");
+		return false;
+	}
+
+	uint32_t TOTAL = NUM_THREADS * NUM_WORK;
+	for (uint32_t i=0;i<TOTAL;i++) {
+		uint32_t *v = (uint32_t *)hashmap_get(map, &i);
+		if (!v || *v != i) {
+			printf("test_resize() is failing. Could not find %u after growing\n", i);
+			return false;
+		}
+	}
+	uint32_t grown = map->table->num_buckets;
+	if (counter_read(&hashmap_resizes) == 0 || grown <= 2) {
+		printf("test_resize() is failing. Table never grew\n");
+		return false;
+	}
+
+	// deleting everything should shrink the table back down
+	for (uint32_t i=0;i<TOTAL;i++) {
+		if (!hashmap_del(map, &i)) {
+			printf("test_resize() is failing. Could not delete %u\n", i);
+			return false;
+		}
+	}
+	for (uint32_t i=0;i<TOTAL;i++) {
+		if (hashmap_get(map, &i)) {
+			printf("test_resize() is failing. Found %u after deleting it\n", i);
+			return false;
+		}
+	}
+	// migration only moves forward with puts and dels, so a shrink may still be running
+	hashmap_table *shrunk = map->table->next ? map->table->next : map->table;
+	if (hashmap_length(map) != 0 || shrunk->num_buckets >= grown) {
+		printf("test_resize() is failing. Table never shrank\n");
+		return false;
+	}
+
+	printf("Done. Resized %ld times, grew to %u buckets and shrank to %u\n",
+		counter_read(&hashmap_resizes), grown, shrunk->num_buckets);
+	return true;
+}
+
+uint32_t stalled_keys[NUM_THREADS * NUM_WORK];
+
+bool
+test_stalled_resize() {
+	map = hashmap_new(2, cmp_uint32, hash_uint32);
+	uint32_t TOTAL = NUM_THREADS * NUM_WORK;
+	for (uint32_t i=0;i<TOTAL;i++) {
+		stalled_keys[i] = i;
+	}
+
+	// add until a resize starts, then claim every group as a thread that stalls would
+	uint32_t added = 0;
+	while (added < TOTAL && !map->table->next) {
+		hashmap_put(map, &stalled_keys[added], &stalled_keys[added]);
+		added++;
+	}
+	hashmap_table *stalled = map->table;
+	if (!stalled->next) {
+		printf("test_stalled_resize() is failing. Table never started to grow\n");
+		return false;
+	}
+	stalled->migrate_next = stalled->num_buckets;
+
+	// the other writers have to finish the claimed groups for the resize to complete
+	while (added < TOTAL) {
+		hashmap_put(map, &stalled_keys[added], &stalled_keys[added]);
+		added++;
+	}
+	if (map->table == stalled) {
+		printf("test_stalled_resize() is failing. Resize never finished\n");
+		return false;
+	}
+	for (uint32_t i=0;i<TOTAL;i++) {
+		uint32_t *v = (uint32_t *)hashmap_get(map, &i);
+		if (!v || *v != i) {
+			printf("test_stalled_resize() is failing. Could not find %u\n", i);
+			return false;
+		}
+	}
+	if (hashmap_length(map) != TOTAL) {
+		printf("test_stalled_resize() is failing. length=%u\n", hashmap_length(map));
+		return false;
+	}
+
+	printf("Done. Resize finished with every group claimed, now %u buckets\n", map->table->num_buckets);
+	return true;
+}
+
+bool
+test_batch() {
+	map = hashmap_new(10, cmp_uint32, hash_uint32);
+
+	// put keys in batches that don't line up with the internal batch size
+	uint32_t TOTAL = NUM_THREADS * NUM_WORK;
+	const void **keys = malloc(2 * TOTAL * sizeof(void *));
+	void **vals = malloc(2 * TOTAL * sizeof(void *));
+	for (uint32_t i=0;i<2 * TOTAL;i++) {
+		uint32_t *val = malloc(sizeof(uint32_t));
+		*val = i;
+		keys[i] = val;
+		vals[i] = val;
+	}
+	for (uint32_t i=0;i<TOTAL;i+=37) {
+		uint32_t count = TOTAL - i < 37 ? TOTAL - i : 37;
+		if (hashmap_put_many(map, &keys[i], &vals[i], count) != 0) {
+			printf("test_batch() is failing. New keys were reported as replaced\n");
+			return false;
+		}
+	}
+
+	// look up every added key and as many that were never added
+	void **found = malloc(2 * TOTAL * sizeof(void *));
+	hashmap_get_many(map, keys, 2 * TOTAL, found);
+	for (uint32_t i=0;i<2 * TOTAL;i++) {
+		if (i < TOTAL && (!found[i] || *(uint32_t *)found[i] != i)) {
+			printf("test_batch() is failing. Could not find %u\n", i);
+			return false;
+		}
+		if (i >= TOTAL && found[i]) {
+			printf("test_batch() is failing. Found %u but it was never added\n", i);
+			return false;
+		}
+	}
+	printf("Done. Batched %u puts and %u gets\n", TOTAL, 2 * TOTAL);
+	return true;
+}
+
+// keys that every thread counts into
+#define NUM_COUNTERS 10
+static uint32_t counter_keys[NUM_COUNTERS];
+
+void *
+count_vals(void *args)
+{
+	for (int j=0;j<NUM_WORK;j++) {
+		for (int k=0;k<NUM_COUNTERS;k++) {
+			hashmap_fetch_add(map, &counter_keys[k], 1);
+		}
+	}
+	return NULL;
+}
+
+bool
+test_update() {
+	map = hashmap_new(2, cmp_uint32, hash_uint32);
+	for (uint32_t k=0;k<NUM_COUNTERS;k++) {
+		counter_keys[k] = k;
+	}
+
+	// concurrent in-place adds must not lose any counts
+	for (int i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_create(&threads[i], NULL, count_vals, NULL);
+		if (ret != 0) {
+			printf("Failed to create thread %d\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_join(threads[i], NULL);
+		if (ret != 0) {
+			printf("Failed to join thread %d\n", i);
+			exit(1);
+		}
+	}
+	for (uint32_t k=0;k<NUM_COUNTERS;k++) {
+		uintptr_t count = (uintptr_t)hashmap_get(map, &counter_keys[k]);
+		if (count != NUM_THREADS * NUM_WORK) {
+			printf("test_update() is failing. Counted %lu for key %u\n", (unsigned long)count, k);
+			return false;
+		}
+	}
+	if (hashmap_length(map) != NUM_COUNTERS) {
+		printf("test_update() is failing. length=%u\n", hashmap_length(map));
+		return false;
+	}
+
+	// put_if_absent and replace_value only change the map when they should
+	uint32_t key = NUM_COUNTERS;
+	uint32_t a = 1, b = 2;
+	if (!hashmap_put_if_absent(map, &key, &a) || hashmap_put_if_absent(map, &key, &b)) {
+		printf("test_update() is failing. put_if_absent added twice\n");
+		return false;
+	}
+	if (hashmap_replace_value(map, &key, &b, &a) || !hashmap_replace_value(map, &key, &a, &b)) {
+		printf("test_update() is failing. replace_value ignored the expected value\n");
+		return false;
+	}
+	if (hashmap_get(map, &key) != &b) {
+		printf("test_update() is failing. replace_value did not replace\n");
+		return false;
+	}
+
+	printf("Done. Counted %u per key, hashmap_put_replace_fail=%ld\n", NUM_THREADS * NUM_WORK, counter_read(&hashmap_put_replace_fail));
+	return true;
+}
+
+// how many threads scan the map in parallel
+#define NUM_PARTS 3
+static uint8_t seen[NUM_THREADS * NUM_WORK];
+
+void *
+scan_part(void *args)
+{
+	uint32_t part = *(uint32_t *)args;
+	hashmap_iter iter;
+	const void *key;
+	void *value;
+
+	hashmap_iter_init(map, &iter, part, NUM_PARTS);
+	while (hashmap_iter_next(&iter, &key, &value)) {
+		uint32_t k = *(uint32_t *)key;
+		// keys added alongside the scan may or may not be seen
+		if (k < NUM_THREADS * NUM_WORK) {
+			__atomic_fetch_add(&seen[k], 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	hashmap_iter_done(&iter);
+	return NULL;
+}
+
+void *
+add_more_vals(void *args)
+{
+	// keys past the ones being checked, so the table resizes during the scan
+	for (uint32_t j=0;j<NUM_THREADS * NUM_WORK;j++) {
+		uint32_t *val = malloc(sizeof(uint32_t));
+		*val = NUM_THREADS * NUM_WORK + j;
+		hashmap_put(map, val, val);
+	}
+	return NULL;
+}
+
+bool
+test_iter() {
+	map = hashmap_new(2, cmp_uint32, hash_uint32);
+	multi_thread_add_vals();
+
+	// split the scan across threads while another thread keeps adding keys
+	pthread_t scanners[NUM_PARTS];
+	uint32_t parts[NUM_PARTS];
+	pthread_t adder;
+	if (pthread_create(&adder, NULL, add_more_vals, NULL) != 0) {
+		printf("Failed to create thread\n");
+		exit(1);
+	}
+	for (uint32_t i=0;i<NUM_PARTS;i++) {
+		parts[i] = i;
+		if (pthread_create(&scanners[i], NULL, scan_part, &parts[i]) != 0) {
+			printf("Failed to create thread %u\n", i);
+			exit(1);
+		}
+	}
+	for (uint32_t i=0;i<NUM_PARTS;i++) {
+		pthread_join(scanners[i], NULL);
+	}
+	pthread_join(adder, NULL);
+
+	for (uint32_t i=0;i<NUM_THREADS * NUM_WORK;i++) {
+		if (seen[i] != 1) {
+			printf("test_iter() is failing. Saw %u %d times\n", i, seen[i]);
+			return false;
+		}
+	}
+
+	// parts split the buckets between them instead of each walking all of them
+	uint32_t walked = 0;
+	for (uint32_t i=0;i<NUM_PARTS;i++) {
+		hashmap_iter iter;
+		hashmap_iter_init(map, &iter, i, NUM_PARTS);
+		walked += iter.count;
+		hashmap_iter_done(&iter);
+	}
+	if (walked != map->table->num_buckets) {
+		printf("test_iter() is failing. %u parts walk %u of %u buckets\n", NUM_PARTS, walked, map->table->num_buckets);
+		return false;
+	}
+	printf("Done. Scanned %u keys in %d parts during a resize\n", NUM_THREADS * NUM_WORK, NUM_PARTS);
+	return true;
+}
+
+// keys a walk should see once, and keys that grow and then shrink the table under it
+#define ITER_KEYS 16
+#define ITER_MORE 512
+static uint32_t iter_keys[ITER_KEYS + ITER_MORE];
+
+/**
+ * A shrink merges buckets that a grow split apart. A walk that was following both of
+ * them into newer tables must still return each entry once
+ */
+bool
+test_iter_resize() {
+	map = hashmap_new(2, cmp_uint32, hash_uint32);
+	for (uint32_t i=0;i<ITER_KEYS + ITER_MORE;i++) {
+		iter_keys[i] = i;
+	}
+	for (uint32_t i=0;i<ITER_KEYS;i++) {
+		hashmap_put(map, &iter_keys[i], &iter_keys[i]);
+	}
+	// let any resize finish so the walk starts with a settled table
+	while (map->table->next) hashmap_put(map, &iter_keys[0], &iter_keys[0]);
+	uint32_t start = map->table->num_buckets;
+
+	uint8_t counts[ITER_KEYS] = { 0 };
+	hashmap_iter iter;
+	const void *key;
+	void *value;
+	hashmap_iter_init(map, &iter, 0, 1);
+	if (!hashmap_iter_next(&iter, &key, &value)) {
+		printf("test_iter_resize() is failing. The walk found nothing\n");
+		return false;
+	}
+	counts[*(uint32_t *)key] += 1;
+
+	// grow well past the walk's table and shrink back towards it
+	for (uint32_t i=ITER_KEYS;i<ITER_KEYS + ITER_MORE;i++) {
+		hashmap_put(map, &iter_keys[i], &iter_keys[i]);
+	}
+	while (map->table->next) hashmap_put(map, &iter_keys[0], &iter_keys[0]);
+	uint32_t grown = map->table->num_buckets;
+	for (uint32_t i=ITER_KEYS;i<ITER_KEYS + ITER_MORE;i++) {
+		hashmap_del(map, &iter_keys[i]);
+	}
+	// resizes only move forward with puts and dels, and only start after the last one
+	for (uint32_t i=0;i<ITER_MORE;i++) {
+		hashmap_put(map, &iter_keys[ITER_KEYS], &iter_keys[ITER_KEYS]);
+		hashmap_del(map, &iter_keys[ITER_KEYS]);
+	}
+	uint32_t shrunk = map->table->num_buckets;
+
+	while (hashmap_iter_next(&iter, &key, &value)) {
+		uint32_t k = *(uint32_t *)key;
+		if (k < ITER_KEYS) counts[k] += 1;
+	}
+	bool overflow = iter.overflow;
+	hashmap_iter_done(&iter);
+
+	if (grown <= start || shrunk >= grown || overflow) {
+		printf("test_iter_resize() is failing. %u buckets grew to %u and shrank to %u, overflow=%d\n", start, grown, shrunk, overflow);
+		return false;
+	}
+	for (uint32_t i=0;i<ITER_KEYS;i++) {
+		if (counts[i] != 1) {
+			printf("test_iter_resize() is failing. Saw %u %d times\n", i, counts[i]);
+			return false;
+		}
+	}
+	printf("Done. Walked %u keys once while %u buckets grew to %u and shrank to %u\n", ITER_KEYS, start, grown, shrunk);
+	return true;
+}
+
+// values that the hazard test replaces, poisoned when the map releases them
+#define HAZARD_ALIVE 0x11111111
+#define HAZARD_DEAD 0xdeadbeef
+static uint32_t hazard_key = 0;
+static volatile uint32_t hazard_released = 0;
+
+void
+release_hazard_val(void *value)
+{
+	*(uint32_t *)value = HAZARD_DEAD;
+	__atomic_fetch_add(&hazard_released, 1, __ATOMIC_SEQ_CST);
+	free(value);
+}
+
+void *
+replace_hazard_vals(void *args)
+{
+	for (int j=0;j<NUM_WORK * 10;j++) {
+		uint32_t *val = malloc(sizeof(uint32_t));
+		*val = HAZARD_ALIVE;
+		hashmap_put(map, &hazard_key, val);
+	}
+	return NULL;
+}
+
+bool
+test_hazard() {
+	hazard_domain *domain = hazard_new();
+	map = hashmap_new(2, cmp_uint32, hash_uint32);
+	hashmap_use_hazards(map, domain, release_hazard_val);
+
+	uint32_t *first = malloc(sizeof(uint32_t));
+	*first = HAZARD_ALIVE;
+	hashmap_put(map, &hazard_key, first);
+
+	// hold on to the value like a slow reader while other threads replace it
+	void **slot = hazard_acquire(domain);
+	uint32_t *held = hashmap_get_protected(map, &hazard_key, slot);
+	for (int i=0;i<NUM_THREADS;i++) {
+		if (pthread_create(&threads[i], NULL, replace_hazard_vals, NULL) != 0) {
+			printf("Failed to create thread %d\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_THREADS;i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if (held != first || *held != HAZARD_ALIVE) {
+		printf("test_hazard() is failing. The protected value was released\n");
+		return false;
+	}
+	// everything else that was replaced could be released, held value or not
+	uint32_t replaced = NUM_THREADS * NUM_WORK * 10;
+	if (hazard_released < replaced / 2) {
+		printf("test_hazard() is failing. Only %u of %u replaced values were released\n", hazard_released, replaced);
+		return false;
+	}
+	hazard_release(slot);
+	hashmap_del(map, &hazard_key);
+	hazard_scan(domain);
+	if (hazard_released != replaced + 1) {
+		printf("test_hazard() is failing. %u of %u values were released\n", hazard_released, replaced + 1);
+		return false;
+	}
+	printf("Done. Held one value while %u were replaced and released\n", replaced);
+	return true;
+}
+
+static uint32_t keys_released = 0;
+
+void
+release_key(void *key)
+{
+	__atomic_fetch_add(&keys_released, 1, __ATOMIC_SEQ_CST);
+	free(key);
+}
+
+/**
+ * Keys of deleted entries go to `release_key`, through `free_later`. Keys passed to a
+ * put that replaced a value stay with the caller
+ */
+bool
+test_release_key() {
+	map = hashmap_new(16, cmp_uint32, hash_uint32);
+	map->release_key = release_key;
+	for (uint32_t i=0;i<NUM_WORK;i++) {
+		uint32_t *key = malloc(sizeof(uint32_t));
+		*key = i;
+		hashmap_put(map, key, &MAX_VAL_PLUS_ONE);
+	}
+	// the map keeps the key it has, so this one is still the caller's
+	uint32_t replaced = 0;
+	hashmap_put(map, &replaced, &MAX_VAL_PLUS_ONE);
+
+	for (uint32_t i=0;i<NUM_WORK;i++) {
+		hashmap_del(map, &i);
+	}
+	for (int i=0;i<4 && keys_released < NUM_WORK;i++) {
+		free_later_run();
+	}
+	if (keys_released != NUM_WORK) {
+		printf("test_release_key() is failing. Released %u of %u keys\n", keys_released, NUM_WORK);
+		return false;
+	}
+	printf("Done. Released %u deleted keys\n", keys_released);
+	return true;
+}
+
 int
 main (int argc, char **argv)
 {
 	free_later_init();
 
+	if (!test_resize()) {
+		printf("Failed multi-threaded resize test.");
+	}
+	if (!test_stalled_resize()) {
+		printf("Failed stalled resize test.");
+	}
+	if (!test_batch()) {
+		printf("Failed batch test.");
+	}
+	if (!test_update()) {
+		printf("Failed multi-threaded update test.");
+	}
+	if (!test_iter()) {
+		printf("Failed multi-threaded iterator test.");
+	}
+	if (!test_iter_resize()) {
+		printf("Failed iterator resize test.");
+	}
+	if (!test_hazard()) {
+		printf("Failed hazard pointer test.");
+	}
+	if (!test_release_key()) {
+		printf("Failed key release test.");
+	}
 	if (!test_add()) {
 		printf("Failed multi-threaded add test.");
 	}
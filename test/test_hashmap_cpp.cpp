@@ -0,0 +1,231 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "hashmap.hpp"
+
+// integer keys and values, stored in the nodes
+using U64Map = lockfree::HashMap<uint64_t, uint64_t>;
+// string keys and values, stored in boxes and found by string_view
+using StrMap = lockfree::HashMap<std::string, std::string, lockfree::StringHash>;
+
+// how many threads should run in parallel
+#define NUM_THREADS 8
+// how many keys each thread owns
+#define NUM_WORK 20000
+// how many times the multi-threaded tests should repeat
+#define NUM_LOOPS 5
+
+static uint32_t wrong = 0;
+
+static void
+fail()
+{
+	__atomic_fetch_add(&wrong, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Puts the thread's own keys, starting from a small table so that it resizes, then
+ * replaces and erases every other one. Other threads read the keys at the same time
+ */
+static void
+churn(U64Map *map, uint64_t thread)
+{
+	uint64_t offset = thread * NUM_WORK;
+	for (uint64_t j=0;j<NUM_WORK;j++) {
+		if (!map->insert_or_assign(offset + j, (offset + j) * 2)) fail();
+	}
+	for (uint64_t j=0;j<NUM_WORK;j++) {
+		uint64_t key = offset + j;
+		// a key of another thread is either missing or has one of its two values
+		uint64_t other = (key + NUM_WORK) % (NUM_THREADS * NUM_WORK);
+		std::optional<uint64_t> value = map->get(other);
+		if (value && *value != other * 2 && *value != other * 3) fail();
+		if (j % 2 == 0) {
+			if (map->insert_or_assign(key, key * 3)) fail();
+		}
+		else if (!map->erase(key) || map->erase(key)) {
+			fail();
+		}
+	}
+}
+
+bool
+test_churn()
+{
+	for (int loop=0;loop<NUM_LOOPS;loop++) {
+		U64Map map(16);
+		wrong = 0;
+		std::vector<std::thread> threads;
+		for (uint64_t i=0;i<NUM_THREADS;i++) {
+			threads.emplace_back(churn, &map, i);
+		}
+		for (std::thread &t : threads) {
+			t.join();
+		}
+
+		if (wrong) {
+			printf("test_churn() is failing. %u operations returned the wrong result\n", wrong);
+			return false;
+		}
+		for (uint64_t key=0;key<NUM_THREADS * NUM_WORK;key++) {
+			std::optional<uint64_t> value = map.get(key);
+			if (key % 2 == 0 ? !value || *value != key * 3 : value.has_value()) {
+				printf("test_churn() is failing. key %lu\n", key);
+				return false;
+			}
+		}
+		if (map.size() != NUM_THREADS * NUM_WORK / 2) {
+			printf("test_churn() is failing. size %zu\n", map.size());
+			return false;
+		}
+	}
+	printf("Done. %u threads put, replaced and erased %u keys %u times\n", NUM_THREADS, NUM_THREADS * NUM_WORK, NUM_LOOPS);
+	return true;
+}
+
+/**
+ * Strings are replaced by several threads at once while others read them. Every value
+ * read must be one that was put whole, and no box may leak or be released twice
+ */
+static void
+replace(StrMap *map, uint64_t thread)
+{
+	for (int j=0;j<NUM_WORK;j++) {
+		std::string key = "key" + std::to_string(j % 64);
+		map->insert_or_assign(key, std::string(100, 'a' + thread));
+		map->visit(std::string_view(key), [](const std::string &value) {
+			if (value.size() != 100 || value.find_first_not_of(value[0]) != std::string::npos) fail();
+		});
+		if (j % 16 == 0) map->erase(key);
+	}
+}
+
+bool
+test_boxes()
+{
+	StrMap map(4);
+	wrong = 0;
+	std::vector<std::thread> threads;
+	for (uint64_t i=0;i<NUM_THREADS;i++) {
+		threads.emplace_back(replace, &map, i);
+	}
+	for (std::thread &t : threads) {
+		t.join();
+	}
+	if (wrong) {
+		printf("test_boxes() is failing. %u values were torn\n", wrong);
+		return false;
+	}
+	printf("Done. %u threads replaced string values\n", NUM_THREADS);
+	return true;
+}
+
+/**
+ * Lookups by string_view and C string, emplacement and move-only values
+ */
+bool
+test_api()
+{
+	StrMap map;
+	char alpha[] = "alpha";
+	if (!map.try_emplace(std::string(alpha), 3, 'x') || map.try_emplace("alpha", "y") || !map.try_emplace("beta", "b")) {
+		printf("test_api() is failing. try_emplace\n");
+		return false;
+	}
+	std::optional<std::string> value = map.get(std::string_view("alpha"));
+	if (!value || *value != "xxx" || map.get("gamma") || !map.contains(alpha) || map.size() != 2) {
+		printf("test_api() is failing. get\n");
+		return false;
+	}
+	if (!map.erase("beta") || map.erase("beta") || map.contains("beta") || map.size() != 1) {
+		printf("test_api() is failing. erase\n");
+		return false;
+	}
+
+	// values that can only be moved are constructed in place and read through visit
+	lockfree::HashMap<int, std::unique_ptr<int>> owned;
+	owned.try_emplace(1, new int(10));
+	owned.insert_or_assign(1, std::make_unique<int>(11));
+	int seen = 0;
+	if (!owned.visit(1, [&seen](const std::unique_ptr<int> &v) { seen = *v; }) || seen != 11) {
+		printf("test_api() is failing. move-only values\n");
+		return false;
+	}
+
+	// moving a map hands over its entries
+	StrMap moved(std::move(map));
+	if (!moved.contains("alpha") || moved.size() != 1 || map.size() != 0) {
+		printf("test_api() is failing. move\n");
+		return false;
+	}
+	printf("Done. lookups, emplacement and moves\n");
+	return true;
+}
+
+// a key that can be moved but throws whenever it is copied
+struct MoveOnlyKey {
+	uint64_t id;
+	explicit MoveOnlyKey(uint64_t i) : id(i) {}
+	MoveOnlyKey(MoveOnlyKey &&other) noexcept : id(other.id) {}
+	MoveOnlyKey(const MoveOnlyKey &other) : id(other.id) { throw std::runtime_error("key copied"); }
+	bool operator==(const MoveOnlyKey &other) const { return id == other.id; }
+};
+
+struct MoveOnlyKeyHash {
+	size_t operator()(const MoveOnlyKey &k) const noexcept { return k.id; }
+};
+
+/**
+ * Keys whose copy can throw are boxed, so growing and shrinking the map never copies
+ * them
+ */
+bool
+test_key_box()
+{
+	lockfree::HashMap<MoveOnlyKey, uint64_t, MoveOnlyKeyHash> map(4);
+	try {
+		for (uint64_t i=0;i<1000;i++) {
+			map.try_emplace(MoveOnlyKey(i), i);
+		}
+		for (uint64_t i=0;i<1000;i+=2) {
+			map.erase(MoveOnlyKey(i));
+		}
+	}
+	catch (const std::runtime_error &) {
+		printf("test_key_box() is failing. a resize copied a key\n");
+		return false;
+	}
+	std::optional<uint64_t> value = map.get(MoveOnlyKey(501));
+	if (map.size() != 500 || !value || *value != 501 || map.contains(MoveOnlyKey(500))) {
+		printf("test_key_box() is failing. size %zu\n", map.size());
+		return false;
+	}
+	printf("Done. boxed keys survived resizes without being copied\n");
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	free_later_init();
+	if (!test_churn()) {
+		printf("Failed multi-threaded churn test.");
+	}
+	if (!test_boxes()) {
+		printf("Failed multi-threaded boxed value test.");
+	}
+	if (!test_api()) {
+		printf("Failed API test.");
+	}
+	if (!test_key_box()) {
+		printf("Failed boxed key test.");
+	}
+	free_later_term();
+}
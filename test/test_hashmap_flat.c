@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "free_later.h"
+#include "hashmap_flat.h"
+
+// global hash map
+hashmap_flat *map = NULL;
+
+// how many threads should run in parallel
+#define NUM_THREADS 10
+// how many times the work loop should repeat
+#define NUM_WORK 100
+// how many times the multi-threaded tests should repeat
+#define NUM_LOOPS 100
+// state for the threads
+static pthread_t threads[NUM_THREADS];
+// state for the threads that test deletes
+static pthread_t threads_del[NUM_THREADS * 2];
+
+static uint32_t MAX_VAL_PLUS_ONE = NUM_THREADS * NUM_WORK + 1;
+
+extern counter hashmap_flat_claim_fail;
+extern counter hashmap_flat_del_fail;
+extern counter hashmap_flat_put_full;
+extern counter hashmap_flat_rebuilds;
+
+uint8_t
+cmp_uint32(const void *x, const void *y) {
+	uint32_t xi = *(uint32_t *)x;
+	uint32_t yi = *(uint32_t *)y;
+	if (xi > yi) {
+		return -1;
+	}
+	if (xi < yi) {
+		return 1;
+	}
+	return 0;
+}
+
+uint64_t
+hash_uint32(const void *key) {
+	return *(uint32_t *)key;
+}
+
+/**
+ * Simulates work that is quick and uses the hashtable once per loop.
+ */
+void *
+add_vals(void *args)
+{
+	int *offset = (int *)args;
+	for (int j=0;j<NUM_WORK;j++) {
+		int *val = malloc(sizeof(int));
+		*val = (*offset * NUM_WORK) + j;
+		// same key/val
+		hashmap_flat_put(map, val, val);
+	}
+	return NULL;
+}
+
+bool
+multi_thread_add_vals(void) {
+	for (int i=0;i<NUM_THREADS;i++) {
+		int *offset = malloc(sizeof(int));
+		*offset = i;
+		int ret = pthread_create(&threads[i], NULL, add_vals, offset);
+		if (ret != 0) {
+			printf("Failed to create thread %d\n", i);
+			exit(1);
+		}
+	}
+	// wait for work to finish
+	for (int i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_join(threads[i], NULL);
+		if (ret != 0) {
+			printf("Failed to join thread %d\n", i);
+			exit(1);
+		}
+	}
+	return true;
+}
+
+// adds a value over and over to test the del functionality
+void *
+add_val(void *args)
+{
+	for (int j=0;j<NUM_WORK;j++) {
+		hashmap_flat_put(map, &MAX_VAL_PLUS_ONE, &MAX_VAL_PLUS_ONE);
+	}
+	return NULL;
+}
+
+void *
+del_val(void *args)
+{
+	for (int j=0;j<NUM_WORK;j++) {
+		hashmap_flat_del(map, &MAX_VAL_PLUS_ONE);
+	}
+	return NULL;
+}
+
+bool
+multi_thread_del(void) {
+	for (int i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_create(&threads_del[i], NULL, add_val, NULL);
+		if (ret != 0) {
+			printf("Failed to create thread %d\n", i);
+			exit(1);
+		}
+		ret = pthread_create(&threads_del[NUM_THREADS + i], NULL, del_val, NULL);
+		if (ret != 0) {
+			printf("Failed to create thread %d\n", i);
+			exit(1);
+		}
+	}
+	// also add normal numbers to ensure they aren't clobbered
+	multi_thread_add_vals();
+	// wait for work to finish
+	for (int i=0;i<NUM_THREADS * 2;i++) {
+		int ret = pthread_join(threads_del[i], NULL);
+		if (ret != 0) {
+			printf("Failed to join thread %d\n", i);
+			exit(1);
+		}
+	}
+	return true;
+}
+
+// checks that every value added by multi_thread_add_vals() is in the map
+bool
+all_vals_found(void) {
+	uint32_t TOTAL = NUM_THREADS * NUM_WORK;
+	uint32_t found = 0;
+	for (uint32_t i=0;i<TOTAL;i++) {
+		uint32_t *v = (uint32_t *)hashmap_flat_get(map, &i);
+		if (v && *v == i) {
+			found++;
+		}
+		else {
+			printf("Cound not find %d in the map\n", i);
+		}
+	}
+	return found == TOTAL;
+}
+
+bool
+test_add()
+{
+	for (int loops=1;loops<=NUM_LOOPS;loops++) {
+		// sized for exactly the keys that are added
+		map = hashmap_flat_new(NUM_THREADS * NUM_WORK, cmp_uint32, hash_uint32);
+		if (!multi_thread_add_vals()) {
+			printf("Error. Failed to add values!\n");
+			return false;
+		}
+		if (!all_vals_found() || hashmap_flat_length(map) != NUM_THREADS * NUM_WORK) {
+			printf("Loop %d. Not all values found. length=%u\n", loops, hashmap_flat_length(map));
+			return false;
+		}
+	}
+	// adding everything again replaces each value and leaves the length alone
+	if (!multi_thread_add_vals() || !all_vals_found() || hashmap_flat_length(map) != NUM_THREADS * NUM_WORK) {
+		printf("Error. Replacing values changed the map!\n");
+		return false;
+	}
+
+	printf("Done. hashmap_flat_claim_fail=%ld, hashmap_flat_put_full=%ld\n",
+		counter_read(&hashmap_flat_claim_fail), counter_read(&hashmap_flat_put_full));
+	return counter_read(&hashmap_flat_put_full) == 0;
+}
+
+bool
+test_del()
+{
+	for (int loops=1;loops<=NUM_LOOPS;loops++) {
+		// one extra key for MAX_VAL_PLUS_ONE
+		map = hashmap_flat_new(NUM_THREADS * NUM_WORK + 1, cmp_uint32, hash_uint32);
+
+		// multi-thread add values
+		if (!multi_thread_del()) {
+			printf("test_del() is failing. Can't complete multi_thread_del()");
+			return false;
+		}
+		if (!all_vals_found()) {
+			printf("test_del() is failing. Not all values found!?");
+			return false;
+		}
+
+		// whatever is left of the contested key must account for the length
+		uint32_t contested = hashmap_flat_get(map, &MAX_VAL_PLUS_ONE) ? 1 : 0;
+		if (hashmap_flat_length(map) != NUM_THREADS * NUM_WORK + contested) {
+			printf("test_del() is failing. length=%u\n", hashmap_flat_length(map));
+			return false;
+		}
+	}
+	printf("Done. hashmap_flat_del_fail=%ld\n", counter_read(&hashmap_flat_del_fail));
+	return true;
+}
+
+// puts the same keys from every thread at once, so that claims of one key race
+void *
+add_same_vals(void *args)
+{
+	for (uint32_t j=0;j<NUM_WORK;j++) {
+		hashmap_flat_put(map, &((uint32_t *)args)[j], &((uint32_t *)args)[j]);
+	}
+	return NULL;
+}
+
+/**
+ * Racing puts of a key must meet in one slot. A second copy would survive the del
+ */
+bool
+test_same_key()
+{
+	static uint32_t keys[NUM_WORK];
+	for (uint32_t j=0;j<NUM_WORK;j++) {
+		keys[j] = j;
+	}
+	for (int loops=1;loops<=NUM_LOOPS;loops++) {
+		map = hashmap_flat_new(NUM_WORK, cmp_uint32, hash_uint32);
+		for (int i=0;i<NUM_THREADS;i++) {
+			if (pthread_create(&threads[i], NULL, add_same_vals, keys) != 0) {
+				printf("Failed to create thread %d\n", i);
+				exit(1);
+			}
+		}
+		for (int i=0;i<NUM_THREADS;i++) {
+			pthread_join(threads[i], NULL);
+		}
+		if (hashmap_flat_length(map) != NUM_WORK) {
+			printf("test_same_key() is failing. length=%u\n", hashmap_flat_length(map));
+			return false;
+		}
+		for (uint32_t j=0;j<NUM_WORK;j++) {
+			if (!hashmap_flat_del(map, &keys[j]) || hashmap_flat_get(map, &keys[j])) {
+				printf("test_same_key() is failing. key %u was put twice\n", j);
+				return false;
+			}
+		}
+	}
+	printf("Done. racing puts of the same keys\n");
+	return true;
+}
+
+/**
+ * A put claims a key's slot before it publishes the control byte. Gets and dels in
+ * between must still find the key instead of stopping at the slot as if it were empty
+ */
+bool
+test_unpublished()
+{
+	static uint32_t keys[NUM_WORK];
+	map = hashmap_flat_new(NUM_WORK, cmp_uint32, hash_uint32);
+	for (uint32_t j=0;j<NUM_WORK;j++) {
+		keys[j] = j;
+		hashmap_flat_put(map, &keys[j], &keys[j]);
+	}
+	// take back the control bytes, as if every put stalled just before publishing
+	uint32_t slots = map->table->num_groups * HASHMAP_FLAT_GROUP;
+	for (uint32_t i=0;i<slots;i++) {
+		if (map->table->slots[i].key) map->table->ctrl[i] = 0x80;
+	}
+	for (uint32_t j=0;j<NUM_WORK;j++) {
+		if (hashmap_flat_get(map, &keys[j]) != &keys[j]) {
+			printf("test_unpublished() is failing. key %u was not found\n", j);
+			return false;
+		}
+	}
+	for (uint32_t j=0;j<NUM_WORK;j++) {
+		if (hashmap_flat_put(map, &keys[j], &keys[j]) != true || !hashmap_flat_del(map, &keys[j])) {
+			printf("test_unpublished() is failing. key %u was added twice\n", j);
+			return false;
+		}
+	}
+	if (hashmap_flat_length(map) != 0) {
+		printf("test_unpublished() is failing. length=%u\n", hashmap_flat_length(map));
+		return false;
+	}
+	printf("Done. found keys whose slots were not published\n");
+	return true;
+}
+
+/**
+ * Deleted keys keep their slots until the live entries are copied to a new table, so
+ * churning distinct keys through a small working set never fills the map
+ */
+bool
+test_rebuild()
+{
+	static uint32_t keys[NUM_WORK * 100];
+	uint32_t live = NUM_WORK / 2;
+	map = hashmap_flat_new(NUM_WORK, cmp_uint32, hash_uint32);
+	uint32_t num_groups = map->table->num_groups;
+	counter_reset(&hashmap_flat_rebuilds);
+	for (uint32_t i=0;i<NUM_WORK * 100;i++) {
+		keys[i] = i;
+		if (hashmap_flat_put(map, &keys[i], &keys[i]) != false) {
+			printf("test_rebuild() is failing. key %u could not be put\n", i);
+			return false;
+		}
+		if (i >= live && !hashmap_flat_del(map, &keys[i - live])) {
+			printf("test_rebuild() is failing. key %u could not be deleted\n", i - live);
+			return false;
+		}
+	}
+	for (uint32_t i=0;i<NUM_WORK * 100;i++) {
+		void *expected = i >= NUM_WORK * 100 - live ? &keys[i] : NULL;
+		if (hashmap_flat_get(map, &keys[i]) != expected) {
+			printf("test_rebuild() is failing. wrong value for key %u\n", i);
+			return false;
+		}
+	}
+	if (hashmap_flat_length(map) != live || counter_read(&hashmap_flat_rebuilds) == 0 || map->table->num_groups != num_groups) {
+		printf("test_rebuild() is failing. length=%u, rebuilds=%ld, groups=%u\n",
+			hashmap_flat_length(map), counter_read(&hashmap_flat_rebuilds), map->table->num_groups);
+		return false;
+	}
+
+	// putting NULL deletes the key instead of leaving it counted
+	uint32_t *last = &keys[NUM_WORK * 100 - 1];
+	if (hashmap_flat_put(map, last, NULL) != true || hashmap_flat_get(map, last) || hashmap_flat_put(map, last, NULL) != false) {
+		printf("test_rebuild() is failing. put of NULL did not delete\n");
+		return false;
+	}
+	if (hashmap_flat_length(map) != live - 1) {
+		printf("test_rebuild() is failing. length=%u after put of NULL\n", hashmap_flat_length(map));
+		return false;
+	}
+	printf("Done. churned %u keys through %u slots with %ld rebuilds\n",
+		NUM_WORK * 100, num_groups * HASHMAP_FLAT_GROUP, counter_read(&hashmap_flat_rebuilds));
+	return true;
+}
+
+// keys each churning thread puts, and how many of them it keeps at a time
+#define CHURN_KEYS (NUM_WORK * 10)
+#define CHURN_LIVE (NUM_WORK / 4)
+static uint32_t churn_keys[NUM_THREADS * CHURN_KEYS];
+static volatile uint32_t churn_wrong = 0;
+
+/**
+ * Puts the thread's own keys and deletes each one again once it has put
+ * `CHURN_LIVE` more, checking the ones in between are still there
+ */
+void *
+churn(void *args)
+{
+	uint32_t *keys = &churn_keys[(uintptr_t)args * CHURN_KEYS];
+	for (uint32_t j=0;j<CHURN_KEYS;j++) {
+		if (hashmap_flat_put(map, &keys[j], &keys[j]) != false) {
+			__atomic_fetch_add(&churn_wrong, 1, __ATOMIC_SEQ_CST);
+		}
+		if (j >= CHURN_LIVE) {
+			if (hashmap_flat_get(map, &keys[j - CHURN_LIVE / 2]) != &keys[j - CHURN_LIVE / 2]) {
+				__atomic_fetch_add(&churn_wrong, 1, __ATOMIC_SEQ_CST);
+			}
+			if (!hashmap_flat_del(map, &keys[j - CHURN_LIVE])) {
+				__atomic_fetch_add(&churn_wrong, 1, __ATOMIC_SEQ_CST);
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Rebuilds that race with puts, gets and dels of other threads must not lose or
+ * bring back any key. The map starts small, so it also has to grow
+ */
+bool
+test_churn()
+{
+	for (uint32_t i=0;i<NUM_THREADS * CHURN_KEYS;i++) {
+		churn_keys[i] = i;
+	}
+	for (int loops=1;loops<=NUM_LOOPS / 10;loops++) {
+		map = hashmap_flat_new(HASHMAP_FLAT_GROUP, cmp_uint32, hash_uint32);
+		churn_wrong = 0;
+		for (uintptr_t i=0;i<NUM_THREADS;i++) {
+			if (pthread_create(&threads[i], NULL, churn, (void *)i) != 0) {
+				printf("Failed to create thread %lu\n", i);
+				exit(1);
+			}
+		}
+		for (int i=0;i<NUM_THREADS;i++) {
+			pthread_join(threads[i], NULL);
+		}
+		if (churn_wrong) {
+			printf("test_churn() is failing. %u operations returned the wrong result\n", churn_wrong);
+			return false;
+		}
+		for (uint32_t i=0;i<NUM_THREADS * CHURN_KEYS;i++) {
+			void *expected = i % CHURN_KEYS >= CHURN_KEYS - CHURN_LIVE ? &churn_keys[i] : NULL;
+			if (hashmap_flat_get(map, &churn_keys[i]) != expected) {
+				printf("test_churn() is failing. wrong value for key %u\n", i);
+				return false;
+			}
+		}
+		if (hashmap_flat_length(map) != NUM_THREADS * CHURN_LIVE) {
+			printf("test_churn() is failing. length=%u\n", hashmap_flat_length(map));
+			return false;
+		}
+	}
+	printf("Done. %u threads churned %u keys each with %ld rebuilds\n",
+		NUM_THREADS, CHURN_KEYS, counter_read(&hashmap_flat_rebuilds));
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	free_later_init();
+
+	if (!test_add()) {
+		printf("Failed multi-threaded add test.");
+	}
+	if (!test_del()) {
+		printf("Failed multi-threaded del test.");
+	}
+	if (!test_same_key()) {
+		printf("Failed multi-threaded same key test.");
+	}
+	if (!test_unpublished()) {
+		printf("Failed unpublished slot test.");
+	}
+	if (!test_rebuild()) {
+		printf("Failed rebuild test.");
+	}
+	if (!test_churn()) {
+		printf("Failed multi-threaded churn test.");
+	}
+
+	free_later_term();
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "free_later.h"
+#include "hashmap_typed.h"
+
+// integer keys and values, stored in the nodes
+HASHMAP_TYPED(u64map, uint64_t, uint64_t, hashmap_typed_hash_u64, hashmap_typed_eq)
+// string keys, which stay owned by the caller
+HASHMAP_TYPED(strmap, const char *, int32_t, hashmap_typed_hash_str, hashmap_typed_eq_str)
+
+// global hash map
+u64map *map = NULL;
+
+// how many threads should run in parallel
+#define NUM_THREADS 8
+// how many keys each thread owns
+#define NUM_WORK 20000
+// how many times the multi-threaded tests should repeat
+#define NUM_LOOPS 5
+// state for the threads
+static pthread_t threads[NUM_THREADS];
+
+static volatile uint32_t wrong = 0;
+
+/**
+ * Puts the thread's own keys, starting from a small table so that it resizes, then
+ * replaces and deletes every other one. Other threads read the keys at the same time
+ */
+void *
+churn(void *args)
+{
+	uint64_t offset = (uintptr_t)args * NUM_WORK;
+	for (uint64_t j=0;j<NUM_WORK;j++) {
+		if (u64map_put(map, offset + j, (offset + j) * 2, NULL)) {
+			__atomic_fetch_add(&wrong, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	for (uint64_t j=0;j<NUM_WORK;j++) {
+		uint64_t key = offset + j;
+		uint64_t value, old;
+		// a key of another thread is either missing or has one of its two values
+		uint64_t other = (key + NUM_WORK) % (NUM_THREADS * NUM_WORK);
+		if (u64map_get(map, other, &value) && value != other * 2 && value != other * 3) {
+			__atomic_fetch_add(&wrong, 1, __ATOMIC_SEQ_CST);
+		}
+		if (j % 2 == 0) {
+			if (!u64map_put(map, key, key * 3, &old) || old != key * 2) {
+				__atomic_fetch_add(&wrong, 1, __ATOMIC_SEQ_CST);
+			}
+		}
+		else if (!u64map_del(map, key, &old) || old != key * 2) {
+			__atomic_fetch_add(&wrong, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	return NULL;
+}
+
+bool
+test_churn()
+{
+	for (int loop=0;loop<NUM_LOOPS;loop++) {
+		map = u64map_new(16);
+		wrong = 0;
+		for (uintptr_t i=0;i<NUM_THREADS;i++) {
+			if (pthread_create(&threads[i], NULL, churn, (void *)i) != 0) {
+				printf("Failed to create thread %lu\n", i);
+				exit(1);
+			}
+		}
+		for (int i=0;i<NUM_THREADS;i++) {
+			pthread_join(threads[i], NULL);
+		}
+
+		if (wrong) {
+			printf("test_churn() is failing. %u operations returned the wrong result\n", wrong);
+			return false;
+		}
+		for (uint64_t key=0;key<NUM_THREADS * NUM_WORK;key++) {
+			uint64_t value;
+			bool found = u64map_get(map, key, &value);
+			if (key % 2 == 0 ? !found || value != key * 3 : found) {
+				printf("test_churn() is failing. key %lu\n", key);
+				return false;
+			}
+		}
+		if (u64map_length(map) != NUM_THREADS * NUM_WORK / 2) {
+			printf("test_churn() is failing. length %u\n", u64map_length(map));
+			return false;
+		}
+		u64map_free(&map);
+	}
+	printf("Done. %u threads put, replaced and deleted %u keys %u times\n", NUM_THREADS, NUM_THREADS * NUM_WORK, NUM_LOOPS);
+	return true;
+}
+
+/**
+ * Claims every group of a resize without migrating it, as a thread that stalls right
+ * after claiming would. Later puts have to finish the resize anyway
+ */
+bool
+test_stalled_resize()
+{
+	map = u64map_new(2);
+	uint64_t added = 0;
+	while (added < NUM_WORK && !map->table->next) {
+		u64map_put(map, added, added, NULL);
+		added++;
+	}
+	u64map_table *stalled = map->table;
+	if (!stalled->next) {
+		printf("test_stalled_resize() is failing. Table never started to grow\n");
+		return false;
+	}
+	stalled->migrate_next = stalled->num_buckets;
+
+	while (added < NUM_WORK) {
+		u64map_put(map, added, added, NULL);
+		added++;
+	}
+	if (map->table == stalled) {
+		printf("test_stalled_resize() is failing. Resize never finished\n");
+		return false;
+	}
+	for (uint64_t key=0;key<NUM_WORK;key++) {
+		uint64_t value;
+		if (!u64map_get(map, key, &value) || value != key) {
+			printf("test_stalled_resize() is failing. key %lu\n", key);
+			return false;
+		}
+	}
+	u64map_free(&map);
+	printf("Done. Resize finished with every group claimed\n");
+	return true;
+}
+
+/**
+ * Keys are compared with `eq_fn`, not by address
+ */
+bool
+test_strings()
+{
+	strmap *m = strmap_new(4);
+	char a[] = "alpha", b[] = "beta";
+	int32_t value;
+	if (!strmap_put_if_absent(m, a, 1) || !strmap_put_if_absent(m, b, 2) || strmap_put_if_absent(m, "alpha", 3)) {
+		printf("test_strings() is failing. put_if_absent\n");
+		return false;
+	}
+	if (!strmap_get(m, "alpha", &value) || value != 1 || !strmap_get(m, "beta", &value) || value != 2 || strmap_get(m, "gamma", &value)) {
+		printf("test_strings() is failing. get\n");
+		return false;
+	}
+	if (!strmap_del(m, "beta", NULL) || strmap_del(m, "beta", NULL) || strmap_length(m) != 1) {
+		printf("test_strings() is failing. del\n");
+		return false;
+	}
+	strmap_free(&m);
+	printf("Done. string keys\n");
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	free_later_init();
+	if (!test_churn()) {
+		printf("Failed multi-threaded churn test.");
+	}
+	if (!test_stalled_resize()) {
+		printf("Failed stalled resize test.");
+	}
+	if (!test_strings()) {
+		printf("Failed string key test.");
+	}
+	free_later_term();
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hazard.h"
+
+// how many threads should run in parallel
+#define NUM_THREADS 10
+// how many times the work loop should repeat
+#define NUM_WORK 10000
+// state for the threads
+static pthread_t threads[NUM_THREADS];
+
+#define ALIVE 0x11111111
+#define DEAD 0xdeadbeef
+
+// shared object that writers keep replacing and readers keep checking
+typedef struct box_s {
+	volatile uint32_t magic;
+	uint32_t value;
+} box;
+
+static hazard_domain *domain = NULL;
+static box *current = NULL;
+
+static volatile uint32_t retired = 0;
+static volatile uint32_t released = 0;
+static volatile uint32_t most_pending = 0;
+static volatile uint32_t bad_reads = 0;
+static volatile bool writing = true;
+
+void
+release_box(void *var)
+{
+	box *b = var;
+	// poison it so that a reader that still had it would notice
+	b->magic = DEAD;
+	__atomic_fetch_add(&released, 1, __ATOMIC_SEQ_CST);
+	free(b);
+}
+
+/**
+ * Swaps in a new box and retires the old one, tracking how many are still waiting
+ */
+void *
+write_boxes(void *args)
+{
+	for (int j=0;j<NUM_WORK;j++) {
+		box *b = malloc(sizeof(box));
+		b->magic = ALIVE;
+		b->value = j;
+		box *old = __atomic_exchange_n(&current, b, __ATOMIC_SEQ_CST);
+		hazard_retire(domain, old, release_box);
+
+		// a scan of another thread may release boxes it retired after this count was
+		// taken, so the difference can briefly go below 0
+		int32_t pending = __atomic_add_fetch(&retired, 1, __ATOMIC_SEQ_CST) - released;
+		if (pending > (int32_t)most_pending) most_pending = pending;
+	}
+	return NULL;
+}
+
+/**
+ * Protects the current box and checks it a few times, yielding in between
+ */
+void *
+read_boxes(void *args)
+{
+	void **slot = hazard_acquire(domain);
+	while (writing) {
+		box *b = hazard_protect(slot, (void **)&current);
+		for (int k=0;k<3;k++) {
+			if (b->magic != ALIVE) {
+				__atomic_fetch_add(&bad_reads, 1, __ATOMIC_SEQ_CST);
+			}
+			sched_yield();
+		}
+	}
+	hazard_release(slot);
+	return NULL;
+}
+
+/**
+ * Holds one box for the whole test, like a reader blocked on I/O
+ */
+void *
+read_slowly(void *args)
+{
+	void **slot = hazard_acquire(domain);
+	box *b = hazard_protect(slot, (void **)&current);
+	while (writing) {
+		sched_yield();
+	}
+	if (b->magic != ALIVE) {
+		__atomic_fetch_add(&bad_reads, 1, __ATOMIC_SEQ_CST);
+	}
+	hazard_release(slot);
+	return NULL;
+}
+
+bool
+test_reclaim(void)
+{
+	domain = hazard_new();
+	current = malloc(sizeof(box));
+	current->magic = ALIVE;
+
+	// half writers, the rest readers and one slow reader
+	for (uintptr_t i=0;i<NUM_THREADS;i++) {
+		void *(*fn)(void *) = i == 0 ? read_slowly : i % 2 ? write_boxes : read_boxes;
+		int ret = pthread_create(&threads[i], NULL, fn, (void *)i);
+		if (ret != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	// wait for the writers, then the readers
+	for (int i=1;i<NUM_THREADS;i+=2) {
+		pthread_join(threads[i], NULL);
+	}
+	writing = false;
+	for (int i=0;i<NUM_THREADS;i+=2) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if (bad_reads) {
+		printf("test_reclaim() is failing. %u reads saw a released box\n", bad_reads);
+		return false;
+	}
+	// a reader holding one box must not keep the others from being released
+	uint32_t bound = NUM_THREADS * 2 * hazard_scan_limit(domain);
+	if (most_pending > bound) {
+		printf("test_reclaim() is failing. %u boxes were waiting at once, more than %u\n", most_pending, bound);
+		return false;
+	}
+	// the exited threads' boxes are released by the next scan
+	hazard_scan(domain);
+	if (released != retired) {
+		printf("test_reclaim() is failing. %u of %u boxes were released\n", released, retired);
+		return false;
+	}
+
+	printf("Done. Released %u boxes with at most %u waiting\n", released, most_pending);
+	return true;
+}
+
+// more domains than a thread caches records for
+#define NUM_HELD 8
+
+/**
+ * A thread that holds slots in many domains re-uses its record in one more domain
+ * instead of claiming a new one on every call
+ */
+bool
+test_many_domains(void)
+{
+	hazard_domain *held[NUM_HELD];
+	void **slots[NUM_HELD];
+	for (int i=0;i<NUM_HELD;i++) {
+		held[i] = hazard_new();
+		slots[i] = hazard_acquire(held[i]);
+	}
+
+	hazard_domain *d = hazard_new();
+	for (int j=0;j<NUM_WORK;j++) {
+		void **slot = hazard_acquire(d);
+		hazard_release(slot);
+		hazard_retire(d, malloc(sizeof(box)), free);
+	}
+	uint32_t records = d->num_records;
+	hazard_scan(d);
+	for (int i=0;i<NUM_HELD;i++) {
+		hazard_release(slots[i]);
+	}
+
+	if (records != 1) {
+		printf("test_many_domains() is failing. One thread made %u records\n", records);
+		return false;
+	}
+	printf("Done. One record served %u acquires while %u domains were held\n", NUM_WORK, NUM_HELD);
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	if (!test_reclaim()) {
+		printf("Failed multi-threaded reclaim test.");
+	}
+	if (!test_many_domains()) {
+		printf("Failed many domains test.");
+	}
+}
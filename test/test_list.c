@@ -5,11 +5,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "free_later.h"
 #include "list.h"
 
 // global hash map
 list *l = NULL;
 
+extern counter list_retries_empty;
+extern counter list_retries_populated;
+
 // how many threads should run in parallel
 #define NUM_THREADS 10
 // how many times the work loop should repeat
@@ -54,6 +58,161 @@ multi_thread_add_vals(void) {
 	return true;
 }
 
+// values shared by the pop test, each marked while a thread holds it
+#define NUM_VALS 64
+#define NUM_POPS 100000
+static uint32_t held[NUM_VALS];
+static volatile uint32_t double_pops = 0;
+static volatile uint32_t empty_pops = 0;
+
+/**
+ * Uses the list as a pool, popping a value and adding it back over and over. A value
+ * popped by two threads at once means a pop was fooled by a recycled node
+ */
+void *
+pop_vals(void *args)
+{
+	for (int j=0;j<NUM_POPS;j++) {
+		uint32_t *val = list_pop(l);
+		if (!val) {
+			__atomic_fetch_add(&empty_pops, 1, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (__atomic_exchange_n(val, 1, __ATOMIC_SEQ_CST) != 0) {
+			__atomic_fetch_add(&double_pops, 1, __ATOMIC_SEQ_CST);
+		}
+		__atomic_store_n(val, 0, __ATOMIC_SEQ_CST);
+		list_add(l, val);
+	}
+	return NULL;
+}
+
+bool
+test_pop(void)
+{
+	l = list_new();
+	for (int i=0;i<NUM_VALS;i++) {
+		list_add(l, &held[i]);
+	}
+	for (int i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_create(&threads[i], NULL, pop_vals, NULL);
+		if (ret != 0) {
+			printf("Failed to create thread %d\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_THREADS;i++) {
+		pthread_join(threads[i], NULL);
+	}
+	if (double_pops) {
+		printf("test_pop() is failing. %u values were popped twice\n", double_pops);
+		return false;
+	}
+
+	// every value is back exactly once
+	if (counter_read(&l->length) != NUM_VALS) {
+		printf("test_pop() is failing. length=%ld\n", (long)counter_read(&l->length));
+		return false;
+	}
+	uint8_t checks[NUM_VALS] = {0};
+	list_node *nodes = list_pop_all(l);
+	for (list_node *n = nodes; n; n = n->next) {
+		checks[(uint32_t *)n->val - held] += 1;
+	}
+	list_free_nodes(l, nodes);
+	for (int i=0;i<NUM_VALS;i++) {
+		if (checks[i] != 1) {
+			printf("test_pop() is failing. check[%d]: %d\n", i, checks[i]);
+			return false;
+		}
+	}
+	if (l->head || list_pop(l) || counter_read(&l->length) != 0) {
+		printf("test_pop() is failing. The list isn't empty after list_pop_all\n");
+		return false;
+	}
+	printf("Done. %u threads popped and re-added %u values %u times each, %u found it empty\n", NUM_THREADS, NUM_VALS, NUM_POPS, empty_pops);
+	return true;
+}
+
+// second list that chains are moved into
+list *l2 = NULL;
+#define CHAIN 100
+
+/**
+ * Builds chains of values and adds each with one CAS, then drains whichever list it
+ * finds values in and moves them to the other one
+ */
+void *
+chain_vals(void *args)
+{
+	uintptr_t offset = (uintptr_t)args;
+	for (int j=0;j<NUM_WORK;j++) {
+		list_node *chain = NULL;
+		for (int i=CHAIN-1;i>=0;i--) {
+			list_node *n = list_new_node(l, (void *)(offset * NUM_WORK * CHAIN + j * CHAIN + i));
+			n->next = chain;
+			chain = n;
+		}
+		list_add_chain(l, chain);
+
+		list_node *taken = list_pop_all(j % 2 ? l : l2);
+		list_add_chain(j % 2 ? l2 : l, taken);
+	}
+	return NULL;
+}
+
+bool
+test_chain(void)
+{
+	l = list_new();
+	l2 = list_new();
+
+	// a chain keeps its order
+	list_node *chain = list_new_node(l, (void *)1);
+	chain->next = list_new_node(l, (void *)2);
+	list_add_chain(l, chain);
+	if (list_pop(l) != (void *)1 || list_pop(l) != (void *)2 || list_pop(l) != NULL) {
+		printf("test_chain() is failing. The chain lost its order\n");
+		return false;
+	}
+
+	for (uintptr_t i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_create(&threads[i], NULL, chain_vals, (void *)i);
+		if (ret != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_THREADS;i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// every value ended up in one of the lists exactly once
+	uint32_t TOTAL = NUM_THREADS * NUM_WORK * CHAIN;
+	if (counter_read(&l->length) + counter_read(&l2->length) != TOTAL) {
+		printf("test_chain() is failing. length=%ld+%ld\n", (long)counter_read(&l->length), (long)counter_read(&l2->length));
+		return false;
+	}
+	uint8_t *checks = calloc(TOTAL, sizeof(uint8_t));
+	list *lists[2] = { l, l2 };
+	for (int i=0;i<2;i++) {
+		list_node *nodes = list_pop_all(lists[i]);
+		for (list_node *n = nodes; n; n = n->next) {
+			checks[(uintptr_t)n->val] += 1;
+		}
+		list_free_nodes(lists[i], nodes);
+	}
+	for (uint32_t i=0;i<TOTAL;i++) {
+		if (checks[i] != 1) {
+			printf("test_chain() is failing. check[%u]: %d\n", i, checks[i]);
+			return false;
+		}
+	}
+	free(checks);
+	printf("Done. %u threads added and moved %u values in chains of %u\n", NUM_THREADS, TOTAL, CHAIN);
+	return true;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -61,7 +220,7 @@ main (int argc, char **argv)
 
 	printf("Adding Values\n");
 	int loops = 0;
-	while (l->retries_empty < 10 && l->retries_populated < 10) {
+	while (counter_read(&list_retries_empty) < 10 && counter_read(&list_retries_populated) < 10) {
 		loops += 1;
 		printf("Trying for CAS-fail retry: %d\n", loops);
 		if (!multi_thread_add_vals()) {
@@ -95,4 +254,12 @@ main (int argc, char **argv)
 	printf("Valid: %d, Invalid: %d\n", valid_checks, invalid_checks);
 
 	printf("Done\n");
+
+	if (!test_pop()) {
+		printf("Failed multi-threaded pop test.");
+	}
+	if (!test_chain()) {
+		printf("Failed multi-threaded chain test.");
+	}
+	free_later_term();
 }
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "mempool.h"
+
+// global pool
+mempool *pool = NULL;
+
+// how many threads should run in parallel
+#define NUM_THREADS 10
+// how many allocations each thread makes
+#define NUM_WORK 10000
+// state for the threads
+static pthread_t threads[NUM_THREADS];
+
+static volatile uint32_t bad_allocs = 0;
+
+/**
+ * Allocates a mix of small and large blocks and fills each one with the thread's id.
+ * Afterwards every block must still hold only that id, or two threads were given
+ * overlapping memory
+ */
+void *
+alloc_vals(void *args)
+{
+	uint8_t id = (uintptr_t)args + 1;
+	uint8_t **blocks = malloc(NUM_WORK * sizeof(uint8_t *));
+	uint32_t *sizes = malloc(NUM_WORK * sizeof(uint32_t));
+	for (uint32_t j=0;j<NUM_WORK;j++) {
+		// every 100th block is too large for a thread's region
+		sizes[j] = j % 100 == 0 ? pool->region_size : 1 + j % 200;
+		blocks[j] = mempool_alloc(pool, sizes[j]);
+		if (!blocks[j] || (uintptr_t)blocks[j] % sizeof(void *) != 0) {
+			__atomic_fetch_add(&bad_allocs, 1, __ATOMIC_SEQ_CST);
+			return NULL;
+		}
+		memset(blocks[j], id, sizes[j]);
+	}
+	for (uint32_t j=0;j<NUM_WORK;j++) {
+		for (uint32_t i=0;i<sizes[j];i++) {
+			if (blocks[j][i] != id) {
+				__atomic_fetch_add(&bad_allocs, 1, __ATOMIC_SEQ_CST);
+				break;
+			}
+		}
+	}
+	free(blocks);
+	free(sizes);
+	return NULL;
+}
+
+bool
+test_alloc(mempool *p)
+{
+	pool = p;
+	for (uintptr_t i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_create(&threads[i], NULL, alloc_vals, (void *)i);
+		if (ret != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_THREADS;i++) {
+		pthread_join(threads[i], NULL);
+	}
+	if (bad_allocs) {
+		printf("test_alloc() is failing. %u blocks were shared or misaligned\n", bad_allocs);
+		return false;
+	}
+
+	uint32_t chunks = 0;
+	for (mempool_chunk *c = pool->chunks; c; c = c->next) chunks++;
+	for (int i=0;i<MEMPOOL_NODES;i++) {
+		for (mempool_chunk *c = pool->node_chunks[i]; c; c = c->next) chunks++;
+	}
+	// mapped chunks are whole hugepages
+	if ((pool->flags & MEMPOOL_HUGEPAGES) && pool->reserved % MEMPOOL_HUGEPAGE != 0) {
+		printf("test_alloc() is failing. %lu bytes aren't whole hugepages\n", pool->reserved);
+		return false;
+	}
+	printf("Done. %u threads allocated %u blocks each from %u %s chunks, cas_alloc_retries=%ld\n", NUM_THREADS, NUM_WORK, chunks, pool->flags ? "mapped" : "malloc'd", (long)counter_read(&pool->cas_alloc_retries));
+	mempool_free(&pool);
+	return true;
+}
+
+// how many blocks each thread holds at once while churning
+#define NUM_HELD 200
+#define NUM_ROUNDS 200
+
+/**
+ * Allocates blocks of mixed sizes, checks nobody else was given them and releases them
+ */
+void *
+churn(void *args)
+{
+	uint8_t id = (uintptr_t)args + 1;
+	uint8_t *blocks[NUM_HELD];
+	uint32_t sizes[NUM_HELD];
+	for (uint32_t j=0;j<NUM_ROUNDS;j++) {
+		for (uint32_t i=0;i<NUM_HELD;i++) {
+			sizes[i] = i % 50 == 0 ? 6000 : 1 + (i * 37 + j) % 2000;
+			blocks[i] = mempool_alloc(pool, sizes[i]);
+			memset(blocks[i], id, sizes[i]);
+		}
+		for (uint32_t i=0;i<NUM_HELD;i++) {
+			for (uint32_t k=0;k<sizes[i];k++) {
+				if (blocks[i][k] != id) {
+					__atomic_fetch_add(&bad_allocs, 1, __ATOMIC_SEQ_CST);
+					break;
+				}
+			}
+			mempool_release(pool, blocks[i], sizes[i]);
+		}
+	}
+	return NULL;
+}
+
+bool
+test_release(void)
+{
+	// blocks are rounded up to their class, so each one fits the next request of its class
+	pool = mempool_new_flags(10 * 1024, 3, MEMPOOL_RELEASE);
+	mempool_usage usage;
+	uint64_t reserved[2];
+	// the second run re-uses what the first one released
+	for (int run=0;run<2;run++) {
+		for (uintptr_t i=0;i<NUM_THREADS;i++) {
+			int ret = pthread_create(&threads[i], NULL, churn, (void *)i);
+			if (ret != 0) {
+				printf("Failed to create thread %lu\n", i);
+				exit(1);
+			}
+		}
+		for (int i=0;i<NUM_THREADS;i++) {
+			pthread_join(threads[i], NULL);
+		}
+		mempool_stats(pool, &usage);
+		reserved[run] = usage.reserved;
+	}
+	if (bad_allocs) {
+		printf("test_release() is failing. %u blocks were shared\n", bad_allocs);
+		return false;
+	}
+	if (usage.in_use != 0 || usage.free <= 0) {
+		printf("test_release() is failing. in_use=%ld free=%ld\n", (long)usage.in_use, (long)usage.free);
+		return false;
+	}
+	// threads hold different mixes of classes at different times, so a little growth is
+	// expected before every class has enough blocks of its own
+	if (reserved[1] > reserved[0] + reserved[0] / 4) {
+		printf("test_release() is failing. Memory kept growing from %lu to %lu bytes\n", reserved[0], reserved[1]);
+		return false;
+	}
+	printf("Done. Churned %u blocks. Reserved %lu then %lu bytes, %ld free\n", 2 * NUM_THREADS * NUM_HELD * NUM_ROUNDS, reserved[0], reserved[1], (long)usage.free);
+	mempool_free(&pool);
+	return true;
+}
+
+/**
+ * Allocates a mix of sizes that often don't fit what is left of the newest chunk, and
+ * checks how much of the reserved memory ends up unused
+ */
+bool
+test_waste(void)
+{
+	pool = mempool_new_default();
+	uint32_t sizes[] = { 24, 700, 3000, 100, 1800, 5200, 40, 2500 };
+	uint32_t num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	// measured against the bytes asked for, so that padding counts as waste too
+	uint64_t requested = 0;
+	for (uint32_t j=0;j<NUM_WORK;j++) {
+		uint8_t *block = mempool_alloc(pool, sizes[j % num_sizes]);
+		memset(block, 1, sizes[j % num_sizes]);
+		requested += sizes[j % num_sizes];
+	}
+	mempool_usage usage;
+	mempool_stats(pool, &usage);
+	double waste = 1.0 - (double)requested / usage.reserved;
+	if (waste > 0.15) {
+		printf("test_waste() is failing. %.1f%% of %lu reserved bytes are unused\n", waste * 100, usage.reserved);
+		return false;
+	}
+	printf("Done. %.1f%% of %lu reserved bytes are unused\n", waste * 100, usage.reserved);
+	mempool_free(&pool);
+	return true;
+}
+
+#define NUM_REQUESTS 1000
+
+/**
+ * Uses the pool as an arena per request, rewinding after each one. After the first
+ * request no new chunks should be needed
+ */
+bool
+test_rewind(void)
+{
+	pool = mempool_new_default();
+	// allocated before the mark and has to survive every rewind
+	uint8_t *kept = mempool_alloc(pool, 100);
+	memset(kept, 7, 100);
+
+	mempool_savepoint mark;
+	mempool_mark(pool, &mark);
+	uint64_t reserved = 0;
+	for (uint32_t j=0;j<NUM_REQUESTS;j++) {
+		for (uint32_t i=0;i<100;i++) {
+			// one block per request is large enough for a chunk of its own
+			uint32_t size = i == 50 ? 6000 : 1 + (i * 37) % 3000;
+			uint8_t *block = mempool_alloc(pool, size);
+			memset(block, 1, size);
+			if (i % 10 == 0) mempool_release(pool, block, size);
+		}
+		mempool_rewind(pool, &mark);
+		if (j == 0) reserved = pool->reserved;
+	}
+	for (uint32_t i=0;i<100;i++) {
+		if (kept[i] != 7) {
+			printf("test_rewind() is failing. Memory from before the mark was handed out again\n");
+			return false;
+		}
+	}
+	if (pool->reserved != reserved) {
+		printf("test_rewind() is failing. Memory grew from %lu to %lu bytes\n", reserved, pool->reserved);
+		return false;
+	}
+	mempool_usage usage;
+	mempool_stats(pool, &usage);
+	// the block from before the mark, padded for alignment
+	if (usage.in_use != 104 || usage.free != 0) {
+		printf("test_rewind() is failing. in_use=%ld free=%ld after rewinding\n", (long)usage.in_use, (long)usage.free);
+		return false;
+	}
+
+	// keep one chunk and let the rest go
+	mempool_reset(pool, 1);
+	uint32_t chunks = 0;
+	for (mempool_chunk *c = pool->spare; c; c = c->next) chunks++;
+	if (pool->chunks || chunks != 1 || pool->reserved != pool->spare->limit - (uint8_t *)pool->spare) {
+		printf("test_rewind() is failing. %u chunks and %lu bytes after reset\n", chunks, pool->reserved);
+		return false;
+	}
+	printf("Done. Rewound %u requests within %lu bytes\n", NUM_REQUESTS, reserved);
+	mempool_free(&pool);
+	return true;
+}
+
+/**
+ * Rewinds requests larger than a chunk, and ones that get a regular chunk of their
+ * own. Their chunks have to become spares and serve the next request
+ */
+bool
+test_rewind_large(void)
+{
+	pool = mempool_new(4096, 3);
+	mempool_alloc(pool, 100);
+
+	mempool_savepoint mark;
+	mempool_mark(pool, &mark);
+	uint64_t reserved = 0;
+	uint32_t sizes[] = {10000, 3000};
+	for (uint32_t j=0;j<NUM_REQUESTS;j++) {
+		for (uint32_t i=0;i<2;i++) {
+			uint8_t *block = mempool_alloc(pool, sizes[i]);
+			memset(block, 1, sizes[i]);
+			mempool_alloc(pool, 200);
+		}
+		mempool_rewind(pool, &mark);
+		if (j == 0) reserved = pool->reserved;
+	}
+	if (pool->reserved != reserved) {
+		printf("test_rewind_large() is failing. Memory grew from %lu to %lu bytes\n", reserved, pool->reserved);
+		return false;
+	}
+	mempool_usage usage;
+	mempool_stats(pool, &usage);
+	if (usage.in_use != 104) {
+		printf("test_rewind_large() is failing. in_use=%ld after rewinding\n", (long)usage.in_use);
+		return false;
+	}
+	printf("Done. Rewound %u requests larger than a chunk within %lu bytes\n", NUM_REQUESTS, reserved);
+	mempool_free(&pool);
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	if (!test_alloc(mempool_new_default())) {
+		printf("Failed multi-threaded alloc test.");
+	}
+	// 1 MiB chunks on this thread's node, with hugepages if the system has them
+	if (!test_alloc(mempool_new_mapped(1024 * 1024, 3, MEMPOOL_HUGEPAGES | MEMPOOL_NUMA_LOCAL))) {
+		printf("Failed multi-threaded mapped alloc test.");
+	}
+	if (!test_release()) {
+		printf("Failed multi-threaded release test.");
+	}
+	if (!test_waste()) {
+		printf("Failed waste test.");
+	}
+	if (!test_rewind()) {
+		printf("Failed rewind test.");
+	}
+	if (!test_rewind_large()) {
+		printf("Failed large rewind test.");
+	}
+}
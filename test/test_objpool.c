@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "objpool.h"
+#include "list.h"
+
+// global pool
+objpool *pool = NULL;
+
+// how many threads should run in parallel
+#define NUM_THREADS 10
+// how many objects each thread holds at once
+#define NUM_HELD 100
+// how many times the work loop should repeat
+#define NUM_WORK 1000
+// state for the threads
+static pthread_t threads[NUM_THREADS];
+
+// objects are stamped by whoever holds them to catch one being handed out twice
+typedef struct stamp_s {
+	uint64_t owner;
+	uint64_t seq;
+	uint64_t pad[2];
+} stamp;
+
+static volatile uint32_t bad_objects = 0;
+
+/**
+ * Takes a handful of objects, checks nobody else was given them and hands them back.
+ * Odd threads free their objects through the pool, even threads through the object.
+ */
+void *
+churn(void *args)
+{
+	uint64_t id = (uintptr_t)args;
+	stamp *held[NUM_HELD];
+	for (int j=0;j<NUM_WORK;j++) {
+		for (int i=0;i<NUM_HELD;i++) {
+			held[i] = objpool_alloc(pool);
+			if (!held[i] || (uintptr_t)held[i] % 16 != 0) {
+				__atomic_fetch_add(&bad_objects, 1, __ATOMIC_SEQ_CST);
+				return NULL;
+			}
+			held[i]->owner = id;
+			held[i]->seq = j;
+		}
+		sched_yield();
+		for (int i=0;i<NUM_HELD;i++) {
+			if (held[i]->owner != id || held[i]->seq != j) {
+				__atomic_fetch_add(&bad_objects, 1, __ATOMIC_SEQ_CST);
+			}
+			if (id % 2) {
+				objpool_free(pool, held[i]);
+			}
+			else {
+				objpool_release(held[i]);
+			}
+		}
+	}
+	return NULL;
+}
+
+bool
+test_churn(void)
+{
+	pool = objpool_new(sizeof(stamp));
+	for (uintptr_t i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_create(&threads[i], NULL, churn, (void *)i);
+		if (ret != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	// wait for work to finish
+	for (int i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_join(threads[i], NULL);
+		if (ret != 0) {
+			printf("Failed to join thread %d\n", i);
+			exit(1);
+		}
+	}
+	if (bad_objects) {
+		printf("test_churn() is failing. %u objects were shared or misaligned\n", bad_objects);
+		return false;
+	}
+
+	// objects are re-used, so all that churn only needed about as many as were held
+	uint32_t chunks = 0;
+	for (void **c = pool->chunks; c; c = c[1]) chunks++;
+	uint32_t per_chunk = (OBJPOOL_CHUNK - 64) / pool->size;
+	if (chunks > (NUM_THREADS * NUM_HELD + NUM_THREADS * OBJPOOL_CACHE) / per_chunk + NUM_THREADS) {
+		printf("test_churn() is failing. Objects aren't re-used, %u chunks\n", chunks);
+		return false;
+	}
+	objpool_free_all(&pool);
+	printf("Done. %u threads churned %u objects each using %u chunks\n", NUM_THREADS, NUM_HELD * NUM_WORK, chunks);
+	return true;
+}
+
+// list whose nodes come from the pool
+list *l = NULL;
+
+void *
+add_vals(void *args)
+{
+	uintptr_t offset = (uintptr_t)args;
+	for (uintptr_t j=0;j<NUM_WORK;j++) {
+		list_add(l, (void *)(offset * NUM_WORK + j));
+	}
+	return NULL;
+}
+
+bool
+test_list(void)
+{
+	pool = objpool_new(sizeof(list_node));
+	l = list_new_pool(pool);
+	for (uintptr_t i=0;i<NUM_THREADS;i++) {
+		int ret = pthread_create(&threads[i], NULL, add_vals, (void *)i);
+		if (ret != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_THREADS;i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// check all the list entries
+	uint32_t TOTAL = NUM_THREADS * NUM_WORK;
+	uint8_t *checks = calloc(TOTAL, sizeof(uint8_t));
+	for (list_node *n = l->head; n; n = n->next) {
+		checks[(uintptr_t)n->val] += 1;
+	}
+	for (uint32_t i=0;i<TOTAL;i++) {
+		if (checks[i] != 1) {
+			printf("test_list() is failing. check[%u]: %d\n", i, checks[i]);
+			return false;
+		}
+	}
+	free(checks);
+	objpool_free_all(&pool);
+	printf("Done. Added %u pooled list nodes\n", TOTAL);
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	if (!test_churn()) {
+		printf("Failed multi-threaded churn test.");
+	}
+	if (!test_list()) {
+		printf("Failed pooled list test.");
+	}
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "free_later.h"
+#include "objpool.h"
+#include "queue.h"
+
+// global queue
+queue *q = NULL;
+
+// how many threads enqueue and how many dequeue
+#define NUM_PRODUCERS 4
+#define NUM_CONSUMERS 4
+// how many values each producer enqueues
+#define NUM_WORK 100000
+// state for the threads
+static pthread_t producers[NUM_PRODUCERS];
+static pthread_t consumers[NUM_CONSUMERS];
+
+// values are `producer << 32 | seq`, plus one so that none of them is NULL
+#define VAL(p, seq) ((void *)(((uintptr_t)(p) << 32 | (seq)) + 1))
+#define VAL_PRODUCER(v) (((uintptr_t)(v) - 1) >> 32)
+#define VAL_SEQ(v) (((uintptr_t)(v) - 1) & 0xffffffff)
+
+static uint8_t *seen = NULL;
+static volatile uint32_t dequeued = 0;
+static volatile uint32_t out_of_order = 0;
+
+void *
+produce(void *args)
+{
+	uintptr_t id = (uintptr_t)args;
+	for (uint32_t j=0;j<NUM_WORK;j++) {
+		queue_enqueue(q, VAL(id, j));
+	}
+	return NULL;
+}
+
+/**
+ * Dequeues until every value is out. Values of one producer must come out in the order
+ * they went in, so each consumer only ever sees a producer's sequence numbers grow
+ */
+void *
+consume(void *args)
+{
+	int64_t last[NUM_PRODUCERS];
+	for (int i=0;i<NUM_PRODUCERS;i++) last[i] = -1;
+	while (__atomic_load_n(&dequeued, __ATOMIC_SEQ_CST) < NUM_PRODUCERS * NUM_WORK) {
+		void *v = queue_dequeue(q);
+		if (!v) continue;
+		uintptr_t p = VAL_PRODUCER(v);
+		int64_t seq = VAL_SEQ(v);
+		if (seq <= last[p]) {
+			__atomic_fetch_add(&out_of_order, 1, __ATOMIC_SEQ_CST);
+		}
+		last[p] = seq;
+		__atomic_fetch_add(&seen[p * NUM_WORK + seq], 1, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&dequeued, 1, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+bool
+test_fifo(objpool *pool)
+{
+	q = pool ? queue_new_pool(pool) : queue_new();
+	seen = calloc(NUM_PRODUCERS * NUM_WORK, sizeof(uint8_t));
+	dequeued = 0;
+	out_of_order = 0;
+
+	for (uintptr_t i=0;i<NUM_CONSUMERS;i++) {
+		if (pthread_create(&consumers[i], NULL, consume, NULL) != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (uintptr_t i=0;i<NUM_PRODUCERS;i++) {
+		if (pthread_create(&producers[i], NULL, produce, (void *)i) != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_PRODUCERS;i++) {
+		pthread_join(producers[i], NULL);
+	}
+	for (int i=0;i<NUM_CONSUMERS;i++) {
+		pthread_join(consumers[i], NULL);
+	}
+
+	if (out_of_order) {
+		printf("test_fifo() is failing. %u values came out of order\n", out_of_order);
+		return false;
+	}
+	for (uint32_t i=0;i<NUM_PRODUCERS * NUM_WORK;i++) {
+		if (seen[i] != 1) {
+			printf("test_fifo() is failing. seen[%u]: %d\n", i, seen[i]);
+			return false;
+		}
+	}
+	if (queue_dequeue(q) || counter_read(&q->length) != 0) {
+		printf("test_fifo() is failing. The queue isn't empty\n");
+		return false;
+	}
+	free(seen);
+	queue_free(&q);
+	printf("Done. %u producers and %u consumers moved %u values%s\n", NUM_PRODUCERS, NUM_CONSUMERS, NUM_PRODUCERS * NUM_WORK, pool ? " through pooled nodes" : "");
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	free_later_init();
+	if (!test_fifo(NULL)) {
+		printf("Failed multi-threaded FIFO test.");
+	}
+
+	objpool *pool = objpool_new(sizeof(queue_node));
+	if (!test_fifo(pool)) {
+		printf("Failed multi-threaded pooled FIFO test.");
+	}
+	// nodes still waiting for free_later go back to the pool before it is released
+	free_later_term();
+	objpool_free_all(&pool);
+}
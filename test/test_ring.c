@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ring.h"
+
+// global rings
+ring *r = NULL;
+spsc_ring *sr = NULL;
+
+// how many threads push and how many pop on the MPMC ring
+#define NUM_PRODUCERS 4
+#define NUM_CONSUMERS 4
+// how many values each producer pushes
+#define NUM_WORK 100000
+// small, so that producers keep running into a full ring
+#define CAPACITY 64
+// most values moved by one `_many` call
+#define BATCH 8
+// state for the threads
+static pthread_t producers[NUM_PRODUCERS];
+static pthread_t consumers[NUM_CONSUMERS];
+
+// values are `producer << 32 | seq`, plus one so that none of them is NULL
+#define VAL(p, seq) ((void *)(((uintptr_t)(p) << 32 | (seq)) + 1))
+#define VAL_PRODUCER(v) (((uintptr_t)(v) - 1) >> 32)
+#define VAL_SEQ(v) (((uintptr_t)(v) - 1) & 0xffffffff)
+
+static uint8_t *seen = NULL;
+static volatile uint32_t popped = 0;
+static volatile uint32_t out_of_order = 0;
+
+/**
+ * Even producers push one value at a time, odd ones push batches
+ */
+void *
+produce(void *args)
+{
+	uintptr_t id = (uintptr_t)args;
+	void *vals[BATCH];
+	uint32_t j = 0;
+	while (j < NUM_WORK) {
+		if (id % 2 == 0) {
+			if (ring_push(r, VAL(id, j))) j++;
+			else sched_yield();
+			continue;
+		}
+		uint32_t n = 0;
+		for (; n < BATCH && j + n < NUM_WORK; n++) {
+			vals[n] = VAL(id, j + n);
+		}
+		uint32_t pushed = ring_push_many(r, vals, n);
+		if (!pushed) sched_yield();
+		j += pushed;
+	}
+	return NULL;
+}
+
+/**
+ * Pops until every value is out, checking that each producer's values come out in the
+ * order they went in
+ */
+void *
+consume(void *args)
+{
+	uintptr_t id = (uintptr_t)args;
+	int64_t last[NUM_PRODUCERS];
+	for (int i=0;i<NUM_PRODUCERS;i++) last[i] = -1;
+	void *vals[BATCH];
+	while (__atomic_load_n(&popped, __ATOMIC_SEQ_CST) < NUM_PRODUCERS * NUM_WORK) {
+		uint32_t n;
+		if (id % 2 == 0) {
+			vals[0] = ring_pop(r);
+			n = vals[0] ? 1 : 0;
+		}
+		else {
+			n = ring_pop_many(r, vals, BATCH);
+		}
+		if (!n) {
+			sched_yield();
+			continue;
+		}
+		for (uint32_t i=0;i<n;i++) {
+			uintptr_t p = VAL_PRODUCER(vals[i]);
+			int64_t seq = VAL_SEQ(vals[i]);
+			if (seq <= last[p]) {
+				__atomic_fetch_add(&out_of_order, 1, __ATOMIC_SEQ_CST);
+			}
+			last[p] = seq;
+			__atomic_fetch_add(&seen[p * NUM_WORK + seq], 1, __ATOMIC_SEQ_CST);
+		}
+		__atomic_fetch_add(&popped, n, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+bool
+test_mpmc(void)
+{
+	r = ring_new(CAPACITY);
+	seen = calloc(NUM_PRODUCERS * NUM_WORK, sizeof(uint8_t));
+	for (uintptr_t i=0;i<NUM_CONSUMERS;i++) {
+		if (pthread_create(&consumers[i], NULL, consume, (void *)i) != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (uintptr_t i=0;i<NUM_PRODUCERS;i++) {
+		if (pthread_create(&producers[i], NULL, produce, (void *)i) != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_PRODUCERS;i++) {
+		pthread_join(producers[i], NULL);
+	}
+	for (int i=0;i<NUM_CONSUMERS;i++) {
+		pthread_join(consumers[i], NULL);
+	}
+
+	if (out_of_order) {
+		printf("test_mpmc() is failing. %u values came out of order\n", out_of_order);
+		return false;
+	}
+	for (uint32_t i=0;i<NUM_PRODUCERS * NUM_WORK;i++) {
+		if (seen[i] != 1) {
+			printf("test_mpmc() is failing. seen[%u]: %d\n", i, seen[i]);
+			return false;
+		}
+	}
+	if (ring_pop(r)) {
+		printf("test_mpmc() is failing. The ring isn't empty\n");
+		return false;
+	}
+	free(seen);
+	ring_free(&r);
+	printf("Done. %u producers and %u consumers moved %u values through %u cells\n", NUM_PRODUCERS, NUM_CONSUMERS, NUM_PRODUCERS * NUM_WORK, CAPACITY);
+	return true;
+}
+
+static volatile uint32_t spsc_bad = 0;
+
+void *
+spsc_produce(void *args)
+{
+	void *vals[BATCH];
+	uint32_t j = 0;
+	while (j < NUM_WORK) {
+		// alternate between single values and batches
+		if (j % 2) {
+			if (spsc_ring_push(sr, VAL(0, j))) j++;
+			else sched_yield();
+			continue;
+		}
+		uint32_t n = 0;
+		for (; n < BATCH && j + n < NUM_WORK; n++) {
+			vals[n] = VAL(0, j + n);
+		}
+		uint32_t pushed = spsc_ring_push_many(sr, vals, n);
+		if (!pushed) sched_yield();
+		j += pushed;
+	}
+	return NULL;
+}
+
+void *
+spsc_consume(void *args)
+{
+	void *vals[BATCH];
+	uint32_t expected = 0;
+	while (expected < NUM_WORK) {
+		uint32_t n = spsc_ring_pop_many(sr, vals, expected % 3 + 1);
+		if (!n) {
+			sched_yield();
+			continue;
+		}
+		for (uint32_t i=0;i<n;i++) {
+			if (VAL_SEQ(vals[i]) != expected++) spsc_bad += 1;
+		}
+	}
+	return NULL;
+}
+
+bool
+test_spsc(void)
+{
+	sr = spsc_ring_new(CAPACITY);
+	pthread_create(&consumers[0], NULL, spsc_consume, NULL);
+	pthread_create(&producers[0], NULL, spsc_produce, NULL);
+	pthread_join(producers[0], NULL);
+	pthread_join(consumers[0], NULL);
+	if (spsc_bad) {
+		printf("test_spsc() is failing. %u values came out of order\n", spsc_bad);
+		return false;
+	}
+	if (spsc_ring_pop(sr)) {
+		printf("test_spsc() is failing. The ring isn't empty\n");
+		return false;
+	}
+	spsc_ring_free(&sr);
+	printf("Done. Moved %u values from one thread to another in order\n", NUM_WORK);
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	if (!test_mpmc()) {
+		printf("Failed multi-threaded MPMC test.");
+	}
+	if (!test_spsc()) {
+		printf("Failed SPSC test.");
+	}
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rwlock.h"
+#include "seqlock.h"
+
+// how many threads read and how many write
+#define NUM_READERS 4
+#define NUM_WRITERS 2
+// how many reads each reader does
+#define NUM_READS 200000
+// how many writes each writer does
+#define NUM_WRITES 2000
+// state for the threads
+static pthread_t readers[NUM_READERS];
+static pthread_t writers[NUM_WRITERS];
+
+// global locks
+static seqlock sl;
+static rwlock rl;
+
+// the writers keep every field equal, so a reader that sees them differ saw a torn write
+#define FIELDS 4
+static uint64_t data[FIELDS];
+static volatile uint32_t torn = 0;
+
+void *
+seq_write(void *args)
+{
+	for (uint32_t j=0;j<NUM_WRITES;j++) {
+		seqlock_write_begin(&sl);
+		uint64_t v = __atomic_load_n(&data[0], __ATOMIC_RELAXED) + 1;
+		for (int i=0;i<FIELDS;i++) {
+			__atomic_store_n(&data[i], v, __ATOMIC_RELAXED);
+		}
+		seqlock_write_end(&sl);
+	}
+	return NULL;
+}
+
+void *
+seq_read(void *args)
+{
+	uint64_t copy[FIELDS];
+	for (uint32_t j=0;j<NUM_READS;j++) {
+		uint32_t seq;
+		do {
+			seq = seqlock_read_begin(&sl);
+			for (int i=0;i<FIELDS;i++) {
+				copy[i] = __atomic_load_n(&data[i], __ATOMIC_RELAXED);
+			}
+		} while (seqlock_read_retry(&sl, seq));
+		for (int i=1;i<FIELDS;i++) {
+			if (copy[i] != copy[0]) {
+				__atomic_fetch_add(&torn, 1, __ATOMIC_SEQ_CST);
+			}
+		}
+	}
+	return NULL;
+}
+
+void *
+rw_write(void *args)
+{
+	for (uint32_t j=0;j<NUM_WRITES;j++) {
+		rwlock_write_acquire(&rl);
+		// plain accesses, which a broken lock lets race with the readers
+		for (int i=0;i<FIELDS;i++) {
+			data[i]++;
+		}
+		rwlock_write_release(&rl);
+	}
+	return NULL;
+}
+
+void *
+rw_read(void *args)
+{
+	for (uint32_t j=0;j<NUM_READS;j++) {
+		rwlock_read_acquire(&rl);
+		for (int i=1;i<FIELDS;i++) {
+			if (data[i] != data[0]) {
+				__atomic_fetch_add(&torn, 1, __ATOMIC_SEQ_CST);
+			}
+		}
+		rwlock_read_release(&rl);
+	}
+	return NULL;
+}
+
+bool
+test_locked(const char *name, void *(*read)(void *), void *(*write)(void *))
+{
+	for (int i=0;i<FIELDS;i++) data[i] = 0;
+	torn = 0;
+	for (uintptr_t i=0;i<NUM_READERS;i++) {
+		if (pthread_create(&readers[i], NULL, read, NULL) != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (uintptr_t i=0;i<NUM_WRITERS;i++) {
+		if (pthread_create(&writers[i], NULL, write, NULL) != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_READERS;i++) {
+		pthread_join(readers[i], NULL);
+	}
+	for (int i=0;i<NUM_WRITERS;i++) {
+		pthread_join(writers[i], NULL);
+	}
+
+	if (torn) {
+		printf("test_locked() is failing. %s: %u reads saw a torn write\n", name, torn);
+		return false;
+	}
+	// writers that overlap lose increments
+	if (data[0] != NUM_WRITERS * NUM_WRITES) {
+		printf("test_locked() is failing. %s: %lu of %u writes\n", name, data[0], NUM_WRITERS * NUM_WRITES);
+		return false;
+	}
+	printf("Done. %u readers read %u times and %u writers wrote %u times with the %s\n", NUM_READERS, NUM_READERS * NUM_READS, NUM_WRITERS, NUM_WRITERS * NUM_WRITES, name);
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	if (!test_locked("seqlock", seq_read, seq_write)) {
+		printf("Failed multi-threaded seqlock test.");
+	}
+	if (!test_locked("rwlock", rw_read, rw_write)) {
+		printf("Failed multi-threaded rwlock test.");
+	}
+}
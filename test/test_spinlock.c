@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "spinlock.h"
+
+// how many threads take the lock
+#define NUM_THREADS 4
+// how many times each thread takes it
+#define NUM_WORK 100000
+// fair locks that only spin hand over to a thread that may not be running when there
+// are more threads than cores, so they get fewer rounds
+#define NUM_WORK_FAIR 2000
+// state for the threads
+static pthread_t threads[NUM_THREADS];
+
+typedef enum {
+	SPIN,
+	SPIN_PARK,
+	TICKET,
+	MCS,
+	MCS_PARK,
+	MACRO,
+} lock_kind;
+
+static const char *names[] = {"spinlock", "parking spinlock", "ticketlock", "mcslock", "parking mcslock", "acquire_lock"};
+
+// global locks
+static spinlock sl;
+static ticketlock tl;
+static mcslock ml;
+static uint32_t macro_lock;
+
+// changed only while holding the lock, so a broken lock loses increments
+static uint64_t total = 0;
+// threads inside the lock at once, which must never be more than 1
+static volatile uint32_t inside = 0;
+static volatile uint32_t overlaps = 0;
+
+void *
+work(void *args)
+{
+	lock_kind kind = (lock_kind)(uintptr_t)args;
+	uint32_t rounds = kind == TICKET || kind == MCS ? NUM_WORK_FAIR : NUM_WORK;
+	mcslock_node node;
+	for (uint32_t j=0;j<rounds;j++) {
+		switch (kind) {
+		case SPIN: spinlock_acquire(&sl); break;
+		case SPIN_PARK: spinlock_acquire_park(&sl); break;
+		case TICKET: ticketlock_acquire(&tl); break;
+		case MCS: mcslock_acquire(&ml, &node); break;
+		case MCS_PARK: mcslock_acquire_park(&ml, &node); break;
+		case MACRO: acquire_lock(macro_lock); break;
+		}
+
+		if (__atomic_fetch_add(&inside, 1, __ATOMIC_SEQ_CST) != 0) {
+			__atomic_fetch_add(&overlaps, 1, __ATOMIC_SEQ_CST);
+		}
+		total++;
+		__atomic_fetch_sub(&inside, 1, __ATOMIC_SEQ_CST);
+
+		switch (kind) {
+		case SPIN:
+		case SPIN_PARK: spinlock_release(&sl); break;
+		case TICKET: ticketlock_release(&tl); break;
+		case MCS:
+		case MCS_PARK: mcslock_release(&ml, &node); break;
+		case MACRO: release_lock(macro_lock); break;
+		}
+	}
+	return NULL;
+}
+
+bool
+test_exclusive(lock_kind kind)
+{
+	total = 0;
+	overlaps = 0;
+	for (uintptr_t i=0;i<NUM_THREADS;i++) {
+		if (pthread_create(&threads[i], NULL, work, (void *)(uintptr_t)kind) != 0) {
+			printf("Failed to create thread %lu\n", i);
+			exit(1);
+		}
+	}
+	for (int i=0;i<NUM_THREADS;i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	uint32_t rounds = kind == TICKET || kind == MCS ? NUM_WORK_FAIR : NUM_WORK;
+	if (overlaps || total != NUM_THREADS * rounds) {
+		printf("test_exclusive() is failing. %s: total %lu, %u overlaps\n", names[kind], total, overlaps);
+		return false;
+	}
+	printf("Done. %u threads took the %s %u times\n", NUM_THREADS, names[kind], NUM_THREADS * rounds);
+	return true;
+}
+
+/**
+ * `_try` takes a free lock and fails on a held one
+ */
+bool
+test_try()
+{
+	mcslock_node a, b;
+	if (!spinlock_try(&sl) || spinlock_try(&sl)) {
+		printf("test_try() is failing. spinlock\n");
+		return false;
+	}
+	spinlock_release(&sl);
+	if (!ticketlock_try(&tl) || ticketlock_try(&tl)) {
+		printf("test_try() is failing. ticketlock\n");
+		return false;
+	}
+	ticketlock_release(&tl);
+	if (!mcslock_try(&ml, &a) || mcslock_try(&ml, &b)) {
+		printf("test_try() is failing. mcslock\n");
+		return false;
+	}
+	mcslock_release(&ml, &a);
+	if (!spinlock_try(&sl) || !ticketlock_try(&tl) || !mcslock_try(&ml, &b)) {
+		printf("test_try() is failing. A released lock can't be taken again\n");
+		return false;
+	}
+	spinlock_release(&sl);
+	ticketlock_release(&tl);
+	mcslock_release(&ml, &b);
+	printf("Done. try\n");
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	for (lock_kind kind=SPIN;kind<=MACRO;kind++) {
+		if (!test_exclusive(kind)) {
+			printf("Failed multi-threaded %s test.", names[kind]);
+		}
+	}
+	if (!test_try()) {
+		printf("Failed try test.");
+	}
+}